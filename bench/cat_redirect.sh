@@ -0,0 +1,28 @@
+#!/bin/bash
+# Times `cat FILE > out` in the builtin cat with the io_uring engine and
+# with the blocking one (PIPE_SHELL_IO=blocking).
+# usage: bench/cat_redirect.sh [copies of war_and_peace.txt, default 1] [runs, default 20]
+cd "$(dirname "$0")/.." || exit 1
+copies=${1:-1}
+runs=${2:-20}
+input=./test_files/war_and_peace.txt
+out=${TMPDIR:-/tmp}/cat_redirect.out
+
+if [ "$copies" -gt 1 ]; then
+    input=${TMPDIR:-/tmp}/cat_redirect_corpus.txt
+    if [ ! -f "$input" ]; then
+        for i in $(seq "$copies"); do cat ./test_files/war_and_peace.txt; done > "$input"
+    fi
+fi
+make -s pipe_shell || exit 1
+
+size=$(stat -c %s "$input")
+script=$(for i in $(seq "$runs"); do echo "cat $input > $out"; done)
+for engine in io_uring blocking; do
+    start=$(date +%s.%N)
+    echo "$script" | PIPE_SHELL_IO=$engine ./pipe_shell > /dev/null
+    end=$(date +%s.%N)
+    awk -v s="$size" -v n="$runs" -v t0="$start" -v t1="$end" -v e="$engine" \
+        'BEGIN { printf "%-9s %.0f MB/s\n", e, s * n / (t1 - t0) / 1048576 }'
+done
+rm -f "$out"
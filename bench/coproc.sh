@@ -0,0 +1,46 @@
+#!/bin/bash
+# Times running a Python filter on each of 200 command lines started anew
+# every time against sending the lines through it as a coprocess, started
+# once with `coproc` and reached with `@NAME`.  The filter upper-cases its
+# input; with --framed it speaks the length-prefixed protocol instead.
+# usage: bench/coproc.sh [command lines, default 200]
+cd "$(dirname "$0")/.." || exit 1
+count=${1:-200}
+dir=${TMPDIR:-/tmp}
+make -s pipe_shell || exit 1
+
+filter=$dir/coproc_bench_filter.py
+cat > "$filter" <<'EOF'
+import sys
+inp, out = sys.stdin.buffer, sys.stdout.buffer
+if sys.argv[1:] != ["--framed"]:
+    out.write(inp.read().upper())
+    sys.exit()
+while True:
+    prefix = inp.readline()
+    if not prefix:
+        break
+    data = inp.read(int(prefix)).upper()
+    out.write(b"%d\n" % len(data) + data)
+    out.flush()
+EOF
+
+time_it() {
+    local name=$1 script=$2
+    local start end
+    start=$(date +%s.%N)
+    ./pipe_shell <<< "$script" > /dev/null
+    end=$(date +%s.%N)
+    awk -v n="$count" -v t0="$start" -v t1="$end" -v name="$name" \
+        'BEGIN { printf "%-22s %7.3f s  %8.1f us each\n", name, t1 - t0, (t1 - t0) * 1e6 / n }'
+}
+
+line="head -n 10 ./test_files/war_and_peace.txt"
+time_it "started every line" "$(for i in $(seq "$count"); do
+    echo "$line | python3 $filter"
+done)"
+time_it "coprocess" "$(echo "coproc up python3 $filter --framed"
+for i in $(seq "$count"); do
+    echo "$line | @up"
+done)"
+rm -f "$filter"
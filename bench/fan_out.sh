@@ -0,0 +1,34 @@
+#!/bin/bash
+# Times feeding one trunk's output to three branches with a fan-out,
+# `TRUNK |{ A ; B ; C }`, against running the trunk once per branch, on
+# war_and_peace.txt copied 20 times (about 64 MB).  The trunk is an
+# external grep, so running it again costs what it would in practice.
+# usage: bench/fan_out.sh [repetitions, default 5]
+cd "$(dirname "$0")/.." || exit 1
+count=${1:-5}
+dir=${TMPDIR:-/tmp}
+make -s pipe_shell || exit 1
+
+big=$dir/fan_out_bench.txt
+for i in $(seq 20); do cat ./test_files/war_and_peace.txt; done > "$big"
+
+time_it() {
+    local name=$1 script=$2
+    local start end
+    start=$(date +%s.%N)
+    ./pipe_shell <<< "$script" > /dev/null
+    end=$(date +%s.%N)
+    awk -v n="$count" -v t0="$start" -v t1="$end" -v name="$name" \
+        'BEGIN { printf "%-22s %7.3f s  %8.1f ms each\n", name, t1 - t0, (t1 - t0) * 1e3 / n }'
+}
+
+trunk="/bin/grep -i e $big"
+time_it "trunk once per branch" "$(for i in $(seq "$count"); do
+    echo "$trunk | wc -l"
+    echo "$trunk | grep -c peace"
+    echo "$trunk | /usr/bin/tr a-z A-Z | wc -c"
+done)"
+time_it "fan-out" "$(for i in $(seq "$count"); do
+    echo "$trunk |{ wc -l ; grep -c peace ; /usr/bin/tr a-z A-Z | wc -c }"
+done)"
+rm -f "$big"
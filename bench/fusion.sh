@@ -0,0 +1,33 @@
+#!/bin/bash
+# Times all-builtin pipelines fused into one pass against the same
+# pipelines run stage by stage (PIPE_SHELL_FUSE=0) and run by bash, one
+# process per stage.
+# usage: bench/fusion.sh [copies of war_and_peace.txt, default 50 (~150MB)]
+cd "$(dirname "$0")/.." || exit 1
+copies=${1:-50}
+corpus=${TMPDIR:-/tmp}/fusion_corpus.txt
+
+if [ ! -f "$corpus" ]; then
+    for i in $(seq "$copies"); do cat ./test_files/war_and_peace.txt; done > "$corpus"
+fi
+make -s pipe_shell || exit 1
+
+# Seconds taken by running "$@".
+seconds() {
+    local start end
+    start=$(date +%s.%N)
+    "$@" > /dev/null
+    end=$(date +%s.%N)
+    awk -v t0="$start" -v t1="$end" 'BEGIN { printf "%.3f", t1 - t0 }'
+}
+
+printf '%-10s %-10s %-10s %s\n' fused unfused bash pipeline
+for cmd in "cat $corpus | grep a | grep b | wc -l" \
+           "cat $corpus | grep -i war | grep -v peace | tail -5" \
+           "cat $corpus | grep the | head -1000 | wc -w" \
+           "cat $corpus | wc -l"; do
+    fused=$(seconds sh -c "echo '$cmd' | ./pipe_shell")
+    unfused=$(seconds sh -c "echo '$cmd' | PIPE_SHELL_FUSE=0 ./pipe_shell")
+    processes=$(seconds bash -c "$cmd")
+    printf '%-10s %-10s %-10s %s\n' "$fused" "$unfused" "$processes" "$cmd"
+done
@@ -0,0 +1,24 @@
+#!/bin/bash
+# Times the builtin grep over a generated corpus with 1, 2, 4, ... cores.
+# usage: bench/grep_scaling.sh [copies of war_and_peace.txt, default 300 (~1GB)]
+cd "$(dirname "$0")/.." || exit 1
+copies=${1:-300}
+corpus=${TMPDIR:-/tmp}/grep_corpus.txt
+
+if [ ! -f "$corpus" ]; then
+    for i in $(seq "$copies"); do cat ./test_files/war_and_peace.txt; done > "$corpus"
+fi
+make -s pipe_shell || exit 1
+
+size=$(stat -c %s "$corpus")
+cores=1
+while [ "$cores" -le "$(nproc)" ]; do
+    for cmd in "grep -c -i peace $corpus" "grep -i war $corpus | grep -i peace | wc -l"; do
+        start=$(date +%s.%N)
+        echo "$cmd" | taskset -c 0-$((cores - 1)) ./pipe_shell > /dev/null
+        end=$(date +%s.%N)
+        awk -v s="$size" -v t0="$start" -v t1="$end" -v c="$cores" -v cmd="$cmd" \
+            'BEGIN { printf "%d core(s): %s: %.0f MB/s\n", c, cmd, s / (t1 - t0) / 1048576 }'
+    done
+    cores=$((cores * 2))
+done
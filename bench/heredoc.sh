@@ -0,0 +1,41 @@
+#!/bin/bash
+# Times delivering here-documents of 1 KB, 1 MB and 100 MB to `wc -c`
+# through a sealed memfd and through a temporary file on disk
+# (PIPE_SHELL_HEREDOC=tmpfile, in $TMPDIR or /tmp).  Reading the body
+# from the script costs the same either way; it is measured on its own
+# with `explain`, which reads the body but runs nothing, and taken off.
+# usage: bench/heredoc.sh
+cd "$(dirname "$0")/.." || exit 1
+dir=${TMPDIR:-/tmp}
+make -s pipe_shell || exit 1
+
+seconds() {
+    local start end
+    start=$(date +%s.%N)
+    PIPE_SHELL_HEREDOC=$1 ./pipe_shell < "$2" > /dev/null
+    end=$(date +%s.%N)
+    awk -v t0="$start" -v t1="$end" 'BEGIN { print t1 - t0 }'
+}
+
+for spec in 1024:1000 1048576:50 104857600:3; do
+    size=${spec%:*}
+    n=${spec#*:}
+    body=$dir/heredoc_body.txt
+    # Lines of 63 characters and a newline.
+    head -c "$size" /dev/zero | tr '\0' 'x' | fold -w 63 | head -c "$size" > "$body"
+    for cmd in "explain wc -c" "wc -c"; do
+        for i in $(seq "$n"); do
+            echo "$cmd <<EOF"
+            cat "$body"
+            echo
+            echo "EOF"
+        done > "$dir/heredoc_bench_${cmd%% *}.txt"
+    done
+    base=$(seconds memfd "$dir/heredoc_bench_explain.txt")
+    for mode in memfd tmpfile; do
+        total=$(seconds $mode "$dir/heredoc_bench_wc.txt")
+        awk -v s="$size" -v n="$n" -v t="$total" -v b="$base" -v m="$mode" \
+            'BEGIN { printf "%10d bytes  %-8s %9.1f us each\n", s, m, (t - b) * 1e6 / n }'
+    done
+    rm -f "$body" "$dir"/heredoc_bench_*.txt
+done
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Times counting the lines three greps match over war_and_peace.txt copied
+# 20 times (about 64 MB) by running them one after another into the
+# consumer, `{ A ; B ; C }`-style through a temporary file, against merging
+# them with `merge { A ; B ; C } | wc -l`, which runs them at once.  The
+# greps are CPU-bound, so merging only wins with a core for each.
+# usage: bench/merge.sh [repetitions, default 5]
+cd "$(dirname "$0")/.." || exit 1
+count=${1:-5}
+dir=${TMPDIR:-/tmp}
+make -s pipe_shell || exit 1
+
+big=$dir/merge_bench.txt
+for i in $(seq 20); do cat ./test_files/war_and_peace.txt; done > "$big"
+
+time_it() {
+    local name=$1 script=$2
+    local start end
+    start=$(date +%s.%N)
+    ./pipe_shell <<< "$script" > /dev/null
+    end=$(date +%s.%N)
+    awk -v n="$count" -v t0="$start" -v t1="$end" -v name="$name" \
+        'BEGIN { printf "%-22s %7.3f s  %8.1f ms each\n", name, t1 - t0, (t1 - t0) * 1e3 / n }'
+}
+
+a="/bin/grep -i war $big"
+b="/bin/grep -i peace $big"
+c="/bin/grep -i prince $big"
+time_it "one after another" "$(for i in $(seq "$count"); do
+    echo "$a > $dir/merge_bench.out"
+    echo "$b >> $dir/merge_bench.out"
+    echo "$c >> $dir/merge_bench.out"
+    echo "wc -l $dir/merge_bench.out"
+done)"
+time_it "merge, interleaved" "$(for i in $(seq "$count"); do
+    echo "merge { $a ; $b ; $c } | wc -l"
+done)"
+time_it "merge -o, in order" "$(for i in $(seq "$count"); do
+    echo "merge -o { $a ; $b ; $c } | wc -l"
+done)"
+rm -f "$big" "$dir/merge_bench.out"
@@ -0,0 +1,33 @@
+#!/bin/bash
+# Times `cat BIG | grep -i communism | wc -lw` with the grep run as one
+# stage and as replicated stages, `grep -i communism &N`, on
+# mutual_aid.txt copied 100 times (about 70 MB).  The builtin grep and
+# the external one are timed separately: the external one is started
+# once per 8 MB chunk.  Replicas only help with a core for each.
+# usage: bench/replicate.sh [repetitions, default 5]
+cd "$(dirname "$0")/.." || exit 1
+count=${1:-5}
+dir=${TMPDIR:-/tmp}
+make -s pipe_shell || exit 1
+
+big=$dir/replicate_bench.txt
+for i in $(seq 100); do cat ./test_files/mutual_aid.txt; done > "$big"
+
+time_it() {
+    local name=$1 script=$2
+    local start end
+    start=$(date +%s.%N)
+    ./pipe_shell <<< "$script" > /dev/null
+    end=$(date +%s.%N)
+    awk -v n="$count" -v t0="$start" -v t1="$end" -v name="$name" \
+        'BEGIN { printf "%-22s %7.3f s  %8.1f ms each\n", name, t1 - t0, (t1 - t0) * 1e3 / n }'
+}
+
+for grep in grep /bin/grep; do
+    for copies in "" " &2" " &4" " &$(nproc)"; do
+        time_it "$grep${copies}" "$(for i in $(seq "$count"); do
+            echo "cat $big | $grep -i communism$copies | wc -lw"
+        done)"
+    done
+done
+rm -f "$big"
@@ -0,0 +1,35 @@
+#!/bin/bash
+# Times sorting the words of war_and_peace.txt, one per line, replicated
+# to about 1 GB: the builtin sort against the system's, each given the
+# file and reading it from a pipe.  The locale is C for both, which
+# compare bytes alike.  -S sets both sorts' memory budget; past it they
+# spill sorted runs to $TMPDIR and merge them.
+# usage: bench/sort.sh [MB, default 1024] [budget, default 256M]
+cd "$(dirname "$0")/.." || exit 1
+mb=${1:-1024}
+budget=${2:-256M}
+dir=${TMPDIR:-/tmp}
+make -s pipe_shell || exit 1
+export LC_ALL=C
+
+words=$dir/sort_bench_words.txt
+big=$dir/sort_bench.txt
+tr -cs "A-Za-z'" '\n' < ./test_files/war_and_peace.txt > "$words"
+: > "$big"
+while [ "$(stat -c %s "$big")" -lt $((mb << 20)) ]; do cat "$words"; done >> "$big"
+
+time_it() {
+    local name=$1 script=$2
+    local start end
+    start=$(date +%s.%N)
+    ./pipe_shell <<< "$script" > /dev/null
+    end=$(date +%s.%N)
+    awk -v t0="$start" -v t1="$end" -v name="$name" \
+        'BEGIN { printf "%-22s %7.3f s\n", name, t1 - t0 }'
+}
+
+time_it "system sort, file" "/usr/bin/sort -S $budget $big > /dev/null"
+time_it "builtin sort, file" "sort -S $budget $big > /dev/null"
+time_it "system sort, pipe" "cat $big | /usr/bin/sort -S $budget > /dev/null"
+time_it "builtin sort, pipe" "cat $big | sort -S $budget > /dev/null"
+rm -f "$words" "$big"
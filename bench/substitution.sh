@@ -0,0 +1,25 @@
+#!/bin/bash
+# Times 10k command substitutions in pipe_shell against the same loop in
+# bash: a builtin one, which pipe_shell runs without forking, and one of
+# an external command.
+# usage: bench/substitution.sh [substitutions, default 10000]
+cd "$(dirname "$0")/.." || exit 1
+count=${1:-10000}
+make -s pipe_shell || exit 1
+
+time_it() {
+    local name=$1
+    shift
+    local start end
+    start=$(date +%s.%N)
+    "$@" > /dev/null
+    end=$(date +%s.%N)
+    awk -v n="$count" -v t0="$start" -v t1="$end" -v name="$name" \
+        'BEGIN { printf "%-28s %7.3f s  %6.1f us each\n", name, t1 - t0, (t1 - t0) * 1e6 / n }'
+}
+
+for cmd in "echo x" "/bin/echo x"; do
+    script=$(for i in $(seq "$count"); do echo "echo \$($cmd)"; done)
+    time_it "pipe_shell \$($cmd)" ./pipe_shell <<< "$script"
+    time_it "bash \$($cmd)" bash -c "for i in \$(seq $count); do echo \$($cmd); done"
+done
@@ -0,0 +1,23 @@
+#!/bin/bash
+# Times 100k short jobs, one argument each, through the builtin xargs and
+# through the system's, both running eight at a time: `seq N | xargs -n 1
+# -P 8 CMD`.  CMD is /bin/true, started with posix_spawn() per job, and
+# the builtin true, which the builtin xargs runs on a thread instead.
+# usage: bench/xargs.sh [jobs, default 100000]
+cd "$(dirname "$0")/.." || exit 1
+count=${1:-100000}
+make -s pipe_shell || exit 1
+
+time_it() {
+    local name=$1 script=$2
+    local start end
+    start=$(date +%s.%N)
+    ./pipe_shell <<< "$script" > /dev/null
+    end=$(date +%s.%N)
+    awk -v n="$count" -v t0="$start" -v t1="$end" -v name="$name" \
+        'BEGIN { printf "%-22s %7.3f s  %8.1f us each\n", name, t1 - t0, (t1 - t0) * 1e6 / n }'
+}
+
+time_it "system xargs" "seq $count | /usr/bin/xargs -n 1 -P 8 /bin/true"
+time_it "builtin xargs" "seq $count | xargs -n 1 -P 8 /bin/true"
+time_it "builtin xargs, true" "seq $count | xargs -n 1 -P 8 true"
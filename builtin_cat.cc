@@ -0,0 +1,95 @@
+#include "builtins.h"
+
+#include <unistd.h>  // for close()
+#include <fcntl.h>   // for open()
+
+#include <cerrno>
+#include <cstdlib>  // for EXIT_SUCCESS, EXIT_FAILURE
+#include <cstring>  // for strerror()
+#include <iostream>
+
+#include "io_engine.h"
+
+using std::endl;
+using std::string;
+using std::vector;
+
+static const size_t kCopySize = 128 * 1024;
+
+bool cat_accepts(const vector<string>& args) {
+    bool options = true;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (options && args[i] == "--") {
+            options = false;
+        } else if (options && args[i].size() > 1 && args[i][0] == '-') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Copies src's input to its output.  Returns false if the output went away.
+static bool copy_input(const StageIO& src, const string& name, bool& trouble) {
+    if (src.in_ring == nullptr && src.out_ring == nullptr && src.capture == nullptr) {
+        // Descriptors on both sides: let the I/O engine move the data.
+        copy_status status = copy_fd(src.in, src.out);
+        if (status == kCopyReadError) {
+            stage_err(src) << "cat: " << name << ": " << strerror(errno) << endl;
+            trouble = true;
+        }
+        return status != kCopyWriteError;
+    }
+    static thread_local char buf[kCopySize];
+    while (true) {
+        ssize_t n = stage_read(src, buf, sizeof(buf));
+        if (n < 0) {
+            stage_err(src) << "cat: " << name << ": " << strerror(errno) << endl;
+            trouble = true;
+            return true;
+        }
+        if (n == 0) {
+            return true;
+        }
+        if (!stage_write(src, buf, n)) {
+            return false;
+        }
+    }
+}
+
+int builtin_cat(const vector<string>& args, StageIO& io) {
+    vector<string> files;
+    bool options = true;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (options && args[i] == "--") {
+            options = false;
+        } else {
+            files.push_back(args[i]);
+        }
+    }
+    if (files.empty()) {
+        files.push_back("-");
+    }
+
+    bool trouble = false;
+    for (const auto& file : files) {
+        if (file == "-") {
+            if (!copy_input(io, "-", trouble)) {
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+        int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            stage_err(io) << "cat: " << file << ": " << strerror(errno) << endl;
+            trouble = true;
+            continue;
+        }
+        StageIO file_io = {fd, io.out, nullptr, io.out_ring, io.capture, io.err};
+        bool keep_going = copy_input(file_io, file, trouble);
+        close(fd);
+        if (!keep_going) {
+            return EXIT_FAILURE;
+        }
+    }
+    return trouble ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,304 @@
+#include "builtins.h"
+
+#include <cerrno>
+#include <cstdio>   // for snprintf()
+#include <cstdlib>  // for strtoll(), strtoull(), strtold()
+#include <cctype>   // for isdigit()
+#include <cstring>  // for strchr(), strerror()
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::endl;
+using std::string;
+using std::vector;
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Expands the backslash escape starting at s[i] (the character after the
+// backslash) onto out and returns the index just past it.  Sets stop on
+// \c, which suppresses all further output.  echo-style octal escapes
+// need a leading 0 (\0nnn), printf-style ones don't (\nnn).
+static size_t expand_escape(const string& s, size_t i, bool echo_octal,
+                            string& out, bool& stop) {
+    if (i == s.size()) {
+        out += '\\';
+        return i;
+    }
+    char c = s[i++];
+    switch (c) {
+        case '\\': out += '\\'; return i;
+        case 'a': out += '\a'; return i;
+        case 'b': out += '\b'; return i;
+        case 'e': out += '\x1b'; return i;
+        case 'f': out += '\f'; return i;
+        case 'n': out += '\n'; return i;
+        case 'r': out += '\r'; return i;
+        case 't': out += '\t'; return i;
+        case 'v': out += '\v'; return i;
+        case 'c': stop = true; return i;
+        case 'x': {
+            int value = 0;
+            size_t start = i;
+            while (i < s.size() && i - start < 2 && hex_value(s[i]) >= 0) {
+                value = value * 16 + hex_value(s[i++]);
+            }
+            if (i == start) {
+                out += "\\x";
+            } else {
+                out += static_cast<char>(value);
+            }
+            return i;
+        }
+        default:
+            break;
+    }
+
+    if (c >= '0' && c <= '7' && (!echo_octal || c == '0')) {
+        int value = echo_octal ? 0 : c - '0';
+        size_t start = i;
+        while (i < s.size() && i - start < (echo_octal ? 3u : 2u) &&
+               s[i] >= '0' && s[i] <= '7') {
+            value = value * 8 + (s[i++] - '0');
+        }
+        out += static_cast<char>(value);
+        return i;
+    }
+
+    out += '\\';
+    out += c;
+    return i;
+}
+
+int builtin_echo(const vector<string>& args, StageIO& io) {
+    bool newline = true;
+    bool escapes = false;
+    size_t i = 1;
+    // Like coreutils, an argument is only an option if every letter of it is.
+    for (; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (arg.size() < 2 || arg[0] != '-' || arg.find_first_not_of("neE", 1) != string::npos) {
+            break;
+        }
+        for (size_t j = 1; j < arg.size(); j++) {
+            if (arg[j] == 'n') {
+                newline = false;
+            } else {
+                escapes = arg[j] == 'e';
+            }
+        }
+    }
+
+    string out;
+    bool stop = false;
+    for (size_t first = i; i < args.size() && !stop; i++) {
+        if (i != first) {
+            out += ' ';
+        }
+        if (!escapes) {
+            out += args[i];
+            continue;
+        }
+        const string& arg = args[i];
+        for (size_t j = 0; j < arg.size() && !stop;) {
+            if (arg[j] == '\\') {
+                j = expand_escape(arg, j + 1, true, out, stop);
+            } else {
+                out += arg[j++];
+            }
+        }
+    }
+    if (newline && !stop) {
+        out += '\n';
+    }
+    return stage_write(io, out.data(), out.size()) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Converts a printf numeric argument, accepting 'c and "c for the value of
+// the character c.  Complains (and flags failure) like coreutils on junk.
+template <typename T>
+static T numeric_arg(const StageIO& io, const string& arg, T (*convert)(const char*, char**),
+                     bool& failed) {
+    if (arg.size() >= 2 && (arg[0] == '\'' || arg[0] == '"')) {
+        return static_cast<unsigned char>(arg[1]);
+    }
+    if (arg.empty()) {
+        return 0;
+    }
+    char* end;
+    errno = 0;
+    T value = convert(arg.c_str(), &end);
+    if (end == arg.c_str() || *end != '\0') {
+        stage_err(io) << "printf: '" << arg << "': expected a numeric value" << endl;
+        failed = true;
+    } else if (errno == ERANGE) {
+        stage_err(io) << "printf: '" << arg << "': " << strerror(errno) << endl;
+        failed = true;
+    }
+    return value;
+}
+
+static long long to_ll(const char* s, char** end) { return strtoll(s, end, 0); }
+static unsigned long long to_ull(const char* s, char** end) { return strtoull(s, end, 0); }
+static long double to_ld(const char* s, char** end) { return strtold(s, end); }
+
+// %q: quotes s so that a shell would read it back as one word.
+static string shell_quote(const string& s) {
+    if (s.empty()) {
+        return "''";
+    }
+    if (s.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                            "0123456789_-+=./:,@%^") == string::npos) {
+        return s;
+    }
+    string quoted = "'";
+    for (char c : s) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "'";
+}
+
+// Formats one value with a printf conversion spec and appends it to out.
+template <typename T>
+static void append_formatted(string& out, const string& spec, T value) {
+    char small[128];
+    int n = snprintf(small, sizeof(small), spec.c_str(), value);
+    if (n < 0) {
+        return;
+    }
+    if (static_cast<size_t>(n) < sizeof(small)) {
+        out.append(small, n);
+        return;
+    }
+    vector<char> big(n + 1);
+    snprintf(big.data(), big.size(), spec.c_str(), value);
+    out.append(big.data(), n);
+}
+
+int builtin_printf(const vector<string>& args, StageIO& io) {
+    if (args.size() < 2) {
+        stage_err(io) << "printf: missing operand" << endl;
+        return EXIT_FAILURE;
+    }
+    const string& fmt = args[1];
+    size_t next = 2;
+    bool failed = false;
+    bool stop = false;
+    string out;
+
+    // The format is reused for as long as it keeps consuming arguments.
+    do {
+        size_t round_start = next;
+        for (size_t i = 0; i < fmt.size() && !stop;) {
+            char c = fmt[i];
+            if (c == '\\') {
+                i = expand_escape(fmt, i + 1, false, out, stop);
+                continue;
+            }
+            if (c != '%') {
+                out += c;
+                i++;
+                continue;
+            }
+            if (i + 1 < fmt.size() && fmt[i + 1] == '%') {
+                out += '%';
+                i += 2;
+                continue;
+            }
+
+            // Collect "%[flags][width][.precision]" into spec, expanding '*'.
+            string spec = "%";
+            i++;
+            while (i < fmt.size() && strchr("-+ #0'", fmt[i]) != nullptr) {
+                spec += fmt[i++];
+            }
+            for (int part = 0; part < 2; part++) {
+                if (part == 1) {
+                    if (i >= fmt.size() || fmt[i] != '.') {
+                        break;
+                    }
+                    spec += fmt[i++];
+                }
+                if (i < fmt.size() && fmt[i] == '*') {
+                    string arg = next < args.size() ? args[next++] : "";
+                    spec += std::to_string(numeric_arg<long long>(io, arg, to_ll, failed));
+                    i++;
+                }
+                while (i < fmt.size() && isdigit(static_cast<unsigned char>(fmt[i]))) {
+                    spec += fmt[i++];
+                }
+            }
+            while (i < fmt.size() && strchr("hlLjzt", fmt[i]) != nullptr) {
+                i++;
+            }
+            if (i == fmt.size()) {
+                stage_err(io) << "printf: " << fmt << ": invalid conversion specification" << endl;
+                return EXIT_FAILURE;
+            }
+
+            char conv = fmt[i++];
+            string arg = next < args.size() ? args[next++] : "";
+            switch (conv) {
+                case 's':
+                    append_formatted(out, spec + 's', arg.c_str());
+                    break;
+                case 'b': {
+                    string expanded;
+                    for (size_t j = 0; j < arg.size() && !stop;) {
+                        if (arg[j] == '\\') {
+                            j = expand_escape(arg, j + 1, true, expanded, stop);
+                        } else {
+                            expanded += arg[j++];
+                        }
+                    }
+                    append_formatted(out, spec + 's', expanded.c_str());
+                    break;
+                }
+                case 'c':
+                    append_formatted(out, spec + 'c', arg.empty() ? 0 : arg[0]);
+                    break;
+                case 'q':
+                    append_formatted(out, spec + 's', shell_quote(arg).c_str());
+                    break;
+                case 'd':
+                case 'i':
+                    append_formatted(out, spec + "ll" + conv,
+                                     numeric_arg<long long>(io, arg, to_ll, failed));
+                    break;
+                case 'o':
+                case 'u':
+                case 'x':
+                case 'X':
+                    append_formatted(out, spec + "ll" + conv,
+                                     numeric_arg<unsigned long long>(io, arg, to_ull, failed));
+                    break;
+                case 'a': case 'A': case 'e': case 'E':
+                case 'f': case 'F': case 'g': case 'G':
+                    append_formatted(out, spec + 'L' + conv,
+                                     numeric_arg<long double>(io, arg, to_ld, failed));
+                    break;
+                default:
+                    stage_err(io) << "printf: %" << conv << ": invalid conversion specification"
+                                  << endl;
+                    return EXIT_FAILURE;
+            }
+        }
+        if (next == round_start) {
+            break;
+        }
+    } while (next < args.size() && !stop);
+
+    if (!stage_write(io, out.data(), out.size())) {
+        return EXIT_FAILURE;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,448 @@
+#include "builtins.h"
+
+#include <unistd.h>    // for lseek(), close()
+#include <fcntl.h>     // for open()
+#include <sys/mman.h>  // for madvise()
+#include <sys/stat.h>  // for fstat()
+
+#include <algorithm>
+#include <cerrno>
+#include <clocale>  // for setlocale()
+#include <cstdint>
+#include <cstring>  // for memchr(), strerror()
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "file_map.h"
+#include "grep_matcher.h"
+#include "task_pool.h"
+
+using std::endl;
+using std::string;
+using std::vector;
+
+// grep's exit status when something went wrong (unreadable file).
+static const int kGrepTrouble = 2;
+
+// One bit per filter in the hit masks below.
+static const size_t kMaxFilters = 64;
+
+static const size_t kReadSize = 128 * 1024;
+static const size_t kFlushSize = 64 * 1024;
+
+// Regular files at least this big are mapped and searched in parallel, in
+// chunks of at least kMinChunk bytes.  Chunks are handed to the task pool
+// a window at a time, so only one window of output is ever buffered.
+static const size_t kParallelMin = 1 << 20;
+static const size_t kMinChunk = 256 * 1024;
+static const size_t kChunksPerWorker = 4;
+
+// Characters that make a basic regular expression more than a literal.
+static const char* const kRegexChars = "\\.[]*^$";
+
+// Whether the shell's characters are bytes.  In a multibyte locale grep
+// folds case beyond ASCII and takes invalid characters for binary data,
+// which only the real grep does.
+static bool byte_ctype() {
+    const char* ctype = setlocale(LC_CTYPE, nullptr);
+    string name = ctype != nullptr ? ctype : "C";
+    return name == "C" || name == "POSIX";
+}
+
+bool parse_grep(const vector<string>& args, grep_command& cmd) {
+    if (!byte_ctype()) {
+        return false;
+    }
+    bool chain = args[0] == "grep-chain";
+    bool fixed = chain;
+    bool ignore_case = false;
+    bool invert = false;
+    bool have_pattern = false;
+    bool no_more_options = false;
+    vector<string> operands;
+
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (no_more_options || arg.size() < 2 || arg[0] != '-') {
+            operands.push_back(arg);
+            continue;
+        }
+        if (arg == "--") {
+            no_more_options = true;
+            continue;
+        }
+        for (size_t j = 1; j < arg.size(); j++) {
+            switch (arg[j]) {
+                case 'i':
+                case 'y': ignore_case = true; break;
+                case 'v': invert = true; break;
+                case 'c': cmd.count = true; break;
+                case 'F': fixed = true; break;
+                case 'e': {
+                    // The rest of this argument, or the next one, is a pattern.
+                    string pattern = arg.substr(j + 1);
+                    if (pattern.empty()) {
+                        if (i + 1 == args.size()) {
+                            return false;
+                        }
+                        pattern = args[++i];
+                    }
+                    if (have_pattern && !chain) {
+                        return false;
+                    }
+                    cmd.filters.push_back({pattern, ignore_case, invert});
+                    have_pattern = true;
+                    if (chain) {
+                        ignore_case = invert = false;
+                    }
+                    j = arg.size();
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+    }
+
+    if (!have_pattern) {
+        if (chain || operands.empty()) {
+            return false;
+        }
+        cmd.filters.push_back({operands[0], ignore_case, invert});
+        operands.erase(operands.begin());
+    } else if (!chain) {
+        cmd.filters.back().ignore_case = ignore_case;
+        cmd.filters.back().invert = invert;
+    }
+    cmd.files = operands;
+
+    if (cmd.filters.size() > kMaxFilters) {
+        return false;
+    }
+    for (const auto& f : cmd.filters) {
+        if (f.pattern.find('\n') != string::npos) {
+            return false;
+        }
+        if (!fixed && f.pattern.find_first_of(kRegexChars) != string::npos) {
+            return false;
+        }
+    }
+    return true;
+}
+
+vector<string> grep_chain_args(const grep_command& cmd) {
+    vector<string> args = {"grep-chain"};
+    if (cmd.count) {
+        args.push_back("-c");
+    }
+    for (const auto& f : cmd.filters) {
+        if (f.ignore_case) {
+            args.push_back("-i");
+        }
+        if (f.invert) {
+            args.push_back("-v");
+        }
+        args.push_back("-e");
+        args.push_back(f.pattern);
+    }
+    if (!cmd.files.empty()) {
+        args.push_back("--");
+        args.insert(args.end(), cmd.files.begin(), cmd.files.end());
+    }
+    return args;
+}
+
+bool grep_accepts(const vector<string>& args) {
+    grep_command cmd;
+    return parse_grep(args, cmd);
+}
+
+namespace {
+
+// What selecting lines from one piece of input produced.
+struct grep_piece {
+    string out;
+    long count = 0;
+    bool binary = false;
+};
+
+// The state of one grep run across all of its input files.
+struct grep_run {
+    grep_run(const grep_command& c, const grep_matcher& m, bool p, const StageIO& o)
+        : cmd(c), matcher(m), prefix(p), io(o), selected(false), write_failed(false) {}
+
+    const grep_command& cmd;
+    const grep_matcher& matcher;
+    bool prefix;  // more than one file: print "name:" in front of lines
+    const StageIO& io;  // output goes to its stdout
+    string out;
+    bool selected;
+    bool write_failed;
+
+    bool flush() {
+        if (!write_failed && !stage_write(io, out.data(), out.size())) {
+            write_failed = true;
+        }
+        out.clear();
+        return !write_failed;
+    }
+};
+
+// Appends the lines of [begin, end) that pass the chain to piece.out (or
+// just counts them for -c).  The range holds whole lines, except that the
+// last one may lack its newline.
+void select_lines(const grep_run& run, const string& name, const char* begin,
+                  const char* end, grep_piece& piece) {
+    const char* p = begin;
+    while (p < end) {
+        if (run.matcher.has_prefilter()) {
+            // Jump straight to the line holding the next candidate.
+            const char* hit = run.matcher.next_candidate(p, end);
+            if (hit == nullptr) {
+                return;
+            }
+            const char* nl = static_cast<const char*>(memrchr(p, '\n', hit - p));
+            if (nl != nullptr) {
+                p = nl + 1;
+            }
+        }
+        const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+        const char* line = p;
+        size_t len = nl ? nl - line : end - line;
+        p = nl ? nl + 1 : end;
+
+        if (!run.matcher.passes(run.matcher.hits(line, len))) {
+            continue;
+        }
+        piece.count++;
+        if (run.cmd.count) {
+            continue;
+        }
+        if (run.prefix) {
+            piece.out += name;
+            piece.out += ':';
+        }
+        piece.out.append(line, len);
+        piece.out += '\n';
+    }
+}
+
+// Appends the output for one input file (a count, for -c) to run.out.
+void finish_input(grep_run& run, const string& name, long count) {
+    if (count > 0) {
+        run.selected = true;
+    }
+    if (run.cmd.count) {
+        if (run.prefix) {
+            run.out += name + ":";
+        }
+        run.out += std::to_string(count) + "\n";
+    }
+}
+
+// Searches a big regular file from offset on: maps it, cuts it into
+// chunks at line boundaries and has the task pool search windows of chunks
+// in parallel, writing each window's output in order once it is done.
+// Returns false if the output went away.  A chunk holding a NUL byte ends
+// the parallel search: count and the file offset are left at the start of
+// that chunk for the streaming path, which knows how to treat binary data.
+// So does a window the file shrank under: the streaming path reads what is
+// left of it.  done tells whether the whole file was searched here.
+bool grep_mapped(grep_run& run, int fd, off_t offset, size_t size, const string& name,
+                 long& count, bool& done) {
+    done = false;
+    file_map map(fd, size);
+    if (!map.ok()) {
+        return true;
+    }
+    madvise(const_cast<char*>(map.data()), size, MADV_SEQUENTIAL);
+    const char* file = map.data();
+    const char* base = file + offset;
+    const char* end = file + size;
+
+    task_pool& pool = shared_task_pool();
+    size_t window = pool.concurrency() * kChunksPerWorker;
+    size_t chunk_size = std::max(kMinChunk, static_cast<size_t>(end - base) / window + 1);
+
+    // Chunk boundaries, each just past a newline (or at the end).
+    vector<const char*> bounds = {base};
+    while (bounds.back() < end) {
+        const char* cut = bounds.back() + std::min(chunk_size, static_cast<size_t>(end - bounds.back()));
+        if (cut < end) {
+            const char* nl = static_cast<const char*>(memchr(cut - 1, '\n', end - (cut - 1)));
+            cut = nl ? nl + 1 : end;
+        }
+        bounds.push_back(cut);
+    }
+
+    size_t chunks = bounds.size() - 1;
+    vector<grep_piece> pieces(std::min(window, chunks));
+    bool keep_going = true;
+    const char* resume = end;
+    for (size_t first = 0; first < chunks && keep_going && resume == end; first += window) {
+        size_t n = std::min(window, chunks - first);
+        pool.run(n, [&](size_t i) {
+            grep_piece& piece = pieces[i];
+            piece.out.clear();
+            piece.count = 0;
+            const char* from = bounds[first + i];
+            const char* to = bounds[first + i + 1];
+            piece.binary = memchr(from, '\0', to - from) != nullptr;
+            if (!piece.binary) {
+                select_lines(run, name, from, to, piece);
+            }
+        });
+        if (map.truncated()) {
+            resume = bounds[first];
+            break;
+        }
+        for (size_t i = 0; i < n && keep_going; i++) {
+            if (pieces[i].binary) {
+                resume = bounds[first + i];
+                break;
+            }
+            count += pieces[i].count;
+            run.out.swap(pieces[i].out);
+            keep_going = run.flush();
+        }
+    }
+    lseek(fd, resume - file, SEEK_SET);
+    done = resume == end;
+    return keep_going;
+}
+
+// Runs the chain over everything readable from src's input.  Returns
+// false if the output went away and grep should stop.
+bool grep_input(grep_run& run, const StageIO& src, const string& name) {
+    long count = 0;
+    int fd = src.in;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        static_cast<size_t>(st.st_size) >= kParallelMin) {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (offset >= 0 && offset <= st.st_size) {
+            bool done;
+            if (!grep_mapped(run, fd, offset, st.st_size, name, count, done)) {
+                return false;
+            }
+            if (done) {
+                finish_input(run, name, count);
+                return run.flush();
+            }
+        }
+    }
+
+    string buf;
+    size_t start = 0;  // first byte of buf not processed yet
+    bool binary = false;
+    bool eof = false;
+
+    while (!eof) {
+        if (start > 0) {
+            buf.erase(0, start);
+            start = 0;
+        }
+        size_t old = buf.size();
+        buf.resize(old + kReadSize);
+        ssize_t n = stage_read(src, &buf[old], kReadSize);
+        if (n < 0) {
+            stage_err(src) << "grep: " << name << ": " << strerror(errno) << endl;
+            return true;
+        }
+        buf.resize(old + n);
+        eof = n == 0;
+        if (!binary && memchr(buf.data() + old, '\0', n) != nullptr) {
+            binary = true;
+        }
+
+        // Only complete lines are looked at, except for an unterminated
+        // last line at EOF.
+        size_t complete = buf.size();
+        if (!eof) {
+            const char* last_nl = static_cast<const char*>(
+                memrchr(buf.data() + start, '\n', buf.size() - start));
+            complete = last_nl ? last_nl - buf.data() + 1 : start;
+        }
+
+        if (!binary) {
+            grep_piece piece;
+            piece.out.swap(run.out);
+            select_lines(run, name, buf.data() + start, buf.data() + complete, piece);
+            piece.out.swap(run.out);
+            count += piece.count;
+            start = complete;
+            if (run.out.size() >= kFlushSize && !run.flush()) {
+                return false;
+            }
+            continue;
+        }
+
+        while (start < complete) {
+            const char* line = buf.data() + start;
+            const char* nl = static_cast<const char*>(memchr(line, '\n', complete - start));
+            size_t len = nl ? nl - line : complete - start;
+            start += len + (nl ? 1 : 0);
+
+            uint64_t hits = run.matcher.hits(line, len);
+            if (!run.cmd.count && run.matcher.passes_first(hits)) {
+                // Like GNU grep: no binary lines on the output, just a note.
+                if (!run.flush()) {
+                    return false;
+                }
+                stage_err(src) << "grep: " << name << ": binary file matches" << endl;
+                run.selected = true;
+                return true;
+            }
+            if (run.matcher.passes(hits)) {
+                count++;
+            }
+        }
+    }
+
+    finish_input(run, name, count);
+    return run.flush();
+}
+
+}  // namespace
+
+int builtin_grep(const vector<string>& args, StageIO& io) {
+    grep_command cmd;
+    if (!parse_grep(args, cmd)) {
+        stage_err(io) << args[0] << ": unsupported arguments" << endl;
+        return kGrepTrouble;
+    }
+    grep_matcher matcher(cmd.filters);
+    grep_run run(cmd, matcher, cmd.files.size() > 1, io);
+
+    if (cmd.files.empty()) {
+        grep_input(run, io, "(standard input)");
+        return run.selected ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    bool trouble = false;
+    for (const auto& file : cmd.files) {
+        if (file == "-") {
+            if (!grep_input(run, io, "(standard input)")) {
+                break;
+            }
+            continue;
+        }
+        int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            stage_err(io) << "grep: " << file << ": " << strerror(errno) << endl;
+            trouble = true;
+            continue;
+        }
+        StageIO file_io = {fd, io.out, nullptr, io.out_ring, io.capture, io.err};
+        bool keep_going = grep_input(run, file_io, file);
+        close(fd);
+        if (!keep_going) {
+            break;
+        }
+    }
+    if (trouble) {
+        return kGrepTrouble;
+    }
+    return run.selected ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,145 @@
+#include "builtins.h"
+
+#include <unistd.h>  // for lseek(), close()
+#include <fcntl.h>   // for open()
+
+#include <cctype>   // for isdigit()
+#include <cerrno>
+#include <cstdlib>  // for strtol()
+#include <cstring>  // for memchr(), strerror()
+#include <iostream>
+
+using std::endl;
+using std::string;
+using std::vector;
+
+static const size_t kReadSize = 64 * 1024;
+
+// Parses a line count the way head takes it: plain decimal digits, no
+// sign and none of the size suffixes the real head knows.
+static bool parse_count(const string& count, long& lines) {
+    if (count.empty() || !isdigit(static_cast<unsigned char>(count[0]))) {
+        return false;
+    }
+    char* end;
+    errno = 0;
+    lines = strtol(count.c_str(), &end, 10);
+    return *end == '\0' && errno == 0;
+}
+
+bool parse_head(const vector<string>& args, head_command& cmd) {
+    bool no_more_options = false;
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (no_more_options || arg.size() < 2 || arg[0] != '-') {
+            cmd.files.push_back(arg);
+            continue;
+        }
+        if (arg == "--") {
+            no_more_options = true;
+            continue;
+        }
+
+        string count;
+        if (arg == "-n") {
+            if (i + 1 == args.size()) {
+                return false;
+            }
+            count = args[++i];
+        } else if (arg.compare(0, 2, "-n") == 0) {
+            count = arg.substr(2);
+        } else if (isdigit(static_cast<unsigned char>(arg[1]))) {
+            count = arg.substr(1);
+        } else {
+            return false;
+        }
+        if (!parse_count(count, cmd.lines)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool head_accepts(const vector<string>& args) {
+    head_command cmd;
+    return parse_head(args, cmd);
+}
+
+// Copies the first n lines of src's input to its output.  A seekable
+// input is left positioned right after the last line copied, like the
+// real head leaves it, so whoever reads it next carries on from there.
+// Returns false if the output went away.
+static bool head_input(const StageIO& src, long n, const string& name, bool& trouble) {
+    char buf[kReadSize];
+    while (n > 0) {
+        ssize_t len = stage_read(src, buf, sizeof(buf));
+        if (len < 0) {
+            stage_err(src) << "head: error reading '" << name << "': " << strerror(errno) << endl;
+            trouble = true;
+            return true;
+        }
+        if (len == 0) {
+            return true;
+        }
+        const char* p = buf;
+        const char* end = buf + len;
+        while (n > 0 && p < end) {
+            const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+            if (nl == nullptr) {
+                p = end;
+                break;
+            }
+            p = nl + 1;
+            n--;
+        }
+        if (!stage_write(src, buf, p - buf)) {
+            return false;
+        }
+        if (n == 0 && p < end && src.in_ring == nullptr) {
+            lseek(src.in, p - end, SEEK_CUR);
+        }
+    }
+    return true;
+}
+
+int builtin_head(const vector<string>& args, StageIO& io) {
+    head_command cmd;
+    if (!parse_head(args, cmd)) {
+        stage_err(io) << "head: unsupported arguments" << endl;
+        return EXIT_FAILURE;
+    }
+    if (cmd.files.empty()) {
+        cmd.files.push_back("-");
+    }
+
+    bool trouble = false;
+    bool first = true;
+    for (const auto& file : cmd.files) {
+        StageIO src = io;
+        if (file != "-") {
+            src.in = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+            src.in_ring = nullptr;
+            if (src.in < 0) {
+                stage_err(io) << "head: cannot open '" << file << "' for reading: "
+                              << strerror(errno) << endl;
+                trouble = true;
+                continue;
+            }
+        }
+        if (cmd.files.size() > 1) {
+            string header = (first ? "" : "\n") + string("==> ") +
+                            (file == "-" ? "standard input" : file) + " <==\n";
+            stage_write(io, header.data(), header.size());
+            first = false;
+        }
+        bool keep_going = head_input(src, cmd.lines, file == "-" ? "standard input" : file,
+                                     trouble);
+        if (file != "-") {
+            close(src.in);
+        }
+        if (!keep_going) {
+            return EXIT_FAILURE;
+        }
+    }
+    return trouble ? EXIT_FAILURE : EXIT_SUCCESS;
+}
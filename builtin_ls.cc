@@ -0,0 +1,508 @@
+#include "builtins.h"
+
+#include <unistd.h>        // for syscall(), readlinkat(), isatty()
+#include <fcntl.h>         // for open(), AT_SYMLINK_NOFOLLOW
+#include <sys/ioctl.h>     // for TIOCGWINSZ
+#include <sys/stat.h>      // for statx()
+#include <sys/syscall.h>   // for SYS_getdents64
+#include <pwd.h>           // for getpwuid_r()
+#include <grp.h>           // for getgrgid_r()
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::endl;
+using std::map;
+using std::string;
+using std::thread;
+using std::vector;
+
+// Exit status of ls on a serious problem (bad option, missing operand).
+static const int kLsTrouble = 2;
+
+// Directories are read in getdents64 batches of this size.  The buffer is
+// kept per thread and reused across directories and invocations.
+static const size_t kDirentBufSize = 256 * 1024;
+
+// Below this many entries -l stats everything on the calling thread; the
+// cost of starting workers only pays off on big directories.
+static const size_t kParallelStatMin = 512;
+static const unsigned kMaxStatThreads = 8;
+
+// Coreutils prints the year instead of the time for files older than
+// half a Gregorian year.
+static const time_t kSixMonths = 31556952 / 2;
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct ls_options {
+    bool all = false;
+    bool longform = false;
+    bool one_per_line = false;
+};
+
+// One listed name.  Names live in a shared arena so that a directory with
+// hundreds of thousands of entries is not hundreds of thousands of
+// allocations.
+struct ls_entry {
+    size_t name_off;
+    size_t name_len;
+    struct statx st;
+    bool have_stat;
+};
+
+struct ls_listing {
+    string names;
+    vector<ls_entry> entries;
+
+    const char* name(const ls_entry& e) const { return names.data() + e.name_off; }
+
+    void add(const char* name, size_t len) {
+        ls_entry e;
+        e.name_off = names.size();
+        e.name_len = len;
+        e.have_stat = false;
+        names.append(name, len);
+        names.push_back('\0');
+        entries.push_back(e);
+    }
+
+    void sort() {
+        const char* base = names.data();
+        std::sort(entries.begin(), entries.end(),
+                  [base](const ls_entry& a, const ls_entry& b) {
+                      return strcoll(base + a.name_off, base + b.name_off) < 0;
+                  });
+    }
+};
+
+// Parses an ls command line.  Returns false if it has an option other
+// than -a, -l and -1, which only the real ls has.
+static bool parse_ls_args(const vector<string>& args, ls_options& opts,
+                          vector<string>& operands) {
+    bool no_more_options = false;
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (no_more_options || arg.size() < 2 || arg[0] != '-') {
+            operands.push_back(arg);
+            continue;
+        }
+        if (arg == "--") {
+            no_more_options = true;
+            continue;
+        }
+        for (size_t j = 1; j < arg.size(); j++) {
+            switch (arg[j]) {
+                case 'a': opts.all = true; break;
+                case 'l': opts.longform = true; opts.one_per_line = false; break;
+                case '1': opts.one_per_line = true; opts.longform = false; break;
+                default: return false;
+            }
+        }
+    }
+    if (operands.empty()) {
+        operands.push_back(".");
+    }
+    return true;
+}
+
+bool ls_accepts(const vector<string>& args) {
+    ls_options opts;
+    vector<string> operands;
+    return parse_ls_args(args, opts, operands);
+}
+
+// Reads every name in the directory open on fd into listing.
+static bool read_directory(int fd, bool all, ls_listing& listing) {
+    static thread_local vector<char> buf(kDirentBufSize);
+    while (true) {
+        long n = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        for (long off = 0; off < n;) {
+            const linux_dirent64* d = reinterpret_cast<const linux_dirent64*>(buf.data() + off);
+            off += d->d_reclen;
+            if (d->d_name[0] == '.' && !all) {
+                continue;
+            }
+            listing.add(d->d_name, strlen(d->d_name));
+        }
+    }
+}
+
+static const unsigned kStatMask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID |
+                                  STATX_GID | STATX_SIZE | STATX_BLOCKS | STATX_MTIME;
+
+static void stat_range(int dirfd, ls_listing& listing, size_t begin, size_t end,
+                       size_t step) {
+    for (size_t i = begin; i < end; i += step) {
+        ls_entry& e = listing.entries[i];
+        e.have_stat = statx(dirfd, listing.name(e), AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                            kStatMask, &e.st) == 0;
+    }
+}
+
+// Fills in the metadata -l needs, fanning the statx() calls out over a few
+// threads for big directories so their latencies overlap.
+static void stat_entries(int dirfd, ls_listing& listing) {
+    size_t n = listing.entries.size();
+    unsigned workers = std::min(thread::hardware_concurrency(), kMaxStatThreads);
+    if (n < kParallelStatMin || workers < 2) {
+        stat_range(dirfd, listing, 0, n, 1);
+        return;
+    }
+    vector<thread> threads;
+    for (unsigned t = 0; t < workers; t++) {
+        threads.emplace_back(stat_range, dirfd, std::ref(listing), t, n, workers);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+static string mode_string(unsigned mode) {
+    string s = "?rwxrwxrwx";
+    switch (mode & S_IFMT) {
+        case S_IFREG: s[0] = '-'; break;
+        case S_IFDIR: s[0] = 'd'; break;
+        case S_IFLNK: s[0] = 'l'; break;
+        case S_IFCHR: s[0] = 'c'; break;
+        case S_IFBLK: s[0] = 'b'; break;
+        case S_IFIFO: s[0] = 'p'; break;
+        case S_IFSOCK: s[0] = 's'; break;
+    }
+    for (int i = 0; i < 9; i++) {
+        if (!(mode & (0400 >> i))) {
+            s[i + 1] = '-';
+        }
+    }
+    if (mode & S_ISUID) s[3] = (mode & S_IXUSR) ? 's' : 'S';
+    if (mode & S_ISGID) s[6] = (mode & S_IXGRP) ? 's' : 'S';
+    if (mode & S_ISVTX) s[9] = (mode & S_IXOTH) ? 't' : 'T';
+    return s;
+}
+
+// Caches uid/gid -> name lookups for the duration of one ls.
+class id_names {
+ public:
+    const string& user(uid_t uid) {
+        auto it = users_.find(uid);
+        if (it != users_.end()) {
+            return it->second;
+        }
+        struct passwd pw, *result = nullptr;
+        char buf[4096];
+        getpwuid_r(uid, &pw, buf, sizeof(buf), &result);
+        return users_[uid] = result ? string(result->pw_name) : std::to_string(uid);
+    }
+
+    const string& group(gid_t gid) {
+        auto it = groups_.find(gid);
+        if (it != groups_.end()) {
+            return it->second;
+        }
+        struct group gr, *result = nullptr;
+        char buf[4096];
+        getgrgid_r(gid, &gr, buf, sizeof(buf), &result);
+        return groups_[gid] = result ? string(result->gr_name) : std::to_string(gid);
+    }
+
+ private:
+    map<uid_t, string> users_;
+    map<gid_t, string> groups_;
+};
+
+static void pad_left(string& out, const string& s, size_t width) {
+    out.append(width > s.size() ? width - s.size() : 0, ' ');
+    out += s;
+}
+
+static void pad_right(string& out, const string& s, size_t width) {
+    out += s;
+    out.append(width > s.size() ? width - s.size() : 0, ' ');
+}
+
+static bool is_device(const struct statx& st) {
+    unsigned mode = st.stx_mode & S_IFMT;
+    return mode == S_IFCHR || mode == S_IFBLK;
+}
+
+// The widths of the size column and, within it, of devices' "major, minor".
+struct size_widths {
+    size_t size = 0, major = 0, minor = 0;
+
+    // Widens them for st.  Like coreutils, a device's numbers are padded
+    // each to their own column, and the size column holds both.
+    void measure(const struct statx& st) {
+        if (is_device(st)) {
+            major = std::max(major, std::to_string(st.stx_rdev_major).size());
+            minor = std::max(minor, std::to_string(st.stx_rdev_minor).size());
+            size = std::max(size, major + 2 + minor);
+        } else {
+            size = std::max(size, std::to_string(st.stx_size).size());
+        }
+    }
+};
+
+static string time_field(const struct statx& st, time_t now) {
+    time_t t = st.stx_mtime.tv_sec;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    char buf[64];
+    bool recent = t > now - kSixMonths && t <= now;
+    strftime(buf, sizeof(buf), recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+    return buf;
+}
+
+// Appends `ls -l` lines for every entry of listing to out.  dirfd is what
+// the names are relative to, for reading symlink targets.  Entries of
+// also_measure are not printed but widen the columns, the way coreutils
+// sizes the columns of file operands by all operands, directories included.
+static void format_long(int dirfd, const ls_listing& listing, const ls_listing* also_measure,
+                        bool total, string& out) {
+    struct row {
+        string mode, nlink, user, group, size, time;
+        string major, minor;  // for a device, instead of the size
+    };
+    id_names ids;
+    time_t now = time(nullptr);
+    vector<row> rows;
+    rows.reserve(listing.entries.size());
+    size_t w_nlink = 0, w_user = 0, w_group = 0;
+    size_widths w_size;
+    unsigned long long blocks = 0;
+
+    for (const auto& e : listing.entries) {
+        row r;
+        if (e.have_stat) {
+            r.mode = mode_string(e.st.stx_mode);
+            r.nlink = std::to_string(e.st.stx_nlink);
+            r.user = ids.user(e.st.stx_uid);
+            r.group = ids.group(e.st.stx_gid);
+            if (is_device(e.st)) {
+                r.major = std::to_string(e.st.stx_rdev_major);
+                r.minor = std::to_string(e.st.stx_rdev_minor);
+            } else {
+                r.size = std::to_string(e.st.stx_size);
+            }
+            w_size.measure(e.st);
+            r.time = time_field(e.st, now);
+            blocks += e.st.stx_blocks;
+        } else {
+            r.mode = "l?????????";
+            r.nlink = r.user = r.group = r.size = "?";
+            r.time = "           ?";
+            w_size.size = std::max(w_size.size, r.size.size());
+        }
+        w_nlink = std::max(w_nlink, r.nlink.size());
+        w_user = std::max(w_user, r.user.size());
+        w_group = std::max(w_group, r.group.size());
+        rows.push_back(r);
+    }
+    if (also_measure != nullptr) {
+        for (const auto& e : also_measure->entries) {
+            w_nlink = std::max(w_nlink, std::to_string(e.st.stx_nlink).size());
+            w_user = std::max(w_user, ids.user(e.st.stx_uid).size());
+            w_group = std::max(w_group, ids.group(e.st.stx_gid).size());
+            w_size.measure(e.st);
+        }
+    }
+
+    if (total) {
+        // st_blocks counts 512-byte units, ls reports 1K blocks.
+        out += "total " + std::to_string((blocks + 1) / 2) + "\n";
+    }
+    for (size_t i = 0; i < rows.size(); i++) {
+        const row& r = rows[i];
+        const ls_entry& e = listing.entries[i];
+        out += r.mode;
+        out += ' ';
+        pad_left(out, r.nlink, w_nlink);
+        out += ' ';
+        pad_right(out, r.user, w_user);
+        out += ' ';
+        pad_right(out, r.group, w_group);
+        out += ' ';
+        if (!r.major.empty()) {
+            pad_left(out, r.major, w_size.size - 2 - w_size.minor);
+            out += ", ";
+            pad_left(out, r.minor, w_size.minor);
+        } else {
+            pad_left(out, r.size, w_size.size);
+        }
+        out += ' ';
+        out += r.time;
+        out += ' ';
+        out.append(listing.name(e), e.name_len);
+        if (e.have_stat && S_ISLNK(e.st.stx_mode)) {
+            char target[4096];
+            ssize_t n = readlinkat(dirfd, listing.name(e), target, sizeof(target));
+            if (n >= 0) {
+                out += " -> ";
+                out.append(target, n);
+            }
+        }
+        out += '\n';
+    }
+}
+
+// Lays names out in columns, filled top to bottom, as ls does on a terminal.
+static void format_columns(const ls_listing& listing, size_t line_width, string& out) {
+    const vector<ls_entry>& entries = listing.entries;
+    size_t n = entries.size();
+    if (n == 0) {
+        return;
+    }
+    size_t cols = std::min(n, std::max<size_t>(1, line_width / 3));
+    vector<size_t> widths;
+    size_t rows = n;
+    for (; cols > 1; cols--) {
+        rows = (n + cols - 1) / cols;
+        widths.assign(cols, 0);
+        for (size_t i = 0; i < n; i++) {
+            widths[i / rows] = std::max(widths[i / rows], entries[i].name_len + 2);
+        }
+        size_t total = 0;
+        for (size_t c = 0; c < cols; c++) {
+            total += widths[c];
+        }
+        if (total - 2 <= line_width) {
+            break;
+        }
+    }
+    if (cols <= 1) {
+        cols = 1;
+        rows = n;
+    }
+    for (size_t r = 0; r < rows; r++) {
+        for (size_t c = 0; c < cols; c++) {
+            size_t i = c * rows + r;
+            if (i >= n) {
+                break;
+            }
+            out.append(listing.name(entries[i]), entries[i].name_len);
+            if (c + 1 < cols && (c + 1) * rows + r < n) {
+                out.append(widths[c] - entries[i].name_len, ' ');
+            }
+        }
+        out += '\n';
+    }
+}
+
+static void format_listing(int dirfd, const ls_listing& listing, const ls_listing* also_measure,
+                           const ls_options& opts, bool total, int out_fd, string& out) {
+    if (opts.longform) {
+        format_long(dirfd, listing, also_measure, total, out);
+    } else if (!opts.one_per_line && isatty(out_fd)) {
+        struct winsize ws;
+        size_t width = 80;
+        if (ioctl(out_fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+            width = ws.ws_col;
+        }
+        format_columns(listing, width, out);
+    } else {
+        for (const auto& e : listing.entries) {
+            out.append(listing.name(e), e.name_len);
+            out += '\n';
+        }
+    }
+}
+
+int builtin_ls(const vector<string>& args, StageIO& io) {
+    ls_options opts;
+    vector<string> operands;
+    if (!parse_ls_args(args, opts, operands)) {
+        stage_err(io) << "usage: ls [-al1] [FILE]..." << endl;
+        return kLsTrouble;
+    }
+
+    int status = EXIT_SUCCESS;
+    ls_listing files;
+    ls_listing dir_operands;
+    vector<string> dirs;
+    for (const auto& name : operands) {
+        struct statx st;
+        if (statx(AT_FDCWD, name.c_str(), opts.longform ? AT_SYMLINK_NOFOLLOW : 0,
+                  kStatMask, &st) < 0) {
+            stage_err(io) << "ls: cannot access '" << name << "': " << strerror(errno) << endl;
+            status = kLsTrouble;
+            continue;
+        }
+        if (S_ISDIR(st.stx_mode)) {
+            dirs.push_back(name);
+            dir_operands.add(name.data(), name.size());
+            dir_operands.entries.back().st = st;
+        } else {
+            files.add(name.data(), name.size());
+            files.entries.back().st = st;
+            files.entries.back().have_stat = true;
+        }
+    }
+    std::sort(dirs.begin(), dirs.end(), [](const string& a, const string& b) {
+        return strcoll(a.c_str(), b.c_str()) < 0;
+    });
+    files.sort();
+
+    string out;
+    format_listing(AT_FDCWD, files, &dir_operands, opts, false, io.out, out);
+    bool headers = operands.size() > 1;
+    bool printed = !files.entries.empty();
+    for (size_t i = 0; i < dirs.size(); i++) {
+        int fd = open(dirs[i].c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        ls_listing listing;
+        if (fd < 0 || !read_directory(fd, opts.all, listing)) {
+            stage_err(io) << "ls: cannot open directory '" << dirs[i] << "': "
+                          << strerror(errno) << endl;
+            status = kLsTrouble;
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+        listing.sort();
+        if (opts.longform) {
+            stat_entries(fd, listing);
+        }
+        if (headers) {
+            if (printed) {
+                out += '\n';
+            }
+            out += dirs[i] + ":\n";
+        }
+        printed = true;
+        format_listing(fd, listing, nullptr, opts, true, io.out, out);
+        close(fd);
+
+        // Don't sit on the text of a huge directory longer than needed.
+        if (!stage_write(io, out.data(), out.size())) {
+            return kLsTrouble;
+        }
+        out.clear();
+    }
+    if (!stage_write(io, out.data(), out.size())) {
+        return kLsTrouble;
+    }
+    return status;
+}
@@ -0,0 +1,303 @@
+#include "builtins.h"
+
+#include <fcntl.h>       // for splice(), tee()
+#include <poll.h>        // for poll()
+#include <sys/socket.h>  // for socket(), sendto()
+#include <sys/un.h>      // for sockaddr_un
+#include <unistd.h>      // for read(), write(), close()
+
+#include <algorithm>  // for std::min()
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>   // for snprintf()
+#include <cstdlib>  // for strtod(), EXIT_SUCCESS, EXIT_FAILURE
+#include <cstring>  // for memchr(), strerror()
+#include <ctime>    // for clock_gettime()
+#include <iostream>
+
+#include "metrics.h"
+
+using std::endl;
+using std::string;
+using std::vector;
+
+static const size_t kSpliceSize = 1024 * 1024;
+static const size_t kCopySize = 128 * 1024;
+
+static double now_seconds() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long count_lines(const char* buf, size_t len) {
+    long lines = 0;
+    const char* end = buf + len;
+    while ((buf = static_cast<const char*>(memchr(buf, '\n', end - buf))) != nullptr) {
+        lines++;
+        buf++;
+    }
+    return lines;
+}
+
+namespace {
+
+// What flowed through, and where the reports go.
+class meter {
+ public:
+    meter(const StageIO& io, const string& name, double interval, const string& socket_path,
+          bool lines)
+        : io_(io), name_(name), interval_(interval), lines_counted_(lines), socket_(-1) {
+        start_ = last_ = now_seconds();
+        next_ = interval > 0 ? start_ + interval : 0;
+        if (!socket_path.empty() && socket_path.size() < sizeof(addr_.sun_path)) {
+            socket_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            memset(&addr_, 0, sizeof(addr_));
+            addr_.sun_family = AF_UNIX;
+            memcpy(addr_.sun_path, socket_path.data(), socket_path.size());
+        }
+    }
+    ~meter() {
+        if (socket_ >= 0) {
+            close(socket_);
+        }
+    }
+
+    void add(size_t bytes, long lines) {
+        bytes_ += bytes;
+        lines_ += lines;
+    }
+
+    // Milliseconds until the next report is due, -1 if there are none.
+    int wait_ms() const {
+        if (next_ == 0) {
+            return -1;
+        }
+        double left = next_ - now_seconds();
+        return left > 0 ? static_cast<int>(left * 1000) + 1 : 0;
+    }
+
+    // Reports the rate since the last report, if one is due.
+    void tick() {
+        if (next_ == 0) {
+            return;
+        }
+        double now = now_seconds();
+        if (now < next_) {
+            return;
+        }
+        report(now, false);
+        while (next_ <= now) {
+            next_ += interval_;
+        }
+    }
+
+    void finish() { report(now_seconds(), true); }
+
+    void show_lines() { lines_counted_ = true; }
+
+ private:
+    void report(double now, bool done) {
+        double elapsed = done ? now - start_ : now - last_;
+        uint64_t bytes = done ? bytes_ : bytes_ - last_bytes_;
+        double rate = elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0;
+        char line[256];
+        int len = snprintf(line, sizeof(line), "meter%s%s: %s%.1f MB", name_.empty() ? "" : " ",
+                           name_.c_str(), done ? "done, " : "", bytes_ / (1024.0 * 1024));
+        if (lines_counted_) {
+            len += snprintf(line + len, sizeof(line) - len, ", %llu lines",
+                            static_cast<unsigned long long>(lines_));
+        }
+        if (done) {
+            len += snprintf(line + len, sizeof(line) - len, " in %.2f s, %.1f MB/s\n",
+                            elapsed, rate);
+        } else {
+            len += snprintf(line + len, sizeof(line) - len, ", %.1f MB/s\n", rate);
+        }
+        len = std::min(len, static_cast<int>(sizeof(line)) - 1);
+        // One write per report, so reports of meters on other pipes don't
+        // interleave, unless the stage's stderr is captured (a job of a
+        // pipeline_runner, $(...)).  A missing collector must not hold the
+        // data up.
+        if (io_.err != nullptr) {
+            stage_err(io_).write(line, len).flush();
+        } else {
+            ssize_t ignored = write(STDERR_FILENO, line, len);
+            (void) ignored;
+        }
+        if (socket_ >= 0) {
+            sendto(socket_, line, len, MSG_DONTWAIT, reinterpret_cast<sockaddr*>(&addr_),
+                   sizeof(addr_));
+        }
+        last_ = now;
+        last_bytes_ = bytes_;
+    }
+
+    const StageIO& io_;
+    string name_;
+    double interval_;
+    bool lines_counted_;
+    int socket_;
+    sockaddr_un addr_;
+    double start_;
+    double last_;
+    double next_;
+    uint64_t bytes_ = 0;
+    uint64_t lines_ = 0;
+    uint64_t last_bytes_ = 0;
+};
+
+}  // namespace
+
+enum pump_result { kPumpDone, kPumpOutputGone, kPumpError, kPumpUnsupported };
+
+// Moves io.in to io.out with splice(2): the data goes from pipe to pipe
+// inside the kernel and is never copied through the shell.  With lines,
+// tee(2) first duplicates it into a scratch pipe that is read to count
+// newlines, which costs one copy instead of the two of read() and write().
+static pump_result splice_pump(const StageIO& io, meter& m, bool lines) {
+    int scratch[2] = {-1, -1};
+    if (lines && pipe2(scratch, O_CLOEXEC) < 0) {
+        return kPumpUnsupported;
+    }
+    static thread_local char buf[kCopySize];
+    pump_result result = kPumpDone;
+    bool moved_any = false;
+    while (true) {
+        pollfd p = {io.in, POLLIN, 0};
+        int ready = poll(&p, 1, m.wait_ms());
+        m.tick();
+        if (ready == 0 || (ready < 0 && errno == EINTR)) {
+            continue;
+        }
+        size_t want = kSpliceSize;
+        long newlines = 0;
+        if (lines) {
+            ssize_t n = tee(io.in, scratch[1], kSpliceSize, SPLICE_F_NONBLOCK);
+            if (n < 0 && errno == EAGAIN) {
+                continue;
+            }
+            if (n < 0) {
+                result = moved_any ? kPumpError : kPumpUnsupported;
+                break;
+            }
+            if (n == 0) {
+                break;
+            }
+            want = n;
+            for (size_t left = n; left > 0;) {
+                ssize_t r = read(scratch[0], buf, std::min(left, sizeof(buf)));
+                if (r <= 0) {
+                    break;
+                }
+                newlines += count_lines(buf, r);
+                left -= r;
+            }
+        }
+        size_t moved = 0;
+        do {
+            ssize_t n = splice(io.in, nullptr, io.out, nullptr, want - moved,
+                               SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                result = errno == EPIPE ? kPumpOutputGone
+                       : moved_any ? kPumpError : kPumpUnsupported;
+                break;
+            }
+            if (n == 0) {
+                break;
+            }
+            moved += n;
+            moved_any = true;
+        } while (lines && moved < want);
+        m.add(moved, newlines);
+        count_metric(metrics.builtin_bytes, moved);
+        if (result != kPumpDone || moved == 0) {
+            break;
+        }
+    }
+    if (lines) {
+        close(scratch[0]);
+        close(scratch[1]);
+    }
+    return result;
+}
+
+// Moves the data through a buffer: between builtin stages (rings), or
+// where splice(2) can't be used.  Lines are counted on the way.
+static pump_result copy_pump(const StageIO& io, meter& m) {
+    static thread_local char buf[kCopySize];
+    while (true) {
+        if (io.in_ring == nullptr) {
+            pollfd p = {io.in, POLLIN, 0};
+            int ready = poll(&p, 1, m.wait_ms());
+            m.tick();
+            if (ready == 0 || (ready < 0 && errno == EINTR)) {
+                continue;
+            }
+        }
+        ssize_t n = stage_read(io, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return kPumpError;
+        }
+        if (n == 0) {
+            return kPumpDone;
+        }
+        m.add(n, count_lines(buf, n));
+        if (!stage_write(io, buf, n)) {
+            return kPumpOutputGone;
+        }
+        m.tick();
+    }
+}
+
+int builtin_meter(const vector<string>& args, StageIO& io) {
+    string name;
+    double interval = 1;
+    string socket_path;
+    bool lines = false;
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (arg == "-l") {
+            lines = true;
+        } else if ((arg == "-n" || arg == "-i" || arg == "-u") && i + 1 < args.size()) {
+            const string& value = args[++i];
+            if (arg == "-n") {
+                name = value;
+            } else if (arg == "-u") {
+                socket_path = value;
+            } else {
+                char* end;
+                interval = strtod(value.c_str(), &end);
+                if (*end != '\0' || interval < 0) {
+                    stage_err(io) << "meter: invalid interval '" << value << "'" << endl;
+                    return EXIT_FAILURE;
+                }
+            }
+        } else {
+            stage_err(io) << "usage: meter [-l] [-i SECONDS] [-n NAME] [-u SOCKET]" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Between two builtin stages the data is in the shell's memory anyway
+    // and counting lines costs next to nothing; across pipes the bytes
+    // are spliced and lines are only counted with -l.
+    bool rings = io.in_ring != nullptr || io.out_ring != nullptr || io.capture != nullptr;
+    meter m(io, name, interval, socket_path, rings || lines);
+    pump_result result = rings ? kPumpUnsupported : splice_pump(io, m, lines);
+    if (result == kPumpUnsupported) {
+        m.show_lines();
+        result = copy_pump(io, m);
+    }
+    m.finish();
+    if (result == kPumpError) {
+        stage_err(io) << "meter: " << strerror(errno) << endl;
+    }
+    return result == kPumpDone ? EXIT_SUCCESS : EXIT_FAILURE;
+}
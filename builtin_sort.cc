@@ -0,0 +1,689 @@
+#include "builtins.h"
+
+#include <fcntl.h>   // for open(), O_TMPFILE
+#include <unistd.h>  // for read(), lseek(), close(), unlink()
+
+#include <algorithm>
+#include <cctype>  // for isdigit()
+#include <cerrno>
+#include <clocale>  // for setlocale()
+#include <cstdint>
+#include <cstdlib>  // for getenv(), strtoull(), mkstemp(), EXIT_SUCCESS
+#include <cstring>  // for memchr(), memcmp(), strerror()
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "task_pool.h"
+
+using std::endl;
+using std::string;
+using std::vector;
+
+// sort's exit status when something went wrong (unreadable file).
+static const int kSortTrouble = 2;
+
+static const size_t kReadSize = 128 * 1024;
+static const size_t kFlushSize = 64 * 1024;
+
+// What the lines read in and their index may take before they are sorted
+// and spilled to a temporary file as a run, unless -S says otherwise.
+static const size_t kDefaultBuffer = 256 << 20;
+static const size_t kMinBuffer = 1 << 20;
+
+// Fewer lines than this are sorted on one thread.  More are cut into a
+// part per thread of the task pool, sorted at once and merged.
+static const size_t kParallelMin = 64 * 1024;
+
+// What is read of a run at a time while runs are merged.
+static const size_t kRunReadSize = 256 * 1024;
+
+namespace {
+
+// A -k key: from the start of field first to the end of field last (0 for
+// the end of the line).  A key with modifiers of its own doesn't take the
+// global -n and -r.
+struct sort_key {
+    long first = 1;
+    long last = 0;
+    bool numeric = false;
+    bool reverse = false;
+};
+
+// A sort command line, parsed.
+struct sort_command {
+    bool numeric = false;
+    bool reverse = false;
+    bool unique = false;
+    int separator = -1;  // -t; -1 for fields that start at blanks
+    vector<sort_key> keys;
+    size_t buffer = kDefaultBuffer;
+    vector<string> files;
+};
+
+// A line in the arena.  prefix holds its first eight bytes big-endian, so
+// comparing two whole lines mostly takes one integer compare instead of a
+// memcmp() through the arena.
+struct line_span {
+    uint64_t prefix;
+    size_t offset;
+    size_t len;
+};
+
+}  // namespace
+
+// Parses a field number: plain decimal digits, at least 1.
+static bool parse_field(const string& spec, size_t& pos, long& field) {
+    size_t start = pos;
+    while (pos < spec.size() && isdigit(static_cast<unsigned char>(spec[pos]))) {
+        pos++;
+    }
+    if (pos == start || pos - start > 9) {
+        return false;
+    }
+    field = strtol(spec.c_str() + start, nullptr, 10);
+    return field > 0;
+}
+
+// Parses the n and r modifiers after a field number.
+static void parse_modifiers(const string& spec, size_t& pos, sort_key& key, bool& any) {
+    for (; pos < spec.size() && (spec[pos] == 'n' || spec[pos] == 'r'); pos++) {
+        if (spec[pos] == 'n') {
+            key.numeric = true;
+        } else {
+            key.reverse = true;
+        }
+        any = true;
+    }
+}
+
+// Parses a -k argument, FIRST[MODS][,LAST[MODS]].
+static bool parse_key(const string& spec, const sort_command& cmd, sort_key& key) {
+    size_t pos = 0;
+    bool modified = false;
+    if (!parse_field(spec, pos, key.first)) {
+        return false;
+    }
+    parse_modifiers(spec, pos, key, modified);
+    if (pos < spec.size() && spec[pos] == ',') {
+        pos++;
+        if (!parse_field(spec, pos, key.last)) {
+            return false;
+        }
+        parse_modifiers(spec, pos, key, modified);
+    }
+    if (!modified) {
+        key.numeric = cmd.numeric;
+        key.reverse = cmd.reverse;
+    }
+    return pos == spec.size();
+}
+
+// Parses a -S size: a number of KiB, or of bytes, KiB, MiB or GiB with a
+// b, K, M or G after it.
+static bool parse_buffer(const string& spec, size_t& buffer) {
+    if (spec.empty() || !isdigit(static_cast<unsigned char>(spec[0]))) {
+        return false;
+    }
+    char* end;
+    errno = 0;
+    unsigned long long n = strtoull(spec.c_str(), &end, 10);
+    string unit = end;
+    int shift = unit == "b" ? 0 : unit.empty() || unit == "K" || unit == "k" ? 10
+              : unit == "M" ? 20 : unit == "G" ? 30 : -1;
+    if (shift < 0 || errno != 0 || n > (SIZE_MAX >> shift)) {
+        return false;
+    }
+    buffer = std::max(kMinBuffer, static_cast<size_t>(n) << shift);
+    return true;
+}
+
+// Parses a sort command line.  Returns false if it needs something only
+// the real sort has (another option, a key with a character position or
+// other modifiers), or is malformed.  -k keys take the global -n and -r
+// whichever side of them those are given, so keys are read last.
+static bool parse_sort(const vector<string>& args, sort_command& cmd) {
+    vector<string> keys;
+    bool no_more_options = false;
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (no_more_options || arg.size() < 2 || arg[0] != '-') {
+            cmd.files.push_back(arg);
+            continue;
+        }
+        if (arg == "--") {
+            no_more_options = true;
+            continue;
+        }
+        char option = arg[1];
+        if (option == 't' || option == 'k' || option == 'S') {
+            string value = arg.substr(2);
+            if (value.empty()) {
+                if (i + 1 == args.size()) {
+                    return false;
+                }
+                value = args[++i];
+            }
+            if (option == 't' && value.size() != 1) {
+                return false;
+            }
+            if (option == 't') {
+                cmd.separator = static_cast<unsigned char>(value[0]);
+            } else if (option == 'k') {
+                keys.push_back(value);
+            } else if (!parse_buffer(value, cmd.buffer)) {
+                return false;
+            }
+            continue;
+        }
+        for (size_t j = 1; j < arg.size(); j++) {
+            if (arg[j] == 'n') {
+                cmd.numeric = true;
+            } else if (arg[j] == 'r') {
+                cmd.reverse = true;
+            } else if (arg[j] == 'u') {
+                cmd.unique = true;
+            } else {
+                return false;
+            }
+        }
+    }
+    for (const auto& spec : keys) {
+        sort_key key;
+        if (!parse_key(spec, cmd, key)) {
+            return false;
+        }
+        cmd.keys.push_back(key);
+    }
+    return true;
+}
+
+// Whether the shell collates bytes in their order, which is how this sort
+// compares.  Elsewhere the real sort collates the locale's way.
+static bool byte_collation() {
+    const char* collate = setlocale(LC_COLLATE, nullptr);
+    string name = collate != nullptr ? collate : "C";
+    return name == "C" || name == "POSIX" || name == "C.UTF-8" || name == "C.utf8";
+}
+
+bool sort_accepts(const vector<string>& args) {
+    sort_command cmd;
+    return byte_collation() && parse_sort(args, cmd);
+}
+
+static int compare_bytes(const char* a, size_t alen, const char* b, size_t blen) {
+    size_t n = std::min(alen, blen);
+    int c = n > 0 ? memcmp(a, b, n) : 0;
+    return c != 0 ? c : alen < blen ? -1 : alen > blen ? 1 : 0;
+}
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// Where field n of [line, line+len) starts.  Without a separator a field
+// is the blanks before a word and the word, as in the real sort.
+static size_t field_start(const char* line, size_t len, long n, int separator) {
+    size_t pos = 0;
+    for (long field = 1; field < n && pos < len; field++) {
+        if (separator >= 0) {
+            const char* sep = static_cast<const char*>(memchr(line + pos, separator, len - pos));
+            pos = sep != nullptr ? sep - line + 1 : len;
+            continue;
+        }
+        while (pos < len && is_blank(line[pos])) {
+            pos++;
+        }
+        while (pos < len && !is_blank(line[pos])) {
+            pos++;
+        }
+    }
+    return pos;
+}
+
+// Where the field starting at pos ends.
+static size_t field_end(const char* line, size_t len, size_t pos, int separator) {
+    if (separator >= 0) {
+        const char* sep = static_cast<const char*>(memchr(line + pos, separator, len - pos));
+        return sep != nullptr ? sep - line : len;
+    }
+    while (pos < len && is_blank(line[pos])) {
+        pos++;
+    }
+    while (pos < len && !is_blank(line[pos])) {
+        pos++;
+    }
+    return pos;
+}
+
+// Where key starts and ends in [line, line+len).
+static void key_bounds(const sort_key& key, int separator, const char* line, size_t len,
+                       size_t& from, size_t& to) {
+    from = field_start(line, len, key.first, separator);
+    to = len;
+    if (key.last > 0) {
+        to = std::max(from, field_end(line, len, field_start(line, len, key.last, separator),
+                                      separator));
+    }
+}
+
+// A number as -n reads it: after any blanks, an optional minus sign,
+// digits and a fraction.  Whatever doesn't parse counts as zero.
+struct number_parts {
+    bool negative = false;
+    const char* integer = nullptr;  // without leading zeros
+    size_t integer_len = 0;
+    const char* fraction = nullptr;  // without trailing zeros
+    size_t fraction_len = 0;
+};
+
+static number_parts parse_number(const char* s, size_t len) {
+    number_parts n;
+    size_t pos = 0;
+    while (pos < len && is_blank(s[pos])) {
+        pos++;
+    }
+    if (pos < len && s[pos] == '-') {
+        n.negative = true;
+        pos++;
+    }
+    while (pos < len && s[pos] == '0') {
+        pos++;
+    }
+    n.integer = s + pos;
+    while (pos < len && isdigit(static_cast<unsigned char>(s[pos]))) {
+        pos++;
+    }
+    n.integer_len = s + pos - n.integer;
+    if (pos < len && s[pos] == '.') {
+        n.fraction = s + ++pos;
+        while (pos < len && isdigit(static_cast<unsigned char>(s[pos]))) {
+            pos++;
+        }
+        n.fraction_len = s + pos - n.fraction;
+        while (n.fraction_len > 0 && n.fraction[n.fraction_len - 1] == '0') {
+            n.fraction_len--;
+        }
+    }
+    if (n.integer_len == 0 && n.fraction_len == 0) {
+        n.negative = false;  // -0 is 0
+    }
+    return n;
+}
+
+// Compares two numbers of any length digit by digit, as the real sort -n
+// does, instead of converting them.
+static int compare_numbers(const char* a, size_t alen, const char* b, size_t blen) {
+    number_parts x = parse_number(a, alen);
+    number_parts y = parse_number(b, blen);
+    if (x.negative != y.negative) {
+        return x.negative ? -1 : 1;
+    }
+    int c = x.integer_len != y.integer_len ? (x.integer_len < y.integer_len ? -1 : 1)
+            : memcmp(x.integer, y.integer, x.integer_len);
+    if (c == 0) {
+        c = compare_bytes(x.fraction, x.fraction_len, y.fraction, y.fraction_len);
+    }
+    return x.negative ? -c : c;
+}
+
+// Compares two lines (without their newlines) the way cmd sorts them:
+// key by key, and then, unless -u made lines with equal keys duplicates,
+// byte by byte as a last resort.
+static int compare_lines(const sort_command& cmd, const char* a, size_t alen, const char* b,
+                         size_t blen) {
+    if (cmd.keys.empty() && !cmd.numeric) {
+        int c = compare_bytes(a, alen, b, blen);
+        return cmd.reverse ? -c : c;
+    }
+    if (cmd.keys.empty()) {
+        int c = compare_numbers(a, alen, b, blen);
+        if (c != 0 || cmd.unique) {
+            return cmd.reverse ? -c : c;
+        }
+    }
+    for (const auto& key : cmd.keys) {
+        size_t a_from, a_to, b_from, b_to;
+        key_bounds(key, cmd.separator, a, alen, a_from, a_to);
+        key_bounds(key, cmd.separator, b, blen, b_from, b_to);
+        int c = key.numeric ? compare_numbers(a + a_from, a_to - a_from, b + b_from, b_to - b_from)
+                            : compare_bytes(a + a_from, a_to - a_from, b + b_from, b_to - b_from);
+        if (c != 0) {
+            return key.reverse ? -c : c;
+        }
+    }
+    if (cmd.unique) {
+        return 0;
+    }
+    int c = compare_bytes(a, alen, b, blen);
+    return cmd.reverse ? -c : c;
+}
+
+static uint64_t line_prefix(const char* line, size_t len) {
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < 8; i++) {
+        prefix = prefix << 8 | (i < len ? static_cast<unsigned char>(line[i]) : 0);
+    }
+    return prefix;
+}
+
+namespace {
+
+// Writes lines, each with a newline, to the stage's output or to a run,
+// dropping a line equal to the one before it with -u.
+class line_writer {
+ public:
+    line_writer(const sort_command& cmd, const StageIO* io, int fd)
+        : cmd_(cmd), io_(io), fd_(fd) {}
+
+    void write(const char* line, size_t len) {
+        if (cmd_.unique && have_last_ &&
+            compare_lines(cmd_, last_.data(), last_.size(), line, len) == 0) {
+            return;
+        }
+        if (cmd_.unique) {
+            last_.assign(line, len);
+            have_last_ = true;
+        }
+        buf_.append(line, len);
+        buf_ += '\n';
+        if (buf_.size() >= kFlushSize) {
+            flush();
+        }
+    }
+
+    // Returns false if the output went away (or the run couldn't be
+    // written).
+    bool flush() {
+        if (ok_ && !buf_.empty()) {
+            ok_ = io_ != nullptr ? stage_write(*io_, buf_.data(), buf_.size())
+                                 : write_all(fd_, buf_.data(), buf_.size());
+        }
+        buf_.clear();
+        return ok_;
+    }
+
+    bool ok() const { return ok_; }
+
+ private:
+    const sort_command& cmd_;
+    const StageIO* io_;
+    int fd_;
+    string buf_;
+    string last_;
+    bool have_last_ = false;
+    bool ok_ = true;
+};
+
+// The lines of one sorted part of the arena, in order.
+struct part_cursor {
+    part_cursor(const string& arena, const line_span* from, const line_span* to)
+        : arena(&arena), at(from), end(to), line(nullptr), len(0) {}
+
+    const string* arena;
+    const line_span* at;
+    const line_span* end;
+    const char* line;
+    size_t len;
+
+    bool next() {
+        if (at == end) {
+            return false;
+        }
+        line = arena->data() + at->offset;
+        len = at->len;
+        at++;
+        return true;
+    }
+};
+
+// The lines of a run spilled to a temporary file, in order.
+struct run_reader {
+    explicit run_reader(int run) : fd(run), pos(0), at_end(false), line(nullptr), len(0) {}
+
+    int fd;
+    string buf;
+    size_t pos;
+    bool at_end;
+    const char* line;
+    size_t len;
+
+    bool next() {
+        while (true) {
+            const char* nl = static_cast<const char*>(
+                memchr(buf.data() + pos, '\n', buf.size() - pos));
+            if (nl != nullptr) {
+                line = buf.data() + pos;
+                len = nl - line;
+                pos += len + 1;
+                return true;
+            }
+            if (at_end) {
+                return false;  // every line in a run ends in a newline
+            }
+            buf.erase(0, pos);
+            pos = 0;
+            size_t used = buf.size();
+            buf.resize(used + kRunReadSize);
+            ssize_t n;
+            do {
+                n = read(fd, &buf[used], kRunReadSize);
+            } while (n < 0 && errno == EINTR);
+            buf.resize(used + (n > 0 ? n : 0));
+            at_end = n <= 0;
+        }
+    }
+};
+
+}  // namespace
+
+// Merges sorted sources into out, a line at a time from whichever source
+// has the first.  Sources that tie go in their order, so -u keeps the line
+// that came first.  Returns false if out failed.
+template <typename Source>
+static bool merge_sources(const sort_command& cmd, vector<Source>& sources, line_writer& out) {
+    auto after = [&](size_t x, size_t y) {
+        int c = compare_lines(cmd, sources[x].line, sources[x].len, sources[y].line,
+                              sources[y].len);
+        return c != 0 ? c > 0 : x > y;
+    };
+    vector<size_t> heap;
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (sources[i].next()) {
+            heap.push_back(i);
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), after);
+    while (!heap.empty() && out.ok()) {
+        std::pop_heap(heap.begin(), heap.end(), after);
+        size_t i = heap.back();
+        out.write(sources[i].line, sources[i].len);
+        if (sources[i].next()) {
+            std::push_heap(heap.begin(), heap.end(), after);
+        } else {
+            heap.pop_back();
+        }
+    }
+    return out.flush();
+}
+
+// Sorts the lines read so far and writes them to out: the index is cut
+// into a part per pool thread, the parts are sorted at once, and merged on
+// the way out.
+static bool sort_lines(const sort_command& cmd, const string& arena, vector<line_span>& lines,
+                       line_writer& out) {
+    const char* base = arena.data();
+    bool plain = cmd.keys.empty() && !cmd.numeric;
+    auto less = [&](const line_span& x, const line_span& y) {
+        if (plain && x.prefix != y.prefix) {
+            return cmd.reverse ? x.prefix > y.prefix : x.prefix < y.prefix;
+        }
+        // The prefix holds all of a line of up to eight bytes, so one that
+        // short is the other's start and comes first.
+        if (plain && (x.len <= 8 || y.len <= 8)) {
+            return cmd.reverse ? x.len > y.len : x.len < y.len;
+        }
+        return compare_lines(cmd, base + x.offset, x.len, base + y.offset, y.len) < 0;
+    };
+    task_pool& pool = shared_task_pool();
+    size_t parts = lines.size() < kParallelMin ? 1 : pool.concurrency();
+    vector<size_t> bounds;
+    for (size_t i = 0; i <= parts; i++) {
+        bounds.push_back(lines.size() * i / parts);
+    }
+    // Only -u can tell lines that compare equal apart, by which came first.
+    pool.run(parts, [&](size_t i) {
+        if (cmd.unique) {
+            std::stable_sort(lines.begin() + bounds[i], lines.begin() + bounds[i + 1], less);
+        } else {
+            std::sort(lines.begin() + bounds[i], lines.begin() + bounds[i + 1], less);
+        }
+    });
+    vector<part_cursor> cursors;
+    for (size_t i = 0; i < parts; i++) {
+        cursors.emplace_back(arena, lines.data() + bounds[i], lines.data() + bounds[i + 1]);
+    }
+    return merge_sources(cmd, cursors, out);
+}
+
+// A temporary file for a run, already unlinked.
+static int run_file() {
+    const char* tmpdir = getenv("TMPDIR");
+    string dir = tmpdir != nullptr && *tmpdir != '\0' ? tmpdir : "/tmp";
+    int fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR)) {
+        return fd;
+    }
+    string name = dir + "/pipe_shell_sortXXXXXX";
+    fd = mkstemp(&name[0]);
+    if (fd >= 0) {
+        unlink(name.c_str());
+    }
+    return fd;
+}
+
+namespace {
+
+// Everything sort has read: the lines not yet sorted, in the arena, and
+// the runs already spilled.
+struct sort_state {
+    string arena;
+    vector<line_span> lines;
+    size_t indexed = 0;  // arena bytes already cut into lines
+    vector<int> runs;
+};
+
+}  // namespace
+
+// Adds the complete lines in the arena past what is indexed to the index,
+// and, at the end of an input, an unterminated last line too.
+static void index_lines(sort_state& s, bool end_of_input) {
+    const char* base = s.arena.data();
+    size_t size = s.arena.size();
+    while (s.indexed < size) {
+        const char* nl =
+            static_cast<const char*>(memchr(base + s.indexed, '\n', size - s.indexed));
+        if (nl == nullptr && !end_of_input) {
+            break;
+        }
+        size_t len = (nl != nullptr ? nl - base : size) - s.indexed;
+        s.lines.push_back({line_prefix(base + s.indexed, len), s.indexed, len});
+        s.indexed += len + (nl != nullptr ? 1 : 0);
+    }
+}
+
+// Sorts the indexed lines into a new run and empties the arena, but for a
+// partial last line.  Returns false after printing why if it couldn't.
+static bool spill(const sort_command& cmd, sort_state& s, const StageIO& io) {
+    int fd = run_file();
+    if (fd < 0) {
+        stage_err(io) << "sort: cannot create temporary file: " << strerror(errno) << endl;
+        return false;
+    }
+    line_writer run(cmd, nullptr, fd);
+    if (!sort_lines(cmd, s.arena, s.lines, run) || lseek(fd, 0, SEEK_SET) < 0) {
+        stage_err(io) << "sort: cannot write temporary file: " << strerror(errno) << endl;
+        close(fd);
+        return false;
+    }
+    s.runs.push_back(fd);
+    s.arena.erase(0, s.indexed);
+    s.indexed = 0;
+    s.lines.clear();
+    return true;
+}
+
+// Reads one input into s, spilling runs whenever the buffer fills.
+static bool read_input(const sort_command& cmd, const StageIO& in, const string& name,
+                       sort_state& s, bool& trouble) {
+    while (true) {
+        size_t used = s.arena.size();
+        s.arena.resize(used + kReadSize);
+        ssize_t n = stage_read(in, &s.arena[used], kReadSize);
+        s.arena.resize(used + (n > 0 ? n : 0));
+        if (n < 0) {
+            stage_err(in) << "sort: read failed: " << name << ": " << strerror(errno) << endl;
+            trouble = true;
+        }
+        index_lines(s, n <= 0);
+        if (n <= 0) {
+            return true;
+        }
+        if (s.arena.size() + s.lines.size() * sizeof(line_span) >= cmd.buffer &&
+            !spill(cmd, s, in)) {
+            return false;
+        }
+    }
+}
+
+int builtin_sort(const vector<string>& args, StageIO& io) {
+    sort_command cmd;
+    if (!parse_sort(args, cmd)) {
+        stage_err(io) << "usage: sort [-nru] [-t SEP] [-k KEY]... [-S SIZE] [FILE]..." << endl;
+        return kSortTrouble;
+    }
+    if (cmd.files.empty()) {
+        cmd.files.push_back("-");
+    }
+
+    sort_state s;
+    bool trouble = false;
+    bool ok = true;
+    for (size_t i = 0; i < cmd.files.size() && ok; i++) {
+        const string& name = cmd.files[i];
+        if (name == "-") {
+            ok = read_input(cmd, io, name, s, trouble);
+            continue;
+        }
+        int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            stage_err(io) << "sort: cannot read: " << name << ": " << strerror(errno) << endl;
+            trouble = true;
+            continue;
+        }
+        StageIO file = {fd, -1, nullptr, nullptr, nullptr, io.err};
+        ok = read_input(cmd, file, name, s, trouble);
+        close(fd);
+    }
+
+    // Everything fit: sort it straight to the output.  Otherwise the rest
+    // becomes the last run, and the runs are merged.
+    line_writer out(cmd, &io, -1);
+    if (ok && s.runs.empty()) {
+        ok = sort_lines(cmd, s.arena, s.lines, out);
+    } else if (ok && (s.lines.empty() || spill(cmd, s, io))) {
+        string().swap(s.arena);
+        vector<line_span>().swap(s.lines);
+        vector<run_reader> readers;
+        for (int fd : s.runs) {
+            readers.emplace_back(fd);
+        }
+        ok = merge_sources(cmd, readers, out);
+    } else {
+        ok = false;
+    }
+    for (int fd : s.runs) {
+        close(fd);
+    }
+    return !ok || trouble ? kSortTrouble : EXIT_SUCCESS;
+}
@@ -0,0 +1,366 @@
+#include "builtins.h"
+
+#include <unistd.h>       // for read(), pread(), close()
+#include <fcntl.h>        // for open()
+#include <sys/mman.h>     // for madvise()
+#include <sys/stat.h>     // for fstat()
+#include <sys/inotify.h>  // for inotify_init1(), inotify_add_watch()
+
+#include <algorithm>  // for std::max()
+#include <cerrno>
+#include <cctype>   // for isdigit()
+#include <cstdlib>  // for strtol()
+#include <cstring>  // for memrchr(), memchr(), strerror()
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "file_map.h"
+
+using std::endl;
+using std::string;
+using std::vector;
+
+// Once a streamed input has buffered this many bytes we drop everything
+// in front of the last N lines, so tail of a pipe runs in bounded memory
+// no matter how much is pushed through it.  Past that, the buffer is only
+// trimmed again once it has doubled since, so the last N lines are not
+// searched for on every read when they alone take more than this.
+static const size_t kTrimThreshold = 1 << 20;
+
+static const size_t kReadSize = 64 * 1024;
+
+bool parse_tail(const vector<string>& args, tail_command& cmd, string& error) {
+    bool no_more_options = false;
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (no_more_options || arg.size() < 2 || arg[0] != '-') {
+            cmd.files.push_back(arg);
+            continue;
+        }
+        if (arg == "--") {
+            no_more_options = true;
+            continue;
+        }
+
+        string count;
+        if (arg == "-f") {
+            cmd.follow = true;
+            continue;
+        } else if (arg == "-n") {
+            if (i + 1 == args.size()) {
+                error = "option requires an argument -- 'n'";
+                return false;
+            }
+            count = args[++i];
+        } else if (arg.compare(0, 2, "-n") == 0) {
+            count = arg.substr(2);
+        } else if (isdigit(static_cast<unsigned char>(arg[1]))) {
+            count = arg.substr(1);
+        } else {
+            error = "invalid option -- '" + arg.substr(1, 1) + "'";
+            return false;
+        }
+
+        cmd.from_start = !count.empty() && count[0] == '+';
+        const char* digits = count.c_str() + (cmd.from_start ? 1 : 0);
+        char* end;
+        errno = 0;
+        cmd.lines = strtol(digits, &end, 10);
+        if (*digits == '\0' || *end != '\0' || errno != 0 || cmd.lines < 0) {
+            error = "invalid number of lines: '" + count + "'";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool tail_accepts(const vector<string>& args) {
+    tail_command cmd;
+    string error;
+    return parse_tail(args, cmd, error);
+}
+
+bool tail_has_file_operand(const vector<string>& args) {
+    tail_command cmd;
+    string error;
+    return parse_tail(args, cmd, error) && !cmd.files.empty();
+}
+
+// Returns a pointer to the first byte of the last n lines of [base, base+len).
+// Scans backwards from the end with memrchr(), so only the pages holding
+// those lines are ever touched.
+static const char* last_lines(const char* base, size_t len, long n) {
+    if (n == 0) {
+        return base + len;
+    }
+    const char* p = base + len;
+    // A trailing newline terminates the last line, it does not start a new one.
+    if (len > 0 && p[-1] == '\n') {
+        p--;
+    }
+    long found = 0;
+    while (p > base) {
+        const char* nl = static_cast<const char*>(memrchr(base, '\n', p - base));
+        if (nl == nullptr) {
+            break;
+        }
+        if (++found == n) {
+            return nl + 1;
+        }
+        p = nl;
+    }
+    return base;
+}
+
+// Returns a pointer to the first byte of line n (1-based) of [base, base+len).
+static const char* skip_lines(const char* base, size_t len, long n) {
+    const char* p = base;
+    const char* end = base + len;
+    for (long i = 1; i < n && p < end; i++) {
+        const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (nl == nullptr) {
+            return end;
+        }
+        p = nl + 1;
+    }
+    return p;
+}
+
+// tail of anything that can't be mapped (pipes, terminals, rings), read
+// from io's input.
+static bool tail_stream(const StageIO& io, const tail_command& opts) {
+    string buf;
+    size_t trim_at = kTrimThreshold;
+    char chunk[kReadSize];
+    long to_skip = opts.from_start ? opts.lines - 1 : 0;
+
+    while (true) {
+        ssize_t n = stage_read(io, chunk, sizeof(chunk));
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        if (opts.from_start) {
+            const char* p = chunk;
+            const char* end = chunk + n;
+            while (to_skip > 0 && p < end) {
+                const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+                if (nl == nullptr) {
+                    p = end;
+                    break;
+                }
+                p = nl + 1;
+                to_skip--;
+            }
+            if (!stage_write(io, p, end - p)) {
+                return false;
+            }
+            continue;
+        }
+
+        buf.append(chunk, n);
+        if (buf.size() > trim_at) {
+            const char* start = last_lines(buf.data(), buf.size(), opts.lines);
+            buf.erase(0, start - buf.data());
+            trim_at = std::max(kTrimThreshold, 2 * buf.size());
+        }
+    }
+
+    if (opts.from_start) {
+        return true;
+    }
+    const char* start = last_lines(buf.data(), buf.size(), opts.lines);
+    return stage_write(io, start, buf.data() + buf.size() - start);
+}
+
+// tail of a regular file: map it and work from EOF backwards.  A file
+// that can't be mapped, or shrinks before the start of the tail is found,
+// is read instead.
+static bool tail_mapped(int fd, size_t size, const string& name, const tail_command& opts,
+                        const StageIO& io) {
+    if (size == 0) {
+        return true;
+    }
+    file_map map(fd, size);
+    if (!map.ok()) {
+        StageIO file_io = {fd, io.out, nullptr, io.out_ring, io.capture, io.err};
+        return tail_stream(file_io, opts);
+    }
+    const char* base = map.data();
+    if (!opts.from_start) {
+        // Don't let readahead pull in the front of the file.
+        madvise(const_cast<char*>(base), size, MADV_RANDOM);
+    }
+    const char* start = opts.from_start ? skip_lines(base, size, opts.lines)
+                                        : last_lines(base, size, opts.lines);
+    if (map.truncated()) {
+        StageIO file_io = {fd, io.out, nullptr, io.out_ring, io.capture, io.err};
+        return tail_stream(file_io, opts);
+    }
+    bool ok = stage_write(io, start, base + size - start);
+    if (map.truncated()) {
+        // Cut short while it was written: some of that was zeros.
+        stage_err(io) << "tail: " << name << ": " << strerror(EIO) << endl;
+        return false;
+    }
+    return ok;
+}
+
+struct followed_file {
+    string name;
+    int fd;
+    off_t offset;
+    int wd;
+};
+
+static void print_header(const string& name, bool first, const StageIO& io) {
+    string header = (first ? "" : "\n") + string("==> ") + name + " <==\n";
+    stage_write(io, header.data(), header.size());
+}
+
+// Copies data appended to f since the last call to io's output.
+static bool copy_appended(followed_file& f, const StageIO& io) {
+    struct stat st;
+    if (fstat(f.fd, &st) < 0) {
+        return true;
+    }
+    if (st.st_size < f.offset) {
+        stage_err(io) << "tail: " << f.name << ": file truncated" << endl;
+        f.offset = 0;
+    }
+    char chunk[kReadSize];
+    while (f.offset < st.st_size) {
+        ssize_t n = pread(f.fd, chunk, sizeof(chunk), f.offset);
+        if (n <= 0) {
+            break;
+        }
+        if (!stage_write(io, chunk, n)) {
+            return false;
+        }
+        f.offset += n;
+    }
+    return true;
+}
+
+// -f: block on inotify and print whatever gets appended to the files.
+// Returns once every file has been removed or the reader went away.
+static int follow(vector<followed_file>& files, const StageIO& io) {
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd < 0) {
+        stage_err(io) << "tail: inotify cannot be used: " << strerror(errno) << endl;
+        return EXIT_FAILURE;
+    }
+    size_t watched = 0;
+    for (auto& f : files) {
+        f.wd = inotify_add_watch(ifd, f.name.c_str(),
+                                 IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (f.wd >= 0) {
+            watched++;
+        }
+    }
+
+    followed_file* last = files.empty() ? nullptr : &files.back();
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int status = EXIT_SUCCESS;
+    while (watched > 0) {
+        ssize_t n = read(ifd, events, sizeof(events));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            status = EXIT_FAILURE;
+            break;
+        }
+        for (char* p = events; p < events + n;) {
+            const struct inotify_event* ev = reinterpret_cast<struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + ev->len;
+            for (auto& f : files) {
+                if (f.wd != ev->wd) {
+                    continue;
+                }
+                if (ev->mask & IN_MODIFY) {
+                    if (files.size() > 1 && last != &f) {
+                        print_header(f.name, false, io);
+                        last = &f;
+                    }
+                    if (!copy_appended(f, io)) {
+                        close(ifd);
+                        return EXIT_FAILURE;
+                    }
+                }
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    inotify_rm_watch(ifd, f.wd);
+                    f.wd = -1;
+                    watched--;
+                }
+            }
+        }
+    }
+    close(ifd);
+    return status;
+}
+
+int builtin_tail(const vector<string>& args, StageIO& io) {
+    tail_command opts;
+    string error;
+    if (!parse_tail(args, opts, error)) {
+        stage_err(io) << "tail: " << error << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (opts.files.empty()) {
+        struct stat st;
+        bool ok;
+        if (fstat(io.in, &st) == 0 && S_ISREG(st.st_mode) && !opts.follow) {
+            ok = tail_mapped(io.in, st.st_size, "standard input", opts, io);
+        } else {
+            ok = tail_stream(io, opts);
+        }
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    vector<followed_file> followed;
+    for (size_t i = 0; i < opts.files.size(); i++) {
+        const string& name = opts.files[i];
+        int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            stage_err(io) << "tail: cannot open '" << name << "' for reading: "
+                          << strerror(errno) << endl;
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (opts.files.size() > 1) {
+            print_header(name, i == 0, io);
+        }
+
+        struct stat st;
+        bool ok;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            ok = tail_mapped(fd, st.st_size, name, opts, io);
+            if (opts.follow) {
+                followed.push_back({name, fd, st.st_size, -1});
+                continue;
+            }
+        } else {
+            StageIO file_io = {fd, io.out, nullptr, io.out_ring, io.capture, io.err};
+            ok = tail_stream(file_io, opts);
+        }
+        close(fd);
+        if (!ok) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!followed.empty()) {
+        status = follow(followed, io);
+        for (auto& f : followed) {
+            close(f.fd);
+        }
+    }
+    return status;
+}
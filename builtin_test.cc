@@ -0,0 +1,276 @@
+#include "builtins.h"
+
+#include <unistd.h>    // for access(), isatty()
+#include <sys/stat.h>  // for stat(), lstat()
+
+#include <cerrno>
+#include <cstdlib>  // for strtoll()
+#include <cstring>  // for strchr()
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace {
+
+// Exit status of test on a malformed expression.
+const int kTestError = 2;
+
+// Recursive descent over the arguments of test:
+//   expr    := and ( -o and )*
+//   and     := not ( -a not )*
+//   not     := ! not | primary
+//   primary := ( expr ) | ARG BINOP ARG | UNOP ARG | ARG
+class test_parser {
+ public:
+    test_parser(const vector<string>& args, size_t begin, size_t end, const StageIO& io)
+        : args_(args), pos_(begin), end_(end), io_(io) {}
+
+    // Evaluates the whole expression into result.  Returns false (after
+    // printing why) if the expression is malformed.
+    bool evaluate(bool& result) {
+        if (pos_ == end_) {
+            result = false;
+            return true;
+        }
+        if (!expr(result)) {
+            return false;
+        }
+        if (pos_ != end_) {
+            return fail("extra argument '" + args_[pos_] + "'");
+        }
+        return true;
+    }
+
+ private:
+    bool fail(const string& why) {
+        stage_err(io_) << args_[0] << ": " << why << endl;
+        return false;
+    }
+
+    bool expr(bool& result) {
+        if (!and_expr(result)) {
+            return false;
+        }
+        while (pos_ < end_ && args_[pos_] == "-o") {
+            pos_++;
+            bool rhs;
+            if (!and_expr(rhs)) {
+                return false;
+            }
+            result = result || rhs;
+        }
+        return true;
+    }
+
+    bool and_expr(bool& result) {
+        if (!not_expr(result)) {
+            return false;
+        }
+        while (pos_ < end_ && args_[pos_] == "-a") {
+            pos_++;
+            bool rhs;
+            if (!not_expr(rhs)) {
+                return false;
+            }
+            result = result && rhs;
+        }
+        return true;
+    }
+
+    bool not_expr(bool& result) {
+        // `! = x` compares "!" with "x", it doesn't negate anything.
+        if (pos_ < end_ && args_[pos_] == "!" && pos_ + 1 < end_ &&
+            !(pos_ + 2 < end_ && is_binary(args_[pos_ + 1]))) {
+            pos_++;
+            if (!not_expr(result)) {
+                return false;
+            }
+            result = !result;
+            return true;
+        }
+        return primary(result);
+    }
+
+    bool primary(bool& result) {
+        if (pos_ == end_) {
+            return fail("missing argument after '" + args_[end_ - 1] + "'");
+        }
+        const string& arg = args_[pos_];
+
+        // A binary operator in second position wins over everything else,
+        // so `test -n = -n` compares two strings.
+        if (pos_ + 2 < end_ && is_binary(args_[pos_ + 1])) {
+            const string& op = args_[pos_ + 1];
+            const string& rhs = args_[pos_ + 2];
+            pos_ += 3;
+            return binary(arg, op, rhs, result);
+        }
+
+        if (arg == "(" && pos_ + 1 < end_) {
+            pos_++;
+            if (!expr(result)) {
+                return false;
+            }
+            if (pos_ == end_ || args_[pos_] != ")") {
+                return fail("missing ')'");
+            }
+            pos_++;
+            return true;
+        }
+
+        if (arg.size() == 2 && arg[0] == '-' && strchr("bcdefghknprsStuwxzLO", arg[1]) &&
+            pos_ + 1 < end_) {
+            const string& operand = args_[pos_ + 1];
+            pos_ += 2;
+            return unary(arg[1], operand, result);
+        }
+
+        if (pos_ + 1 < end_ && !is_connective(args_[pos_ + 1])) {
+            return fail("missing argument after '" + args_[pos_ + 1] + "'");
+        }
+        pos_++;
+        result = !arg.empty();
+        return true;
+    }
+
+    static bool is_connective(const string& arg) {
+        return arg == "-a" || arg == "-o" || arg == ")";
+    }
+
+    static bool is_binary(const string& op) {
+        static const char* const ops[] = {
+            "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+            "-nt", "-ot", "-ef",
+        };
+        for (const char* o : ops) {
+            if (op == o) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool integer(const string& s, long long& value) {
+        char* end;
+        errno = 0;
+        value = strtoll(s.c_str(), &end, 10);
+        if (s.empty() || *end != '\0' || errno != 0) {
+            return fail("invalid integer '" + s + "'");
+        }
+        return true;
+    }
+
+    bool binary(const string& lhs, const string& op, const string& rhs, bool& result) {
+        if (op == "=" || op == "==") {
+            result = lhs == rhs;
+        } else if (op == "!=") {
+            result = lhs != rhs;
+        } else if (op == "<") {
+            result = lhs < rhs;
+        } else if (op == ">") {
+            result = lhs > rhs;
+        } else if (op == "-nt" || op == "-ot" || op == "-ef") {
+            struct stat a, b;
+            bool have_a = stat(lhs.c_str(), &a) == 0;
+            bool have_b = stat(rhs.c_str(), &b) == 0;
+            if (op == "-ef") {
+                result = have_a && have_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+            } else {
+                struct stat& n = op == "-nt" ? a : b;
+                struct stat& o = op == "-nt" ? b : a;
+                bool have_n = op == "-nt" ? have_a : have_b;
+                bool have_o = op == "-nt" ? have_b : have_a;
+                result = have_n && (!have_o || n.st_mtim.tv_sec > o.st_mtim.tv_sec ||
+                                    (n.st_mtim.tv_sec == o.st_mtim.tv_sec &&
+                                     n.st_mtim.tv_nsec > o.st_mtim.tv_nsec));
+            }
+        } else {
+            long long a, b;
+            if (!integer(lhs, a) || !integer(rhs, b)) {
+                return false;
+            }
+            if (op == "-eq") result = a == b;
+            else if (op == "-ne") result = a != b;
+            else if (op == "-lt") result = a < b;
+            else if (op == "-le") result = a <= b;
+            else if (op == "-gt") result = a > b;
+            else result = a >= b;
+        }
+        return true;
+    }
+
+    bool unary(char op, const string& operand, bool& result) {
+        if (op == 'z' || op == 'n') {
+            result = operand.empty() == (op == 'z');
+            return true;
+        }
+        if (op == 't') {
+            long long fd;
+            if (!integer(operand, fd)) {
+                return false;
+            }
+            result = isatty(static_cast<int>(fd));
+            return true;
+        }
+        if (op == 'r' || op == 'w' || op == 'x') {
+            int mode = op == 'r' ? R_OK : op == 'w' ? W_OK : X_OK;
+            result = access(operand.c_str(), mode) == 0;
+            return true;
+        }
+
+        struct stat st;
+        int rc = (op == 'h' || op == 'L') ? lstat(operand.c_str(), &st)
+                                          : stat(operand.c_str(), &st);
+        if (rc != 0) {
+            result = false;
+            return true;
+        }
+        switch (op) {
+            case 'b': result = S_ISBLK(st.st_mode); break;
+            case 'c': result = S_ISCHR(st.st_mode); break;
+            case 'd': result = S_ISDIR(st.st_mode); break;
+            case 'e': result = true; break;
+            case 'f': result = S_ISREG(st.st_mode); break;
+            case 'g': result = (st.st_mode & S_ISGID) != 0; break;
+            case 'h':
+            case 'L': result = S_ISLNK(st.st_mode); break;
+            case 'k': result = (st.st_mode & S_ISVTX) != 0; break;
+            case 'p': result = S_ISFIFO(st.st_mode); break;
+            case 's': result = st.st_size > 0; break;
+            case 'S': result = S_ISSOCK(st.st_mode); break;
+            case 'u': result = (st.st_mode & S_ISUID) != 0; break;
+            case 'O': result = st.st_uid == geteuid(); break;
+            default: result = false; break;
+        }
+        return true;
+    }
+
+    const vector<string>& args_;
+    size_t pos_;
+    size_t end_;
+    const StageIO& io_;
+};
+
+}  // namespace
+
+int builtin_test(const vector<string>& args, StageIO& io) {
+    size_t end = args.size();
+    if (args[0] == "[") {
+        if (end < 2 || args[end - 1] != "]") {
+            stage_err(io) << "[: missing ']'" << endl;
+            return kTestError;
+        }
+        end--;
+    }
+
+    bool result;
+    test_parser parser(args, 1, end, io);
+    if (!parser.evaluate(result)) {
+        return kTestError;
+    }
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
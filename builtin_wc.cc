@@ -0,0 +1,230 @@
+#include "builtins.h"
+
+#include <unistd.h>    // for close()
+#include <fcntl.h>     // for open()
+#include <sys/stat.h>  // for stat(), fstat()
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>  // for EXIT_SUCCESS, EXIT_FAILURE
+#include <cstring>  // for memchr(), strerror()
+#include <iostream>
+
+using std::endl;
+using std::string;
+using std::vector;
+
+static const size_t kReadSize = 128 * 1024;
+
+bool parse_wc(const vector<string>& args, wc_command& cmd) {
+    bool no_more_options = false;
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (no_more_options || arg.size() < 2 || arg[0] != '-') {
+            cmd.files.push_back(arg);
+        } else if (arg == "--") {
+            no_more_options = true;
+        } else if (arg == "--lines") {
+            cmd.lines = true;
+        } else if (arg == "--words") {
+            cmd.words = true;
+        } else if (arg == "--bytes") {
+            cmd.bytes = true;
+        } else if (arg[1] == '-') {
+            return false;
+        } else {
+            for (size_t j = 1; j < arg.size(); j++) {
+                switch (arg[j]) {
+                case 'l': cmd.lines = true; break;
+                case 'w': cmd.words = true; break;
+                case 'c': cmd.bytes = true; break;
+                default: return false;
+                }
+            }
+        }
+    }
+    if (!cmd.lines && !cmd.words && !cmd.bytes) {
+        cmd.lines = cmd.words = cmd.bytes = true;
+    }
+    return true;
+}
+
+bool wc_accepts(const vector<string>& args) {
+    wc_command cmd;
+    return parse_wc(args, cmd);
+}
+
+// What a byte does to word counting.  In the C locale coreutils wc ends a
+// word at white space and starts one at a printable character; any other
+// byte neither starts nor ends a word.
+enum byte_class : unsigned char { kOther, kSpace, kPrint };
+
+struct byte_classes {
+    byte_class of[256];
+    byte_classes() {
+        for (int c = 0; c < 256; c++) {
+            of[c] = (c == ' ' || (c >= '\t' && c <= '\r')) ? kSpace
+                  : (c > ' ' && c < 0x7f) ? kPrint : kOther;
+        }
+    }
+};
+
+static const byte_classes kClasses;
+
+void wc_count(const char* buf, size_t len, wc_counts& counts) {
+    counts.bytes += len;
+    bool in_word = counts.in_word;
+    long words = 0;
+    long lines = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = buf[i];
+        switch (kClasses.of[c]) {
+        case kSpace:
+            lines += c == '\n';
+            in_word = false;
+            break;
+        case kPrint:
+            words += !in_word;
+            in_word = true;
+            break;
+        case kOther:
+            break;
+        }
+    }
+    counts.lines += lines;
+    counts.words += words;
+    counts.in_word = in_word;
+}
+
+// Just the newlines, which memchr() finds much faster than the loop above.
+static void count_lines(const char* buf, size_t len, wc_counts& counts) {
+    counts.bytes += len;
+    const char* end = buf + len;
+    for (const char* p = buf; (p = static_cast<const char*>(memchr(p, '\n', end - p))); p++) {
+        counts.lines++;
+    }
+}
+
+string wc_format(const wc_command& cmd, const wc_counts& counts, int width,
+                 const string& name) {
+    string line;
+    auto field = [&line, width](long n) {
+        string digits = std::to_string(n);
+        if (!line.empty()) {
+            line += ' ';
+        }
+        if (static_cast<int>(digits.size()) < width) {
+            line.append(width - digits.size(), ' ');
+        }
+        line += digits;
+    };
+    if (cmd.lines) {
+        field(counts.lines);
+    }
+    if (cmd.words) {
+        field(counts.words);
+    }
+    if (cmd.bytes) {
+        field(counts.bytes);
+    }
+    if (!name.empty()) {
+        line += ' ';
+        line += name;
+    }
+    line += '\n';
+    return line;
+}
+
+// Counts everything readable from src's input.  Returns false, after
+// printing why, if reading failed.
+static bool count_input(const StageIO& src, const wc_command& cmd, const string& name,
+                        wc_counts& counts) {
+    static thread_local char buf[kReadSize];
+    while (true) {
+        ssize_t n = stage_read(src, buf, sizeof(buf));
+        if (n < 0) {
+            stage_err(src) << "wc: " << name << ": " << strerror(errno) << endl;
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        if (cmd.words) {
+            wc_count(buf, n, counts);
+        } else {
+            count_lines(buf, n, counts);
+        }
+    }
+}
+
+int builtin_wc(const vector<string>& args, StageIO& io) {
+    wc_command cmd;
+    if (!parse_wc(args, cmd)) {
+        stage_err(io) << "wc: unsupported arguments" << endl;
+        return EXIT_FAILURE;
+    }
+    bool named = !cmd.files.empty();
+    if (!named) {
+        cmd.files.push_back("-");
+    }
+
+    // Like coreutils, the columns are wide enough for the sum of the sizes
+    // of the regular files, and at least 7 wide if anything else (a pipe)
+    // is counted; operands that can't be stat()ed don't count.  One count
+    // of one input is printed as is.
+    int width = 1;
+    if (!(cmd.files.size() == 1 && cmd.lines + cmd.words + cmd.bytes == 1)) {
+        int min_width = 1;
+        unsigned long long regular_total = 0;
+        for (size_t i = 0; i < cmd.files.size(); i++) {
+            struct stat st;
+            int rc = cmd.files[i] != "-" ? stat(cmd.files[i].c_str(), &st)
+                   : io.in_ring == nullptr ? fstat(io.in, &st) : -1;
+            if (rc == 0 && S_ISREG(st.st_mode)) {
+                regular_total += st.st_size;
+            } else if (rc == 0 || cmd.files[i] == "-") {
+                min_width = 7;
+            }
+        }
+        for (; regular_total >= 10; regular_total /= 10) {
+            width++;
+        }
+        width = std::max(width, min_width);
+    }
+
+    bool trouble = false;
+    wc_counts total;
+    for (const auto& file : cmd.files) {
+        StageIO src = io;
+        if (file != "-") {
+            src.in = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+            src.in_ring = nullptr;
+            if (src.in < 0) {
+                stage_err(io) << "wc: " << file << ": " << strerror(errno) << endl;
+                trouble = true;
+                continue;
+            }
+        }
+        wc_counts counts;
+        if (!count_input(src, cmd, file, counts)) {
+            trouble = true;
+        }
+        if (file != "-") {
+            close(src.in);
+        }
+        string line = wc_format(cmd, counts, width, named ? file : "");
+        if (!stage_write(io, line.data(), line.size())) {
+            return EXIT_FAILURE;
+        }
+        total.lines += counts.lines;
+        total.words += counts.words;
+        total.bytes += counts.bytes;
+    }
+    if (cmd.files.size() > 1) {
+        string line = wc_format(cmd, total, width, "total");
+        if (!stage_write(io, line.data(), line.size())) {
+            return EXIT_FAILURE;
+        }
+    }
+    return trouble ? EXIT_FAILURE : EXIT_SUCCESS;
+}
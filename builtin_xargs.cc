@@ -0,0 +1,457 @@
+#include "builtins.h"
+
+#include <poll.h>    // for poll()
+#include <unistd.h>  // for sysconf()
+
+#include <algorithm>  // for std::max()
+#include <cctype>     // for isdigit()
+#include <cerrno>
+#include <cstdint>  // for SIZE_MAX
+#include <cstdlib>  // for strtol(), EXIT_SUCCESS, EXIT_FAILURE
+#include <cstring>  // for strchr(), strlen(), strerror()
+#include <iostream>
+#include <map>
+#include <thread>
+
+#include "pipeline.h"
+
+using std::endl;
+using std::map;
+using std::string;
+using std::vector;
+
+extern char** environ;
+
+static const size_t kReadSize = 64 * 1024;
+
+// Room left on a command line for what the exec'd program adds, as
+// POSIX suggests.
+static const size_t kArgHeadroom = 2048;
+
+// xargs' exit statuses: a command failed, exited with 255, was killed,
+// couldn't be run, wasn't found.
+static const int kCommandFailed = 123;
+static const int kCommandAborted = 124;
+static const int kCommandKilled = 125;
+static const int kCommandNotRun = 126;
+static const int kCommandNotFound = 127;
+
+namespace {
+
+// An xargs command line, parsed.
+struct xargs_command {
+    bool null = false;           // -0: items end at NULs
+    bool in_order = false;       // -k: outputs in the order of the input
+    bool run_if_empty = true;    // cleared by -r
+    long max_args = 0;           // -n; 0 for as many as fit
+    long jobs = 1;               // -P
+    string replace;              // -I: one line per command, put where this is
+    vector<string> cmd = {"echo"};
+};
+
+// Cuts the input into items: words separated by blanks and newlines, NUL
+// terminated strings with -0, or lines with -I.  Without -0, quotes and
+// backslashes work as in GNU xargs: '...' and "..." keep what they enclose
+// (but a newline) in the item, and a backslash keeps the character after
+// it, so `'a b' c` is the two items `a b` and `c`.
+class item_reader {
+ public:
+    item_reader(const StageIO& io, const xargs_command& cmd) : io_(io), cmd_(cmd) {}
+
+    // Takes the next item from what has been read.  Returns false if
+    // there is none: more has to be read, or the input is at its end.
+    bool take(string& item);
+
+    // Reads more input.  Blocks unless ready().
+    void fill();
+
+    // Whether fill() can read without blocking: the input is a pipe that
+    // poll() says is readable.  A ring from a builtin stage is assumed to
+    // be, and read anyway.
+    bool ready() const;
+
+    // The input is at its end, or at an unmatched quote, which ends it.
+    bool at_end() const { return at_end_; }
+    bool unmatched_quote() const { return unmatched_quote_; }
+    int fd() const { return io_.in_ring != nullptr ? -1 : io_.in; }
+
+ private:
+    // Takes the next quoted item; what take() does without -0.
+    bool take_quoted(string& item);
+
+    const StageIO& io_;
+    const xargs_command& cmd_;
+    string buf_;
+    size_t pos_ = 0;
+    bool at_end_ = false;
+    bool unmatched_quote_ = false;
+};
+
+bool item_reader::take(string& item) {
+    if (!cmd_.null) {
+        return take_quoted(item);
+    }
+    while (pos_ < buf_.size()) {
+        size_t end = buf_.find('\0', pos_);
+        if (end == string::npos && !at_end_) {
+            break;  // the item may go on in what hasn't been read
+        }
+        end = std::min(end, buf_.size());
+        item.assign(buf_, pos_, end - pos_);
+        pos_ = std::min(end + 1, buf_.size());
+        return true;
+    }
+    buf_.erase(0, pos_);
+    pos_ = 0;
+    return false;
+}
+
+bool item_reader::take_quoted(string& item) {
+    // With -I items are lines, so only newlines end them; blanks at the
+    // start of a line are still dropped.
+    const char* separators = cmd_.replace.empty() ? " \t\n" : "\n";
+    while (pos_ < buf_.size() && !unmatched_quote_) {
+        size_t i = buf_.find_first_not_of(cmd_.replace.empty() ? " \t\n" : " \t", pos_);
+        if (i == string::npos) {
+            pos_ = buf_.size();
+            break;
+        }
+        if (buf_[i] == '\n') {
+            pos_ = i + 1;  // an empty line is no item
+            continue;
+        }
+        item.clear();
+        bool complete = false;
+        while (i < buf_.size() && !complete) {
+            char c = buf_[i];
+            if (c == '\\') {
+                if (i + 1 == buf_.size()) {
+                    i = at_end_ ? i + 1 : i;  // a backslash ending the input is dropped
+                    break;
+                }
+                item += buf_[i + 1];
+                i += 2;
+            } else if (c == '\'' || c == '"') {
+                size_t close = buf_.find_first_of(c == '\'' ? "'\n" : "\"\n", i + 1);
+                if (close == string::npos && !at_end_) {
+                    break;
+                }
+                if (close == string::npos || buf_[close] == '\n') {
+                    stage_err(io_) << "xargs: unmatched " << (c == '\'' ? "single" : "double")
+                                   << " quote; by default quotes are special to xargs unless"
+                                   << " you use the -0 option" << endl;
+                    unmatched_quote_ = true;
+                    at_end_ = true;
+                    break;
+                }
+                item.append(buf_, i + 1, close - i - 1);
+                i = close + 1;
+            } else if (strchr(separators, c) != nullptr) {
+                complete = true;
+                i++;
+            } else {
+                size_t end = std::min(buf_.find_first_of(string(separators) + "\\'\"", i),
+                                      buf_.size());
+                item.append(buf_, i, end - i);
+                i = end;
+            }
+        }
+        if (unmatched_quote_) {
+            break;
+        }
+        if (complete || (i == buf_.size() && at_end_)) {
+            pos_ = i;
+            return true;
+        }
+        break;  // the item may go on in what hasn't been read
+    }
+    buf_.erase(0, pos_);
+    pos_ = 0;
+    return false;
+}
+
+void item_reader::fill() {
+    size_t used = buf_.size();
+    buf_.resize(used + kReadSize);
+    ssize_t n = stage_read(io_, &buf_[used], kReadSize);
+    buf_.resize(used + (n > 0 ? n : 0));
+    if (n <= 0) {
+        at_end_ = true;
+    }
+}
+
+bool item_reader::ready() const {
+    if (fd() < 0) {
+        return true;
+    }
+    pollfd p = {fd(), POLLIN, 0};
+    return ::poll(&p, 1, 0) > 0;
+}
+
+// A batch of items waiting for a free job slot.
+struct batch {
+    vector<string> items;
+    size_t size = 0;  // what the command line takes of ARG_MAX
+};
+
+// A command that finished, and what xargs has to say about it.
+struct finished_command {
+    pipeline_result result;
+    string diagnostic;
+};
+
+}  // namespace
+
+// Parses a count for -n or -P: plain decimal digits.
+static bool parse_count(const string& count, long& n) {
+    if (count.empty() || !isdigit(static_cast<unsigned char>(count[0]))) {
+        return false;
+    }
+    char* end;
+    errno = 0;
+    n = strtol(count.c_str(), &end, 10);
+    return *end == '\0' && errno == 0;
+}
+
+// Parses an xargs command line.  Returns false if it needs something only
+// the real xargs has (-d, -L, -s ...), or is malformed.
+static bool parse_xargs(const vector<string>& args, xargs_command& cmd) {
+    size_t i = 1;
+    for (; i < args.size() && args[i].size() > 1 && args[i][0] == '-'; i++) {
+        const string& arg = args[i];
+        if (arg == "--") {
+            i++;
+            break;
+        }
+        if (arg == "-0") {
+            cmd.null = true;
+            continue;
+        }
+        if (arg == "-k") {
+            cmd.in_order = true;
+            continue;
+        }
+        if (arg == "-r") {
+            cmd.run_if_empty = false;
+            continue;
+        }
+        char option = arg[1];
+        if (option != 'n' && option != 'P' && option != 'I') {
+            return false;
+        }
+        string value = arg.substr(2);
+        if (value.empty()) {
+            if (i + 1 == args.size()) {
+                return false;
+            }
+            value = args[++i];
+        }
+        if (option == 'I') {
+            cmd.replace = value;
+        } else if (!parse_count(value, option == 'n' ? cmd.max_args : cmd.jobs) ||
+                   (option == 'n' && cmd.max_args == 0)) {
+            return false;
+        }
+    }
+    if (i < args.size()) {
+        cmd.cmd.assign(args.begin() + i, args.end());
+    }
+    if (cmd.null && !cmd.replace.empty()) {
+        return false;
+    }
+    // -P 0 is one job per core rather than no limit at all.
+    if (cmd.jobs == 0) {
+        cmd.jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return true;
+}
+
+bool xargs_accepts(const vector<string>& args) {
+    xargs_command cmd;
+    return parse_xargs(args, cmd);
+}
+
+// How much of ARG_MAX an argument takes: its characters, NUL and pointer.
+static size_t arg_size(const string& arg) {
+    return arg.size() + 1 + sizeof(char*);
+}
+
+// What the command lines may take of ARG_MAX: the environment is passed
+// along with them.
+static size_t command_line_limit() {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t limit = arg_max > 0 ? arg_max : 128 * 1024;
+    for (char** env = environ; *env != nullptr; env++) {
+        limit -= std::min(limit, strlen(*env) + 1 + sizeof(char*));
+    }
+    return limit > kArgHeadroom ? limit - kArgHeadroom : 0;
+}
+
+// The command line running a batch: the items after the command's own
+// arguments, or with -I each put in place of the replace string.
+static vector<string> command_for(const xargs_command& cmd, const batch& b) {
+    vector<string> argv = cmd.cmd;
+    if (cmd.replace.empty()) {
+        argv.insert(argv.end(), b.items.begin(), b.items.end());
+        return argv;
+    }
+    for (auto& arg : argv) {
+        for (size_t at = 0; (at = arg.find(cmd.replace, at)) != string::npos;) {
+            arg.replace(at, cmd.replace.size(), b.items[0]);
+            at += b.items[0].size();
+        }
+    }
+    return argv;
+}
+
+// xargs' status for a finished command, with GNU xargs' message where
+// it has one.  Returns true if no more commands are to be started: this
+// one couldn't be run, was killed or exited with 255.
+static bool xargs_status(const string& name, const pipeline_result& r, int& status,
+                         string& diagnostic) {
+    int error = r.error != 0 ? r.error : r.spawn_errors.back();
+    if (error != 0) {
+        diagnostic = "xargs: " + name + ": " + strerror(error) + "\n";
+        status = error == ENOENT ? kCommandNotFound : kCommandNotRun;
+        return true;
+    }
+    if (r.signals.back() != 0) {
+        diagnostic =
+            "xargs: " + name + ": terminated by signal " + std::to_string(r.signals.back()) + "\n";
+        status = kCommandKilled;
+        return true;
+    }
+    if (r.status == 255) {
+        diagnostic = "xargs: " + name + ": exited with status 255; aborting\n";
+        status = kCommandAborted;
+        return true;
+    }
+    status = r.status != 0 ? kCommandFailed : EXIT_SUCCESS;
+    return false;
+}
+
+// Runs the command on the input's items, up to -P commands at a time.
+// The commands are started by a pipeline_runner -- posix_spawn() and a
+// pidfd each, or a thread for a builtin -- and reaped from its epoll loop
+// on this thread, which waits on that and the input at once.  A command
+// is started as soon as its batch is complete and a slot is free, so the
+// run queue is the input itself: whichever job finishes first takes the
+// next batch.  Each command's output is collected and written whole when
+// it finishes, so no two commands' lines interleave.  As in GNU xargs, a
+// command that couldn't be run, was killed or exited with 255 ends the
+// run: no more are started, and the ones running are waited for.
+int builtin_xargs(const vector<string>& args, StageIO& io) {
+    xargs_command cmd;
+    if (!parse_xargs(args, cmd)) {
+        stage_err(io) << "usage: xargs [-0kr] [-n MAX] [-P JOBS] [-I REPLACE] [COMMAND [ARG]...]"
+                      << endl;
+        return EXIT_FAILURE;
+    }
+    size_t limit = command_line_limit();
+    size_t base = 0;
+    for (const auto& arg : cmd.cmd) {
+        base += arg_size(arg);
+    }
+    size_t max_items = !cmd.replace.empty() ? 1 : cmd.max_args > 0 ? cmd.max_args : SIZE_MAX;
+
+    item_reader reader(io, cmd);
+    bool writing = true;
+    int status = EXIT_SUCCESS;
+    uint64_t started = 0;
+    uint64_t next_out = 0;  // with -k, the job whose output goes next
+    int stop_status = 0;  // set by the first command that stops the run
+    map<uint64_t, finished_command> held;
+    auto emit = [&](finished_command& f) {
+        const pipeline_result& r = f.result;
+        if (!r.err.empty()) {
+            stage_err(io) << r.err << std::flush;
+        }
+        if (writing) {
+            writing = stage_write(io, r.out.data(), r.out.size());
+        }
+        stage_err(io) << f.diagnostic << std::flush;
+    };
+    pipeline_runner runner;  // after what its callbacks use
+    auto launch = [&](const batch& b) {
+        pipeline p;
+        p.stage(command_for(cmd, b));
+        string name = p.stages()[0][0];
+        uint64_t seq = started++;
+        runner.start(p, [&, seq, name](pipeline_result&& r) {
+            finished_command f;
+            int command_status;
+            if (xargs_status(name, r, command_status, f.diagnostic) && stop_status == 0) {
+                stop_status = command_status;
+            }
+            status = std::max(status, command_status);
+            if (r.spawn_errors.back() != 0) {
+                r.err.clear();  // the runner's own message, which the diagnostic replaces
+            }
+            f.result = std::move(r);
+            if (!cmd.in_order) {
+                emit(f);
+                return;
+            }
+            held[seq] = std::move(f);
+            for (auto it = held.begin(); it != held.end() && it->first == next_out;
+                 it = held.erase(it), next_out++) {
+                emit(it->second);
+            }
+        });
+    };
+
+    batch next;
+    string item;
+    bool have_item = false;  // an item that didn't fit the last batch
+    while (writing && stop_status == 0) {
+        while (next.items.size() < max_items && (have_item || reader.take(item))) {
+            if (!next.items.empty() && base + next.size + arg_size(item) > limit) {
+                have_item = true;
+                break;
+            }
+            next.items.push_back(item);
+            next.size += arg_size(item);
+            have_item = false;
+        }
+        bool full = next.items.size() == max_items || have_item;
+        bool last = reader.at_end() && !have_item;
+        if (full || (last && !next.items.empty()) ||
+            (last && started == 0 && cmd.run_if_empty && cmd.replace.empty() &&
+             !reader.unmatched_quote())) {
+            if (runner.running() >= static_cast<size_t>(cmd.jobs)) {
+                runner.poll(-1);
+                continue;
+            }
+            launch(next);
+            next = batch();
+            continue;
+        }
+        if (last) {
+            break;
+        }
+        // More input is needed: wait for it and for the jobs at once.
+        if (runner.running() > 0 && !reader.ready()) {
+            if (reader.fd() >= 0) {
+                pollfd fds[2] = {{reader.fd(), POLLIN, 0}, {runner.fd(), POLLIN, 0}};
+                if (::poll(fds, 2, -1) < 0 && errno != EINTR) {
+                    stage_err(io) << "xargs: " << strerror(errno) << endl;
+                    break;
+                }
+                if (fds[1].revents != 0) {
+                    runner.poll(0);
+                }
+                if (fds[0].revents == 0) {
+                    continue;
+                }
+            } else {
+                runner.poll(0);
+            }
+        }
+        reader.fill();
+    }
+    runner.run();
+    if (stop_status != 0) {
+        return stop_status;
+    }
+    return writing && !reader.unmatched_quote() ? status : EXIT_FAILURE;
+}
@@ -0,0 +1,224 @@
+#include "builtins.h"
+
+#include <unistd.h> // for read(), write(), getcwd()
+#include <cerrno>
+#include <cstdint>  // for uint32_t
+#include <cstdlib>  // for EXIT_SUCCESS, EXIT_FAILURE
+#include <cstring>  // for strerror()
+#include <iostream>
+#include <streambuf>
+
+#include "byte_ring.h"
+#include "command_path.h"
+#include "coproc.h"
+#include "latency.h"
+#include "metrics.h"
+#include "plugins.h"
+#include "replicate.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+struct builtin_entry {
+    const char* name;
+    builtin_fn fn;
+    // If set, the builtin only runs the command lines this accepts.
+    bool (*accepts)(const vector<string>&);
+};
+
+static int builtin_true(const vector<string>&, StageIO&) {
+    return EXIT_SUCCESS;
+}
+
+static int builtin_false(const vector<string>&, StageIO&) {
+    return EXIT_FAILURE;
+}
+
+static int builtin_pwd(const vector<string>&, StageIO& io) {
+    char buf[4096];
+    if (getcwd(buf, sizeof(buf)) == nullptr) {
+        stage_err(io) << "pwd: " << strerror(errno) << endl;
+        return EXIT_FAILURE;
+    }
+    string line = string(buf) + "\n";
+    return stage_write(io, line.data(), line.size()) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static constexpr builtin_entry builtins[] = {
+    {"tail", builtin_tail, tail_accepts},
+    {"echo", builtin_echo, nullptr},
+    {"printf", builtin_printf, nullptr},
+    {"true", builtin_true, nullptr},
+    {"false", builtin_false, nullptr},
+    {"test", builtin_test, nullptr},
+    {"[", builtin_test, nullptr},
+    {"pwd", builtin_pwd, nullptr},
+    {"ls", builtin_ls, ls_accepts},
+    {"grep", builtin_grep, grep_accepts},
+    {"grep-chain", builtin_grep, nullptr},
+    {"cat", builtin_cat, cat_accepts},
+    {"head", builtin_head, head_accepts},
+    {"wc", builtin_wc, wc_accepts},
+    {"load", builtin_load, nullptr},
+    {"meter", builtin_meter, nullptr},
+    {"stats", builtin_stats, nullptr},
+    {"hash", builtin_hash, nullptr},
+    {"coproc", builtin_coproc, nullptr},
+    {"xargs", builtin_xargs, xargs_accepts},
+    {"sort", builtin_sort, sort_accepts},
+};
+
+static constexpr size_t kNumBuiltins = sizeof(builtins) / sizeof(builtins[0]);
+
+// Builtin names are looked up before every fork, so the lookup is a
+// perfect hash: the slot of every name is computed at compile time and
+// the static_assert below refuses to build if two names share a slot.
+// When adding a builtin trips it, change kBuiltinHashSeed.
+static constexpr uint32_t kBuiltinHashSeed = 2166136305u;
+static constexpr unsigned kBuiltinSlots = 64;
+
+// FNV-1a, folded into kBuiltinSlots slots.
+static constexpr uint32_t fnv1a(const char* s, uint32_t h) {
+    return *s == '\0' ? h : fnv1a(s + 1, (h ^ static_cast<unsigned char>(*s)) * 16777619u);
+}
+
+static constexpr unsigned builtin_slot(const char* name) {
+    return (fnv1a(name, kBuiltinHashSeed) >> 7) % kBuiltinSlots;
+}
+
+static constexpr bool collides_with_later(size_t i, size_t j) {
+    return j == kNumBuiltins ? false
+        : builtin_slot(builtins[i].name) == builtin_slot(builtins[j].name) ||
+          collides_with_later(i, j + 1);
+}
+
+static constexpr bool is_perfect(size_t i) {
+    return i == kNumBuiltins ? true : !collides_with_later(i, i + 1) && is_perfect(i + 1);
+}
+
+static_assert(is_perfect(0), "builtin names collide, change kBuiltinHashSeed");
+
+// Index into builtins[] of the name hashing to slot, or -1.
+static constexpr int entry_for_slot(unsigned slot, size_t i) {
+    return i == kNumBuiltins ? -1
+        : builtin_slot(builtins[i].name) == slot ? static_cast<int>(i)
+        : entry_for_slot(slot, i + 1);
+}
+
+#define SLOT(n) entry_for_slot(n, 0)
+#define SLOTS8(n) SLOT(n), SLOT(n + 1), SLOT(n + 2), SLOT(n + 3), \
+                  SLOT(n + 4), SLOT(n + 5), SLOT(n + 6), SLOT(n + 7)
+
+static constexpr int slots[kBuiltinSlots] = {
+    SLOTS8(0), SLOTS8(8), SLOTS8(16), SLOTS8(24),
+    SLOTS8(32), SLOTS8(40), SLOTS8(48), SLOTS8(56),
+};
+
+#undef SLOTS8
+#undef SLOT
+
+// Index into builtins[] of name, or -1.
+static int builtin_index(const string& name) {
+    int i = slots[builtin_slot(name.c_str())];
+    return i >= 0 && name.compare(builtins[i].name) == 0 ? i : -1;
+}
+
+bool is_builtin_name(const string& name) {
+    return builtin_index(name) >= 0;
+}
+
+builtin_fn find_builtin(const vector<string>& cmd) {
+    int i = builtin_index(cmd[0]);
+    if (i < 0 && is_replicated_stage(cmd)) {
+        return builtin_replicate;
+    }
+    if (i < 0 && is_coproc_stage(cmd)) {
+        return builtin_coproc_stage;
+    }
+    if (i < 0) {
+        // Plugins come after the builtins, but before the PATH.
+        return find_plugin_stage(cmd[0]);
+    }
+    if (builtins[i].accepts != nullptr && !builtins[i].accepts(cmd)) {
+        return nullptr;
+    }
+    return builtins[i].fn;
+}
+
+bool write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+        note_output(fd);
+    }
+    return true;
+}
+
+ssize_t stage_read(const StageIO& io, char* buf, size_t len) {
+    if (io.in_ring != nullptr) {
+        return io.in_ring->read(buf, len);
+    }
+    while (true) {
+        ssize_t n = read(io.in, buf, len);
+        if (n >= 0 || errno != EINTR) {
+            return n;
+        }
+    }
+}
+
+bool stage_write(const StageIO& io, const char* buf, size_t len) {
+    count_metric(metrics.builtin_bytes, len);
+    if (io.out_ring != nullptr) {
+        return io.out_ring->write(buf, len);
+    }
+    if (io.capture != nullptr) {
+        io.capture->append(buf, len);
+        return true;
+    }
+    return write_all(io.out, buf, len);
+}
+
+namespace {
+
+// A streambuf appending what is written through it to a string.
+class append_buf : public std::streambuf {
+ public:
+    void set_target(string* target) { target_ = target; }
+
+ protected:
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            target_->push_back(traits_type::to_char_type(c));
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        target_->append(s, n);
+        return n;
+    }
+
+ private:
+    string* target_ = nullptr;
+};
+
+}  // namespace
+
+std::ostream& stage_err(const StageIO& io) {
+    if (io.err == nullptr) {
+        return cerr;
+    }
+    static thread_local append_buf buf;
+    static thread_local std::ostream err(&buf);
+    buf.set_target(io.err);
+    return err;
+}
@@ -0,0 +1,218 @@
+#ifndef BUILTINS_H_
+#define BUILTINS_H_
+
+#include <sys/types.h> // for ssize_t
+#include <cstddef> // for size_t
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+class byte_ring;
+
+// Where a builtin reads its input from and writes its output to.  For a
+// builtin running as a pipeline stage these are the ends of the stage's
+// pipes, otherwise they are the shell's own stdin and stdout.  Between two
+// builtin stages there is no pipe: the stages share a byte_ring instead,
+// in_ring or out_ring is set and the matching descriptor is -1.  The last
+// stage of a command substitution writes straight into the shell's buffer:
+// capture is set and out is -1.  What the builtin prints on stderr goes to
+// err if that is set (a pipeline_runner collecting each job's stderr, a
+// copy of a replicated stage), else to the process's stderr.
+//
+// Builtins go through stage_read() and stage_write() for their stdin and
+// stdout, and stage_err() for their stderr, which handle all of these.
+struct StageIO {
+    int in;
+    int out;
+    byte_ring* in_ring;
+    byte_ring* out_ring;
+    std::string* capture;
+    std::string* err;
+};
+
+// A builtin takes its full argv (argv[0] is the builtin's name) and
+// returns an exit status, just like the main() of an external command.
+typedef int (*builtin_fn)(const std::vector<std::string>&, StageIO&);
+
+// Returns the builtin that runs cmd, or nullptr if cmd[0] is not a builtin
+// (or is one that can't handle these arguments) and has to be looked up on
+// the PATH.  Stages registered by plugins count as builtins here.
+builtin_fn find_builtin(const std::vector<std::string>& cmd);
+
+// Whether name is one of the shell's own builtins.
+bool is_builtin_name(const std::string& name);
+
+// Writes all len bytes of buf to fd, retrying on short writes.
+// Returns false if the write failed (e.g. the reader went away).
+bool write_all(int fd, const char* buf, size_t len);
+
+// read(2) and write_all() on a builtin's stdin and stdout.
+ssize_t stage_read(const StageIO& io, char* buf, size_t len);
+bool stage_write(const StageIO& io, const char* buf, size_t len);
+
+// The stream a builtin writes its error messages to: cerr, or, with io.err
+// set, one of the calling thread's own that appends to it.
+std::ostream& stage_err(const StageIO& io);
+
+// cat [FILE]..., without options.
+int builtin_cat(const std::vector<std::string>& args, StageIO& io);
+
+// Whether builtin_cat can run args; options go to the real cat.
+bool cat_accepts(const std::vector<std::string>& args);
+
+// echo [-neE] [ARG]...
+int builtin_echo(const std::vector<std::string>& args, StageIO& io);
+
+// grep [-iycvF] [-e] PATTERN [FILE]..., for literal patterns only, and
+// grep-chain [-c] {[-i] [-v] -e PATTERN}... [FILE]..., which prints the
+// lines passing every one of its filters -- what a chain of greps piped
+// into each other prints.
+int builtin_grep(const std::vector<std::string>& args, StageIO& io);
+
+// Whether builtin_grep can run args; everything else goes to the real grep.
+bool grep_accepts(const std::vector<std::string>& args);
+
+// One grep of a chain: a line passes if it contains pattern, or, with
+// invert, if it doesn't.
+struct grep_filter {
+    std::string pattern;
+    bool ignore_case;
+    bool invert;
+};
+
+// A grep or grep-chain command line, parsed.
+struct grep_command {
+    std::vector<grep_filter> filters;
+    bool count = false;
+    std::vector<std::string> files;
+};
+
+// Parses a grep or grep-chain command line.  Returns false if it needs
+// something only the real grep has (a regular expression, another option,
+// a locale whose characters aren't single bytes).
+bool parse_grep(const std::vector<std::string>& args, grep_command& cmd);
+
+// The grep-chain command line that runs cmd.
+std::vector<std::string> grep_chain_args(const grep_command& cmd);
+
+// head [-n N | -N] [FILE]...
+int builtin_head(const std::vector<std::string>& args, StageIO& io);
+
+// A head command line, parsed.
+struct head_command {
+    long lines = 10;
+    std::vector<std::string> files;
+};
+
+// Parses a head command line.  Returns false if it needs something only
+// the real head has (-c, -v, a negative count, ...), or is malformed.
+bool parse_head(const std::vector<std::string>& args, head_command& cmd);
+
+// Whether builtin_head can run args; everything else goes to the real head.
+bool head_accepts(const std::vector<std::string>& args);
+
+// ls [-al1] [FILE]...
+int builtin_ls(const std::vector<std::string>& args, StageIO& io);
+
+// Whether builtin_ls can run args; other options (-R, -h, ...) go to the
+// real ls.
+bool ls_accepts(const std::vector<std::string>& args);
+
+// meter [-l] [-i SECONDS] [-n NAME] [-u SOCKET]: passes its input through
+// unchanged, reporting to stderr (and, with -u, as datagrams to a unix
+// socket) how many bytes and lines went by and at what rate, every
+// SECONDS (default 1, 0 for only a final report).  Between pipes the data
+// is spliced without being copied; lines are then only counted with -l.
+int builtin_meter(const std::vector<std::string>& args, StageIO& io);
+
+// printf FORMAT [ARG]...
+int builtin_printf(const std::vector<std::string>& args, StageIO& io);
+
+// test EXPRESSION, or [ EXPRESSION ]
+int builtin_test(const std::vector<std::string>& args, StageIO& io);
+
+// sort [-nru] [-t SEP] [-k KEY]... [-S SIZE] [FILE]...: sorts lines by
+// their bytes, as the real sort does in the C locale.  A KEY is
+// FIRST[nr][,LAST[nr]] in fields.  Up to SIZE (default 256M) of input is
+// sorted in memory on the task pool; past that, sorted runs are spilled
+// to temporary files in $TMPDIR and merged.
+int builtin_sort(const std::vector<std::string>& args, StageIO& io);
+
+// Whether builtin_sort can run args, in the shell's collation locale;
+// everything else goes to the real sort.
+bool sort_accepts(const std::vector<std::string>& args);
+
+// tail [-n N | -N | -n +N] [-f] [FILE]...
+int builtin_tail(const std::vector<std::string>& args, StageIO& io);
+
+// A tail command line, parsed.
+struct tail_command {
+    long lines = 10;
+    bool from_start = false;  // -n +N: print starting with line N
+    bool follow = false;
+    std::vector<std::string> files;
+};
+
+// Parses a tail command line.  Returns false, with the reason in error,
+// if it is malformed.
+bool parse_tail(const std::vector<std::string>& args, tail_command& cmd, std::string& error);
+
+// Whether builtin_tail can run args; everything else (-c, -q, ...) goes to
+// the real tail.
+bool tail_accepts(const std::vector<std::string>& args);
+
+// Returns true if args (a tail command line) names at least one file,
+// i.e. tail will not read from its stdin.
+bool tail_has_file_operand(const std::vector<std::string>& args);
+
+// wc [-clw] [FILE]...
+int builtin_wc(const std::vector<std::string>& args, StageIO& io);
+
+// A wc command line, parsed.  With no option given all three counts are on.
+struct wc_command {
+    bool lines = false;
+    bool words = false;
+    bool bytes = false;
+    std::vector<std::string> files;
+};
+
+// Parses a wc command line.  Returns false if it needs something only the
+// real wc has (-m, -L, ...).
+bool parse_wc(const std::vector<std::string>& args, wc_command& cmd);
+
+// Whether builtin_wc can run args; everything else goes to the real wc.
+bool wc_accepts(const std::vector<std::string>& args);
+
+// What wc counts, and the state that carries over between pieces of input.
+struct wc_counts {
+    long lines = 0;
+    long words = 0;
+    long bytes = 0;
+    bool in_word = false;
+};
+
+// Adds the lines, words and bytes of [buf, buf+len) to counts, counting
+// words the way coreutils wc does in the C locale.
+void wc_count(const char* buf, size_t len, wc_counts& counts);
+
+// One line of wc output: the selected counts, each right-aligned to width,
+// then name unless it is empty.
+std::string wc_format(const wc_command& cmd, const wc_counts& counts, int width,
+                      const std::string& name);
+
+// xargs [-0kr] [-n MAX] [-P JOBS] [-I REPLACE] [COMMAND [ARG]...]: runs
+// COMMAND (echo by default) with the items of its input as arguments, as
+// many as fit on a command line or MAX, on up to JOBS commands at once (1
+// by default, one per core for 0).  Items are separated by blanks, with
+// no quoting; by NULs with -0; or are lines with -I, which runs a command
+// per line with REPLACE in its arguments standing for the line.  Each
+// command's output is written in one piece when it finishes, with -k in
+// the order of the input.  -r runs nothing on empty input.
+int builtin_xargs(const std::vector<std::string>& args, StageIO& io);
+
+// Whether builtin_xargs can run args; everything else goes to the real
+// xargs.
+bool xargs_accepts(const std::vector<std::string>& args);
+
+#endif  // BUILTINS_H_
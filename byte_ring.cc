@@ -0,0 +1,131 @@
+#include "byte_ring.h"
+
+#include <linux/futex.h>  // for FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE
+#include <sys/syscall.h>  // for SYS_futex
+#include <unistd.h>       // for syscall()
+
+#include <algorithm>
+#include <climits>  // for INT_MAX
+#include <cstring>  // for memcpy()
+
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::min;
+
+byte_ring::byte_ring(size_t capacity)
+    : head_(0), tail_(0), data_seq_(0), reader_sleeping_(false), writer_closed_(false),
+      space_seq_(0), writer_sleeping_(false), reader_closed_(false) {
+    size_t size = 4096;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    data_ = new char[size];
+    mask_ = size - 1;
+    wake_batch_ = size / 4;
+}
+
+byte_ring::~byte_ring() {
+    delete[] data_;
+}
+
+void byte_ring::wait(std::atomic<uint32_t>& word, uint32_t seen) {
+    // The futex only sleeps if word still holds seen, so a wake() that
+    // bumped it in the meantime isn't lost.
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, seen,
+            nullptr, nullptr, 0);
+}
+
+void byte_ring::wake(std::atomic<uint32_t>& word) {
+    word.fetch_add(1, memory_order_release);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, INT_MAX,
+            nullptr, nullptr, 0);
+}
+
+// The sleeping flags and the indices are stored and loaded sequentially
+// consistent: a side that announces it is going to sleep and then finds
+// the other index unchanged is guaranteed that the other side will see
+// the announcement after its next update.
+
+bool byte_ring::write(const char* buf, size_t len) {
+    size_t capacity = mask_ + 1;
+    size_t head = head_.load(memory_order_relaxed);
+    while (len > 0) {
+        if (reader_closed_.load(memory_order_acquire)) {
+            return false;
+        }
+        size_t tail = tail_.load(memory_order_acquire);
+        size_t room = capacity - (head - tail);
+        if (room == 0) {
+            uint32_t seen = space_seq_.load(memory_order_acquire);
+            writer_sleeping_.store(true);
+            if (tail_.load() == tail && !reader_closed_.load()) {
+                wait(space_seq_, seen);
+            }
+            writer_sleeping_.store(false, memory_order_relaxed);
+            continue;
+        }
+
+        size_t n = min(room, len);
+        size_t at = head & mask_;
+        size_t first = min(n, capacity - at);
+        memcpy(data_ + at, buf, first);
+        memcpy(data_, buf + first, n - first);
+        head += n;
+        buf += n;
+        len -= n;
+        head_.store(head);
+
+        if (reader_sleeping_.load()) {
+            wake(data_seq_);
+        }
+    }
+    return true;
+}
+
+void byte_ring::close_write() {
+    writer_closed_.store(true);
+    wake(data_seq_);
+}
+
+ssize_t byte_ring::read(char* buf, size_t len) {
+    size_t capacity = mask_ + 1;
+    size_t tail = tail_.load(memory_order_relaxed);
+    size_t head;
+    while ((head = head_.load(memory_order_acquire)) == tail) {
+        if (writer_closed_.load(memory_order_acquire)) {
+            // The writer may have written a last batch just before closing.
+            if (head_.load(memory_order_acquire) == tail) {
+                return 0;
+            }
+            continue;
+        }
+        uint32_t seen = data_seq_.load(memory_order_acquire);
+        reader_sleeping_.store(true);
+        if (head_.load() == tail && !writer_closed_.load()) {
+            wait(data_seq_, seen);
+        }
+        reader_sleeping_.store(false, memory_order_relaxed);
+    }
+
+    size_t n = min(head - tail, len);
+    size_t at = tail & mask_;
+    size_t first = min(n, capacity - at);
+    memcpy(buf, data_ + at, first);
+    memcpy(buf + first, data_, n - first);
+    tail += n;
+    tail_.store(tail);
+
+    // A blocked writer is only woken once it can write a good batch, not
+    // for every few bytes read.  The ring always drains to empty before
+    // this side sleeps, so a waiting writer is woken by then at the latest.
+    if (writer_sleeping_.load() && capacity - (head_.load(memory_order_acquire) - tail) >= wake_batch_) {
+        wake(space_seq_);
+    }
+    return static_cast<ssize_t>(n);
+}
+
+void byte_ring::close_read() {
+    reader_closed_.store(true);
+    wake(space_seq_);
+}
@@ -0,0 +1,75 @@
+#ifndef BYTE_RING_H_
+#define BYTE_RING_H_
+
+#include <sys/types.h>  // for ssize_t
+
+#include <atomic>
+#include <cstddef>  // for size_t
+#include <cstdint>
+
+// Bytes buffered between two builtin stages, like the capacity of a pipe.
+static const size_t kStageRingSize = 256 * 1024;
+
+// A pipe between two threads of the shell: a single-producer,
+// single-consumer ring of bytes.  Stages hand bytes over through shared
+// memory with no system call; a side only sleeps (on a futex) when the
+// ring is full or empty, and is only woken once a batch of space or data
+// has built up, so a busy pipeline doesn't pay a wakeup per write.
+//
+// Like a pipe, the ring reports EOF to the reader once the writer has
+// closed it, and fails the writer's writes once the reader has closed it.
+class byte_ring {
+ public:
+    // capacity is rounded up to a power of two.
+    explicit byte_ring(size_t capacity);
+    ~byte_ring();
+
+    byte_ring(const byte_ring&) = delete;
+    byte_ring& operator=(const byte_ring&) = delete;
+
+    // Producer side.  Blocks until all len bytes are in the ring; returns
+    // false if the reader closed its end first.
+    bool write(const char* buf, size_t len);
+    void close_write();
+
+    // Consumer side.  Blocks until there is data, then returns up to len
+    // bytes of it; returns 0 once the writer has closed and the ring is
+    // drained.
+    ssize_t read(char* buf, size_t len);
+    void close_read();
+
+    // Bytes in the ring, as a third thread sees it: a sample for
+    // monitoring, not something to synchronise on.
+    size_t used() const {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        return head_.load(std::memory_order_relaxed) - tail;
+    }
+    size_t capacity() const { return mask_ + 1; }
+
+ private:
+    // Sleeps on word while it still holds seen.
+    static void wait(std::atomic<uint32_t>& word, uint32_t seen);
+    static void wake(std::atomic<uint32_t>& word);
+
+    char* data_;
+    size_t mask_;
+    size_t wake_batch_;  // free space the writer waits for before it is woken
+
+    // Each index is written by one side only.  The padding keeps them (and
+    // the state each side sleeps on) on cache lines of their own, so the two
+    // sides don't keep stealing a line from each other.
+    std::atomic<size_t> head_;  // next byte to write
+    char pad_head_[64];
+    std::atomic<size_t> tail_;  // next byte to read
+    char pad_tail_[64];
+
+    std::atomic<uint32_t> data_seq_;  // bumped to wake the reader
+    std::atomic<bool> reader_sleeping_;
+    std::atomic<bool> writer_closed_;
+    char pad_data_[64];
+    std::atomic<uint32_t> space_seq_;  // bumped to wake the writer
+    std::atomic<bool> writer_sleeping_;
+    std::atomic<bool> reader_closed_;
+};
+
+#endif  // BYTE_RING_H_
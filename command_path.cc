@@ -0,0 +1,88 @@
+#include "command_path.h"
+
+#include <sys/stat.h>  // for stat()
+#include <unistd.h>    // for access()
+
+#include <cstdlib>  // for getenv(), EXIT_SUCCESS, EXIT_FAILURE
+#include <iostream>
+#include <map>
+#include <mutex>
+
+#include "metrics.h"
+
+using std::endl;
+using std::lock_guard;
+using std::map;
+using std::mutex;
+using std::string;
+using std::vector;
+
+// `hash` may run on a builtin thread while nothing else looks up
+// commands, but the lock costs nothing next to a fork.
+static mutex cache_lock;
+static map<string, string> cache;
+static string cached_path_var;
+
+static string search_path(const string& name, const string& path_var) {
+    size_t start = 0;
+    while (start <= path_var.size()) {
+        size_t end = path_var.find(':', start);
+        if (end == string::npos) {
+            end = path_var.size();
+        }
+        // An empty entry is the current directory.
+        string dir = end > start ? path_var.substr(start, end - start) : ".";
+        string file = dir + "/" + name;
+        struct stat st;
+        if (stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+            access(file.c_str(), X_OK) == 0) {
+            return file;
+        }
+        start = end + 1;
+    }
+    return "";
+}
+
+string find_command(const string& name) {
+    if (name.empty() || name.find('/') != string::npos) {
+        return name;
+    }
+    const char* path_var = getenv("PATH");
+    string current = path_var != nullptr ? path_var : "/bin:/usr/bin";
+    lock_guard<mutex> guard(cache_lock);
+    if (current != cached_path_var) {
+        cache.clear();
+        cached_path_var = current;
+    }
+    auto it = cache.find(name);
+    if (it != cache.end()) {
+        count_metric(metrics.path_hits);
+        return it->second;
+    }
+    count_metric(metrics.path_misses);
+    string file = search_path(name, current);
+    if (file.empty()) {
+        return name;
+    }
+    cache[name] = file;
+    return file;
+}
+
+int builtin_hash(const vector<string>& args, StageIO& io) {
+    if (args.size() > 2 || (args.size() == 2 && args[1] != "-r")) {
+        stage_err(io) << "usage: hash [-r]" << endl;
+        return EXIT_FAILURE;
+    }
+    string out;
+    {
+        lock_guard<mutex> guard(cache_lock);
+        if (args.size() == 2) {
+            cache.clear();
+            return EXIT_SUCCESS;
+        }
+        for (const auto& entry : cache) {
+            out += entry.first + "\t" + entry.second + "\n";
+        }
+    }
+    return stage_write(io, out.data(), out.size()) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
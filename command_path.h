@@ -0,0 +1,22 @@
+#ifndef COMMAND_PATH_H_
+#define COMMAND_PATH_H_
+
+#include <string>
+#include <vector>
+
+#include "builtins.h"
+
+// Remembers where in PATH each command was found, like other shells'
+// `hash`: the shell searches PATH once per command name instead of every
+// forked child trying execve() in each directory until one works.
+//
+// Returns the file that running name executes, or name itself if it has a
+// slash or isn't found.  The cache is dropped when PATH changes.  A child
+// should exec the returned path and fall back to execvp() if that fails,
+// in case the file moved since it was cached.
+std::string find_command(const std::string& name);
+
+// hash [-r]: lists the cached command paths; -r forgets them.
+int builtin_hash(const std::vector<std::string>& args, StageIO& io);
+
+#endif  // COMMAND_PATH_H_
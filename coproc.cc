@@ -0,0 +1,327 @@
+#include "coproc.h"
+
+#include <fcntl.h>     // for O_CLOEXEC
+#include <signal.h>    // for kill()
+#include <sys/wait.h>  // for waitpid()
+#include <unistd.h>    // for pipe2(), read(), close()
+
+#include <algorithm>  // for std::min()
+#include <cerrno>
+#include <cstdlib>  // for strtoull(), EXIT_SUCCESS, EXIT_FAILURE
+#include <cstring>  // for strerror()
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "metrics.h"
+#include "spawn.h"
+
+using std::endl;
+using std::lock_guard;
+using std::map;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::vector;
+
+static const size_t kReadSize = 64 * 1024;
+
+// A length prefix is a byte count in decimal; anything longer is garbage.
+static const size_t kMaxPrefix = 20;
+
+namespace {
+
+struct coprocess {
+    string name;
+    string command;  // as given, for the listing
+    string delim;    // empty for length-prefixed frames
+    pid_t pid = -1;
+    int in = -1;     // the write end of its stdin
+    int out = -1;    // the read end of its stdout
+    string ahead;    // read from out but not passed on yet
+    mutex busy;      // held by the stage talking to it
+};
+
+}  // namespace
+
+// Stages look coprocesses up by name on their own threads while `coproc`
+// may be adding or removing one.
+static mutex registry_lock;
+static map<string, shared_ptr<coprocess>> registry;
+
+static shared_ptr<coprocess> find_coproc(const string& name) {
+    lock_guard<mutex> guard(registry_lock);
+    auto it = registry.find(name);
+    return it != registry.end() ? it->second : nullptr;
+}
+
+static void forget_coproc(const string& name) {
+    lock_guard<mutex> guard(registry_lock);
+    registry.erase(name);
+}
+
+// Ends c, with the stage lock held: closing its stdin asks it to exit,
+// and this waits until it has.  It may already have been reaped by the
+// shell waiting for a pipeline, which is fine.
+static void stop(coprocess& c) {
+    if (c.in < 0) {
+        return;
+    }
+    close(c.in);
+    while (waitpid(c.pid, nullptr, 0) < 0 && errno == EINTR) {
+    }
+    close(c.out);
+    c.in = c.out = -1;
+    c.ahead.clear();
+}
+
+static int start(const string& name, const string& delim, const vector<string>& cmd,
+                 const StageIO& io) {
+    int in[2];
+    int out[2];
+    if (pipe2(in, O_CLOEXEC) < 0) {
+        stage_err(io) << "coproc: " << strerror(errno) << endl;
+        return EXIT_FAILURE;
+    }
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        stage_err(io) << "coproc: " << strerror(errno) << endl;
+        close(in[0]);
+        close(in[1]);
+        return EXIT_FAILURE;
+    }
+
+    string command;
+    for (const auto& arg : cmd) {
+        command += (command.empty() ? "" : " ") + arg;
+    }
+    pid_t pid;
+    int error = spawn_command(cmd, in[0], out[1], -1, pid);
+    close(in[0]);
+    close(out[1]);
+    if (error != 0) {
+        stage_err(io) << "coproc: " << cmd[0] << ": " << strerror(error) << endl;
+        close(in[1]);
+        close(out[0]);
+        return EXIT_FAILURE;
+    }
+    count_metric(metrics.forks);
+
+    shared_ptr<coprocess> c(new coprocess);
+    c->name = name;
+    c->command = command;
+    c->delim = delim;
+    c->pid = pid;
+    c->in = in[1];
+    c->out = out[0];
+    lock_guard<mutex> guard(registry_lock);
+    registry[name] = c;
+    return EXIT_SUCCESS;
+}
+
+int builtin_coproc(const vector<string>& args, StageIO& io) {
+    if (args.size() == 1) {
+        string list;
+        {
+            lock_guard<mutex> guard(registry_lock);
+            for (const auto& entry : registry) {
+                const coprocess& c = *entry.second;
+                list += c.name + "\t" + std::to_string(c.pid) + "\t" + c.command + "\n";
+            }
+        }
+        return stage_write(io, list.data(), list.size()) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (args[1] == "-k" && args.size() == 3) {
+        shared_ptr<coprocess> c = find_coproc(args[2]);
+        if (c == nullptr) {
+            stage_err(io) << "coproc: " << args[2] << ": no such coprocess" << endl;
+            return EXIT_FAILURE;
+        }
+        forget_coproc(args[2]);
+        lock_guard<mutex> turn(c->busy);
+        stop(*c);
+        return EXIT_SUCCESS;
+    }
+    size_t first = 1;
+    string delim;
+    if (args[1] == "-d" && args.size() > 2) {
+        delim = args[2];
+        first = 3;
+    }
+    if (args.size() < first + 2 || args[first].empty() || args[first][0] == '-' ||
+        delim.find('\n') != string::npos || (first == 3 && delim.empty())) {
+        stage_err(io) << "usage: coproc [-d DELIM] NAME COMMAND [ARG]..., or coproc -k NAME"
+                      << endl;
+        return EXIT_FAILURE;
+    }
+    if (find_coproc(args[first]) != nullptr) {
+        stage_err(io) << "coproc: " << args[first] << " is already running" << endl;
+        return EXIT_FAILURE;
+    }
+    return start(args[first], delim, vector<string>(args.begin() + first + 1, args.end()), io);
+}
+
+bool is_coproc_stage(const vector<string>& cmd) {
+    return cmd[0].size() > 1 && cmd[0][0] == '@';
+}
+
+// Appends what c writes next to c.ahead.  Returns false at EOF or on an
+// error.
+static bool read_more(coprocess& c) {
+    size_t used = c.ahead.size();
+    c.ahead.resize(used + kReadSize);
+    ssize_t n;
+    do {
+        n = read(c.out, &c.ahead[used], kReadSize);
+    } while (n < 0 && errno == EINTR);
+    c.ahead.resize(used + (n > 0 ? n : 0));
+    return n > 0;
+}
+
+// Passes the first len bytes of c.ahead on to the stage's output and drops
+// them.  Once the output has gone away, writing is false and the rest of
+// the answer is only read, so the next one starts where it should.
+static void pass_on(coprocess& c, size_t len, const StageIO& io, bool& writing) {
+    if (writing && len > 0) {
+        writing = stage_write(io, c.ahead.data(), len);
+    }
+    c.ahead.erase(0, len);
+}
+
+// Reads an answer with a length prefix.  Returns false if c didn't give
+// one.
+static bool read_counted(coprocess& c, const StageIO& io, bool& writing) {
+    size_t nl;
+    while ((nl = c.ahead.find('\n')) == string::npos) {
+        if (c.ahead.size() > kMaxPrefix || !read_more(c)) {
+            return false;
+        }
+    }
+    if (nl == 0 || nl > kMaxPrefix || c.ahead.find_first_not_of("0123456789") != nl) {
+        return false;
+    }
+    uint64_t left = strtoull(c.ahead.c_str(), nullptr, 10);
+    c.ahead.erase(0, nl + 1);
+    while (true) {
+        size_t take = std::min<uint64_t>(left, c.ahead.size());
+        pass_on(c, take, io, writing);
+        left -= take;
+        if (left == 0) {
+            return true;
+        }
+        if (!read_more(c)) {
+            return false;
+        }
+    }
+}
+
+// Reads an answer up to a line that is just c.delim.  Returns false if c
+// stopped before that line.
+static bool read_delimited(coprocess& c, const StageIO& io, bool& writing) {
+    size_t line = 0;  // where the first line not looked at starts
+    while (true) {
+        size_t nl;
+        while ((nl = c.ahead.find('\n', line)) != string::npos) {
+            if (nl - line == c.delim.size() && c.ahead.compare(line, nl - line, c.delim) == 0) {
+                pass_on(c, line, io, writing);
+                c.ahead.erase(0, c.delim.size() + 1);
+                return true;
+            }
+            line = nl + 1;
+        }
+        // The complete lines go on; a partial one waits for the rest.
+        pass_on(c, line, io, writing);
+        line = 0;
+        if (!read_more(c)) {
+            return false;
+        }
+    }
+}
+
+// Reads the stage's input to its end into data.
+static void read_input(const StageIO& io, string& data) {
+    size_t used = 0;
+    while (true) {
+        data.resize(used + kReadSize);
+        ssize_t n = stage_read(io, &data[used], kReadSize);
+        if (n <= 0) {
+            break;
+        }
+        used += n;
+    }
+    data.resize(used);
+}
+
+// Streams the stage's input to c and then the delimiter line, adding a
+// newline to an unterminated last line so the delimiter starts a line.
+static void send_delimited(coprocess& c, const StageIO& io) {
+    char buf[kReadSize];
+    bool at_line_start = true;
+    ssize_t n;
+    while ((n = stage_read(io, buf, sizeof(buf))) > 0) {
+        if (!write_all(c.in, buf, n)) {
+            return;
+        }
+        at_line_start = buf[n - 1] == '\n';
+    }
+    string end = (at_line_start ? "" : "\n") + c.delim + "\n";
+    write_all(c.in, end.data(), end.size());
+}
+
+int builtin_coproc_stage(const vector<string>& args, StageIO& io) {
+    string name = args[0].substr(1);
+    if (args.size() > 1) {
+        stage_err(io) << args[0] << ": a coprocess stage takes no arguments" << endl;
+        return EXIT_FAILURE;
+    }
+    shared_ptr<coprocess> c = find_coproc(name);
+    if (c == nullptr) {
+        stage_err(io) << args[0] << ": no such coprocess" << endl;
+        return EXIT_FAILURE;
+    }
+    lock_guard<mutex> turn(c->busy);
+    if (c->in < 0) {
+        stage_err(io) << args[0] << ": the coprocess has stopped" << endl;
+        return EXIT_FAILURE;
+    }
+
+    // The request goes out on a thread of its own while this one reads the
+    // answer: a coprocess that answers as it reads would otherwise fill
+    // its stdout pipe and stop reading while we are still writing.
+    bool writing = true;
+    bool answered;
+    if (c->delim.empty()) {
+        string request;
+        read_input(io, request);
+        string prefix = std::to_string(request.size()) + "\n";
+        int to = c->in;
+        thread sender([to, &prefix, &request]() {
+            if (write_all(to, prefix.data(), prefix.size())) {
+                write_all(to, request.data(), request.size());
+            }
+        });
+        answered = read_counted(*c, io, writing);
+        if (!answered) {
+            kill(c->pid, SIGKILL);  // so the sender isn't left blocked on it
+        }
+        sender.join();
+    } else {
+        coprocess& ref = *c;
+        thread sender([&ref, &io]() { send_delimited(ref, io); });
+        answered = read_delimited(*c, io, writing);
+        if (!answered) {
+            kill(c->pid, SIGKILL);
+        }
+        sender.join();
+    }
+    if (!answered) {
+        // Whatever it says next would be taken for the next stage's answer.
+        stage_err(io) << args[0] << ": the coprocess broke off its answer and was stopped" << endl;
+        stop(*c);
+        forget_coproc(name);
+        return EXIT_FAILURE;
+    }
+    return writing ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,40 @@
+#ifndef COPROC_H_
+#define COPROC_H_
+
+#include <string>
+#include <vector>
+
+#include "builtins.h"
+
+// Coprocesses: commands started once and kept running for the rest of the
+// session, so a filter that is slow to start (loading a dictionary or a
+// model) pays for it once instead of on every command line.
+//
+//     coproc [-d DELIM] NAME COMMAND [ARG]...
+//
+// starts COMMAND with its stdin and stdout on pipes to the shell, and a
+// pipeline stage `@NAME` then sends the stage's input through it and
+// passes on what COMMAND answers.  COMMAND never sees the end of its
+// input, so each stage's worth is framed:
+//
+//  - by default with a length prefix: the shell writes the byte count in
+//    decimal and a newline, then that many bytes, and COMMAND answers the
+//    same way;
+//  - with -d DELIM, with a delimiter line: the shell writes the input and
+//    then a line that is just DELIM, and COMMAND's answer ends at a line
+//    that is just DELIM.  The input is streamed instead of collected
+//    first, but must not contain that line.  A line-buffered filter that
+//    passes DELIM through (`sed -u`) speaks this already.
+//
+// One stage at a time talks to a coprocess; another waits its turn.
+// `coproc` alone lists the coprocesses, and `coproc -k NAME` closes NAME's
+// stdin and waits for it to exit.
+int builtin_coproc(const std::vector<std::string>& args, StageIO& io);
+
+// @NAME: the stage that sends its input through coprocess NAME.
+int builtin_coproc_stage(const std::vector<std::string>& args, StageIO& io);
+
+// Whether cmd is a coprocess stage, `@NAME`.
+bool is_coproc_stage(const std::vector<std::string>& cmd);
+
+#endif  // COPROC_H_
@@ -0,0 +1,97 @@
+#include "file_map.h"
+
+#include <signal.h>    // for sigaction()
+#include <sys/mman.h>  // for mmap(), munmap()
+#include <unistd.h>    // for sysconf()
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>  // for std::call_once()
+
+// Maps that can be alive at once; a file that finds them all taken isn't
+// mapped, and its reader falls back to read().
+static const int kMapSlots = 64;
+
+namespace {
+
+// Where the SIGBUS handler looks a faulting address up.  Only atomics, so
+// it may look from a signal handler on any thread.
+struct map_slot {
+    std::atomic<bool> used{false};
+    std::atomic<uintptr_t> begin{0};  // 0 while the slot is being filled
+    std::atomic<uintptr_t> end{0};
+    std::atomic<bool> truncated{false};
+};
+
+map_slot slots[kMapSlots];
+struct sigaction previous_action;
+uintptr_t page_size;
+std::once_flag handler_installed;
+
+void on_sigbus(int sig, siginfo_t* info, void*) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(info->si_addr);
+    for (auto& slot : slots) {
+        uintptr_t begin = slot.begin.load(std::memory_order_acquire);
+        if (begin == 0 || addr < begin || addr >= slot.end.load(std::memory_order_relaxed)) {
+            continue;
+        }
+        // The page is past the file's end now: read zeros there instead.
+        void* page = reinterpret_cast<void*>(addr & ~(page_size - 1));
+        if (mmap(page, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) !=
+            MAP_FAILED) {
+            slot.truncated.store(true, std::memory_order_relaxed);
+            return;
+        }
+        break;
+    }
+    // Not a mapped file's: whatever SIGBUS did before, once this returns.
+    sigaction(SIGBUS, &previous_action, nullptr);
+    raise(sig);
+}
+
+void install_handler() {
+    page_size = sysconf(_SC_PAGESIZE);
+    struct sigaction action = {};
+    action.sa_sigaction = on_sigbus;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, &previous_action);
+}
+
+}  // namespace
+
+file_map::file_map(int fd, size_t size) : size_(size) {
+    std::call_once(handler_installed, install_handler);
+    for (int i = 0; i < kMapSlots && slot_ < 0; i++) {
+        if (!slots[i].used.exchange(true)) {
+            slot_ = i;
+        }
+    }
+    if (slot_ < 0 || size == 0) {
+        return;
+    }
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    data_ = static_cast<const char*>(map);
+    map_slot& slot = slots[slot_];
+    slot.truncated.store(false, std::memory_order_relaxed);
+    slot.end.store(reinterpret_cast<uintptr_t>(data_) + size, std::memory_order_relaxed);
+    slot.begin.store(reinterpret_cast<uintptr_t>(data_), std::memory_order_release);
+}
+
+file_map::~file_map() {
+    if (slot_ < 0) {
+        return;
+    }
+    slots[slot_].begin.store(0, std::memory_order_release);
+    if (data_ != nullptr) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+    slots[slot_].used.store(false, std::memory_order_release);
+}
+
+bool file_map::truncated() const {
+    return slot_ >= 0 && slots[slot_].truncated.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,36 @@
+#ifndef FILE_MAP_H_
+#define FILE_MAP_H_
+
+#include <cstddef>  // for size_t
+
+// A read-only mapping of a regular file, for a builtin that scans it in
+// the shell's own process.  The file can shrink under the mapping (another
+// process truncates or rewrites it), and touching a page past its new end
+// raises SIGBUS, which would take the interactive shell down with the
+// stage.  While a file_map is alive, a SIGBUS in its range swaps a page of
+// zeros in for the one that is gone and marks the map truncated() instead;
+// the reader checks that before trusting what it read, and reads the file
+// itself or reports an error.
+class file_map {
+ public:
+    // Maps the first size bytes of fd; ok() tells whether that worked.
+    file_map(int fd, size_t size);
+    ~file_map();
+
+    file_map(const file_map&) = delete;
+    file_map& operator=(const file_map&) = delete;
+
+    bool ok() const { return data_ != nullptr; }
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    // True once some page of the map was found past the file's end.
+    bool truncated() const;
+
+ private:
+    const char* data_ = nullptr;
+    size_t size_;
+    int slot_ = -1;  // where the SIGBUS handler finds the map
+};
+
+#endif  // FILE_MAP_H_
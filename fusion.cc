@@ -0,0 +1,447 @@
+#include "fusion.h"
+
+#include <unistd.h>    // for close()
+#include <fcntl.h>     // for open()
+#include <sys/mman.h>  // for madvise()
+#include <sys/stat.h>  // for fstat()
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>  // for memchr(), strerror()
+#include <deque>
+#include <iostream>
+
+#include "grep_matcher.h"
+
+using std::deque;
+using std::endl;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+// Lines handed from operator to operator at a time.
+static const size_t kBatchLines = 4096;
+static const size_t kFlushSize = 64 * 1024;
+
+// One line of a batch: length bytes at offset from the batch's base, and
+// whether a newline ends it (only the last line of the input may lack one).
+struct line_span {
+    size_t offset;
+    size_t length;
+    bool newline;
+};
+
+struct line_batch {
+    const char* base;
+    vector<line_span> lines;
+    // The spans are back to back in base, as cut from the input, so a
+    // search can run over all of them at once.
+    bool contiguous;
+};
+
+// A stage of a fused pipeline.
+class line_op {
+ public:
+    virtual ~line_op() {}
+
+    // Filters batch in place.  Returns false once no later input can get
+    // past this operator (head has printed its lines), so reading can stop.
+    virtual bool process(line_batch& batch) = 0;
+
+    // Called at the end of the input; sets out to the lines the operator
+    // still has to pass on (what tail kept, the count of wc or grep -c).
+    virtual void finish(line_batch& out) {
+        out.lines.clear();
+    }
+
+    // What the operator does, for the plan.
+    virtual const char* role() const = 0;
+};
+
+namespace {
+
+class grep_op : public line_op {
+ public:
+    explicit grep_op(const grep_command& cmd)
+        : matcher_(cmd.filters), count_only_(cmd.count), count_(0) {}
+
+    bool process(line_batch& batch) override {
+        vector<line_span>& lines = batch.lines;
+        size_t kept = 0;
+        size_t i = 0;
+        const char* end = nullptr;
+        if (batch.contiguous && !lines.empty()) {
+            end = batch.base + lines.back().offset + lines.back().length;
+        }
+        while (i < lines.size()) {
+            if (end != nullptr && matcher_.has_prefilter()) {
+                // Skip straight to the line holding the next candidate.
+                const char* hit = matcher_.next_candidate(batch.base + lines[i].offset, end);
+                if (hit == nullptr) {
+                    break;
+                }
+                size_t at = hit - batch.base;
+                while (lines[i].offset + lines[i].length < at) {
+                    i++;
+                }
+            }
+            const line_span& line = lines[i++];
+            if (matcher_.passes(matcher_.hits(batch.base + line.offset, line.length))) {
+                count_++;
+                if (!count_only_) {
+                    lines[kept] = line;
+                    lines[kept].newline = true;  // grep ends every line it prints
+                    kept++;
+                }
+            }
+        }
+        lines.resize(kept);
+        batch.contiguous = false;
+        return true;
+    }
+
+    void finish(line_batch& out) override {
+        out.lines.clear();
+        if (count_only_) {
+            text_ = std::to_string(count_);
+            out.base = text_.data();
+            out.lines.push_back({0, text_.size(), true});
+        }
+    }
+
+    const char* role() const override { return count_only_ ? "count" : "filter"; }
+
+ private:
+    grep_matcher matcher_;
+    bool count_only_;
+    long count_;
+    string text_;
+};
+
+class head_op : public line_op {
+ public:
+    explicit head_op(long lines) : remaining_(lines) {}
+
+    bool process(line_batch& batch) override {
+        if (static_cast<long>(batch.lines.size()) >= remaining_) {
+            batch.lines.resize(remaining_);
+        }
+        remaining_ -= batch.lines.size();
+        return remaining_ > 0;
+    }
+
+    const char* role() const override { return "limit"; }
+
+ private:
+    long remaining_;
+};
+
+class tail_op : public line_op {
+ public:
+    explicit tail_op(const tail_command& cmd)
+        : lines_(cmd.lines), from_start_(cmd.from_start), to_skip_(cmd.lines - 1) {}
+
+    bool process(line_batch& batch) override {
+        vector<line_span>& lines = batch.lines;
+        if (from_start_) {
+            size_t skip = std::min(static_cast<size_t>(std::max(to_skip_, 0L)), lines.size());
+            lines.erase(lines.begin(), lines.begin() + skip);
+            to_skip_ -= skip;
+            batch.contiguous = batch.contiguous && skip == 0;
+            return true;
+        }
+        // Only the last lines_ lines of a batch can make it into the result;
+        // those are copied, as the batch's memory is reused.
+        size_t first = lines.size() > static_cast<size_t>(lines_) ? lines.size() - lines_ : 0;
+        for (size_t i = first; i < lines.size(); i++) {
+            kept_.push_back(string(batch.base + lines[i].offset, lines[i].length));
+            newline_.push_back(lines[i].newline);
+            if (kept_.size() > static_cast<size_t>(lines_)) {
+                kept_.pop_front();
+                newline_.pop_front();
+            }
+        }
+        lines.clear();
+        return true;
+    }
+
+    void finish(line_batch& out) override {
+        out.lines.clear();
+        if (from_start_) {
+            return;
+        }
+        text_.clear();
+        for (size_t i = 0; i < kept_.size(); i++) {
+            out.lines.push_back({text_.size(), kept_[i].size(), newline_[i]});
+            text_ += kept_[i];
+        }
+        out.base = text_.data();
+    }
+
+    const char* role() const override { return from_start_ ? "skip" : "keep last"; }
+
+ private:
+    long lines_;
+    bool from_start_;
+    long to_skip_;
+    deque<string> kept_;
+    deque<bool> newline_;
+    string text_;
+};
+
+class wc_op : public line_op {
+ public:
+    explicit wc_op(const wc_command& cmd) : cmd_(cmd) {}
+
+    bool process(line_batch& batch) override {
+        if (batch.contiguous && cmd_.words) {
+            // Straight from the input: count the whole range in one go.
+            const line_span& last = batch.lines.back();
+            const char* begin = batch.base + batch.lines.front().offset;
+            const char* end = batch.base + last.offset + last.length + last.newline;
+            wc_count(begin, end - begin, counts_);
+            batch.lines.clear();
+            return true;
+        }
+        for (const auto& line : batch.lines) {
+            if (cmd_.words) {
+                wc_count(batch.base + line.offset, line.length, counts_);
+                if (line.newline) {
+                    wc_count("\n", 1, counts_);
+                }
+            } else {
+                counts_.lines += line.newline;
+                counts_.bytes += line.length + line.newline;
+            }
+        }
+        batch.lines.clear();
+        return true;
+    }
+
+    void finish(line_batch& out) override {
+        // wc reads a pipe here: one count is printed as is, more are
+        // padded to 7 columns.
+        int width = cmd_.lines + cmd_.words + cmd_.bytes == 1 ? 1 : 7;
+        text_ = wc_format(cmd_, counts_, width, "");
+        text_.pop_back();
+        out.base = text_.data();
+        out.lines.clear();
+        out.lines.push_back({0, text_.size(), true});
+    }
+
+    const char* role() const override { return "count"; }
+
+ private:
+    wc_command cmd_;
+    wc_counts counts_;
+    string text_;
+};
+
+// Collects the lines that come out of the last operator and writes them.
+class line_sink {
+ public:
+    explicit line_sink(const StageIO& io) : io_(io), failed_(false) {}
+
+    bool write(const line_batch& batch) {
+        for (const auto& line : batch.lines) {
+            out_.append(batch.base + line.offset, line.length);
+            if (line.newline) {
+                out_ += '\n';
+            }
+        }
+        return out_.size() < kFlushSize || flush();
+    }
+
+    bool flush() {
+        if (!failed_ && !stage_write(io_, out_.data(), out_.size())) {
+            failed_ = true;
+        }
+        out_.clear();
+        return !failed_;
+    }
+
+ private:
+    const StageIO& io_;
+    string out_;
+    bool failed_;
+};
+
+// Runs batch through ops[from...] and into sink.  Returns false if an
+// operator is done or the output went away.
+bool push_batch(const vector<unique_ptr<line_op>>& ops, size_t from, line_batch& batch,
+                line_sink& sink) {
+    bool more = true;
+    for (size_t i = from; i < ops.size() && !batch.lines.empty(); i++) {
+        more = ops[i]->process(batch) && more;
+    }
+    return sink.write(batch) && more;
+}
+
+string join_args(const vector<string>& cmd) {
+    string s;
+    for (const auto& arg : cmd) {
+        s += (s.empty() ? "" : " ") + arg;
+    }
+    return s;
+}
+
+}  // namespace
+
+fused_pipeline::fused_pipeline() {}
+
+fused_pipeline::~fused_pipeline() {}
+
+void fused_pipeline::run(const StageIO& io) {
+    line_sink sink(io);
+    line_batch batch;
+    batch.lines.reserve(kBatchLines);
+    bool more = true;
+    for (size_t f = 0; f < files_.size() && more; f++) {
+        const file_map& map = *files_[f].map;
+        const char* p = map.data();
+        const char* end = p + map.size();
+        while (p < end && more) {
+            batch.base = p;
+            batch.lines.clear();
+            batch.contiguous = true;
+            while (p < end && batch.lines.size() < kBatchLines) {
+                const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+                size_t len = nl ? nl - p : end - p;
+                batch.lines.push_back({static_cast<size_t>(p - batch.base), len, nl != nullptr});
+                p += len + (nl ? 1 : 0);
+            }
+            if (map.truncated()) {
+                // The batch has zeros where the file was cut short.
+                stage_err(io) << reader_ << ": " << files_[f].name << ": " << strerror(EIO)
+                              << endl;
+                more = false;
+                break;
+            }
+            more = push_batch(ops_, 0, batch, sink);
+        }
+    }
+
+    // Whatever the operators held back comes out at the end, and goes
+    // through the operators after them.
+    for (size_t i = 0; i < ops_.size(); i++) {
+        line_batch rest;
+        ops_[i]->finish(rest);
+        rest.contiguous = false;
+        if (!rest.lines.empty()) {
+            push_batch(ops_, i + 1, rest, sink);
+        }
+    }
+    sink.flush();
+}
+
+string fused_pipeline::describe() const {
+    string s = "fused into one pass, no threads or pipes\n";
+    for (const auto& f : files_) {
+        s += "  read       " + f.name + " (mapped, " + std::to_string(f.map->size()) +
+             " bytes)\n";
+    }
+    for (size_t i = 0; i < ops_.size(); i++) {
+        string role = ops_[i]->role();
+        role.resize(std::max(role.size(), size_t(10)), ' ');
+        s += "  " + role + " " + stages_[i] + "\n";
+    }
+    return s;
+}
+
+
+bool fuse_pipeline(const vector<vector<string>>& cmds, fused_pipeline& plan) {
+    // The first stage names the files that are read: cat FILE..., or a
+    // grep or head of a single file.
+    vector<string> inputs;
+    bool grep_seen = false;
+    for (size_t i = 0; i < cmds.size(); i++) {
+        const vector<string>& cmd = cmds[i];
+        const string& name = cmd[0];
+        vector<string> files;
+        unique_ptr<line_op> op;
+        grep_command grep;
+        head_command head;
+        tail_command tail;
+        wc_command wc;
+        string error;
+        if (name == "cat" && cat_accepts(cmd)) {
+            bool options = true;
+            for (size_t j = 1; j < cmd.size(); j++) {
+                if (options && cmd[j] == "--") {
+                    options = false;
+                } else {
+                    files.push_back(cmd[j]);
+                }
+            }
+            if (i > 0 && !(files.empty() || (files.size() == 1 && files[0] == "-"))) {
+                return false;
+            }
+        } else if ((name == "grep" || name == "grep-chain") && parse_grep(cmd, grep)) {
+            files = grep.files;
+            op.reset(new grep_op(grep));
+            grep_seen = true;
+        } else if (name == "head" && parse_head(cmd, head)) {
+            files = head.files;
+            op.reset(new head_op(head.lines));
+        } else if (i > 0 && name == "tail" && parse_tail(cmd, tail, error) && !tail.follow &&
+                   tail.files.empty()) {
+            op.reset(new tail_op(tail));
+        } else if (i > 0 && name == "wc" && parse_wc(cmd, wc) && wc.files.empty()) {
+            op.reset(new wc_op(wc));
+        } else {
+            return false;
+        }
+
+        if (i == 0) {
+            // A grep or head of several files prints headers or prefixes.
+            if (files.empty() || (op && files.size() != 1)) {
+                return false;
+            }
+            inputs = files;
+        } else if (op && !files.empty()) {
+            return false;
+        }
+        if (op) {
+            plan.ops_.push_back(std::move(op));
+            plan.stages_.push_back(join_args(cmd));
+        }
+    }
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (inputs[i] == "-") {
+            return false;
+        }
+        int fd = open(inputs[i].c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            return false;
+        }
+        size_t size = st.st_size;
+        unique_ptr<file_map> map(new file_map(fd, size));
+        close(fd);
+        if (size > 0 && !map->ok()) {
+            return false;
+        }
+        if (size > 0) {
+            madvise(const_cast<char*>(map->data()), size, MADV_SEQUENTIAL);
+        }
+        const char* data = map->data();
+        plan.files_.push_back({inputs[i], std::move(map)});
+
+        // grep says "binary file matches" instead of printing NUL-bearing
+        // lines, and cat glues a last line without newline to the next
+        // file's first; the stage-by-stage pipeline handles both, and
+        // reads a file that shrank while it was looked at here.
+        if (size > 0 && ((grep_seen && memchr(data, '\0', size) != nullptr) ||
+                         (i + 1 < inputs.size() && data[size - 1] != '\n') ||
+                         plan.files_.back().map->truncated())) {
+            return false;
+        }
+    }
+    plan.reader_ = cmds[0][0];
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef FUSION_H_
+#define FUSION_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "builtins.h"
+#include "file_map.h"
+
+class line_op;
+
+// A pipeline made only of line-oriented builtins (cat, grep, head, tail,
+// wc), compiled into a single pass over its input files: no stage threads,
+// no pipes, no rings.  The files are mapped and cut into batches of lines;
+// every batch is a list of (offset, length) spans into the mapping that
+// each operator filters in place, so a line's bytes are only ever touched
+// by the operators that look at them and by the final write.  A file that
+// shrinks during the pass ends it with an I/O error, as a read would have.
+class fused_pipeline {
+ public:
+    fused_pipeline();
+    ~fused_pipeline();
+
+    // Runs the pipeline, writing what its last stage would print to io.
+    void run(const StageIO& io);
+
+    // The plan, one line for the input and one per operator.
+    std::string describe() const;
+
+ private:
+    friend bool fuse_pipeline(const std::vector<std::vector<std::string>>& cmds,
+                              fused_pipeline& plan);
+
+    struct mapped_file {
+        std::string name;
+        std::unique_ptr<file_map> map;
+    };
+
+    std::string reader_;  // the first stage's command, which reads the files
+    std::vector<mapped_file> files_;
+    std::vector<std::unique_ptr<line_op>> ops_;
+    std::vector<std::string> stages_;  // the command line behind each op
+};
+
+// Compiles cmds (as planned by plan_pipeline) into plan.  Returns false if
+// some stage isn't a builtin that can run as a line operator, or the input
+// isn't a set of regular files a single pass can read: the pipeline then
+// runs stage by stage as usual, which also reports any errors.
+bool fuse_pipeline(const std::vector<std::vector<std::string>>& cmds, fused_pipeline& plan);
+
+#endif  // FUSION_H_
@@ -0,0 +1,251 @@
+#ifndef GREP_MATCHER_H_
+#define GREP_MATCHER_H_
+
+#include <cstdint>
+#include <cstring>  // for memchr(), memmem()
+#include <queue>
+#include <string>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "builtins.h"
+
+// The matching machinery behind the builtin grep, shared with the fused
+// pipelines that run grep filters without a grep stage.  A chain holds at
+// most 64 filters, one bit each in the hit masks.
+
+inline unsigned char ascii_fold(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+// An Aho-Corasick automaton over a set of literal patterns, compiled into a
+// full DFA so scanning is one table lookup per byte.  Every pattern carries
+// the bit of the filter it belongs to; scanning a line returns the bits of
+// all patterns that occur in it.
+class multi_literal {
+ public:
+    explicit multi_literal(bool fold_case) : fold_case_(fold_case) {
+        delta_.assign(256, -1);
+        out_.push_back(0);
+    }
+
+    bool empty() const { return patterns_ == 0; }
+
+    void add(const std::string& pattern, uint64_t bit) {
+        int state = 0;
+        for (unsigned char c : pattern) {
+            if (fold_case_) {
+                c = ascii_fold(c);
+            }
+            int& next = delta_[state * 256 + c];
+            if (next < 0) {
+                next = static_cast<int>(out_.size());
+                out_.push_back(0);
+                delta_.resize(delta_.size() + 256, -1);
+            }
+            state = delta_[state * 256 + c];
+        }
+        out_[state] |= bit;
+        patterns_++;
+    }
+
+    // Turns the trie into the automaton: missing transitions follow the
+    // failure links, and every state also reports what its suffixes match.
+    void build() {
+        std::vector<int> fail(out_.size(), 0);
+        std::queue<int> todo;
+        for (int c = 0; c < 256; c++) {
+            int& next = delta_[c];
+            if (next < 0) {
+                next = 0;
+            } else {
+                todo.push(next);
+            }
+        }
+        while (!todo.empty()) {
+            int state = todo.front();
+            todo.pop();
+            out_[state] |= out_[fail[state]];
+            for (int c = 0; c < 256; c++) {
+                int& next = delta_[state * 256 + c];
+                int via_fail = delta_[fail[state] * 256 + c];
+                if (next < 0) {
+                    next = via_fail;
+                } else {
+                    fail[next] = via_fail;
+                    todo.push(next);
+                }
+            }
+        }
+    }
+
+    // ORs the bits of the patterns found in [p, end) into hits, giving up
+    // early once done(hits) says the rest of the line can't matter.
+    template <typename Done>
+    void scan(const char* p, const char* end, uint64_t& hits, Done done) const {
+        hits |= out_[0];
+        int state = 0;
+        for (; p < end; p++) {
+            unsigned char c = *p;
+            state = delta_[state * 256 + (fold_case_ ? ascii_fold(c) : c)];
+            if (out_[state] != 0) {
+                hits |= out_[state];
+                if (done(hits)) {
+                    return;
+                }
+            }
+        }
+    }
+
+ private:
+    bool fold_case_;
+    size_t patterns_ = 0;
+    std::vector<int> delta_;
+    std::vector<uint64_t> out_;
+};
+
+// Finds a literal in a byte range, optionally ignoring ASCII case.  The
+// case-insensitive search compares the pattern's first and last byte
+// against 16 positions at a time and only verifies the whole pattern
+// where both fit.  Unlike strcasestr() it needs no NUL at the end, so it
+// works on read-only mappings.
+class literal_finder {
+ public:
+    literal_finder() : ignore_case_(false) {}
+
+    literal_finder(const std::string& pattern, bool ignore_case)
+        : pattern_(pattern), ignore_case_(ignore_case) {
+        if (ignore_case_) {
+            for (auto& c : pattern_) {
+                c = ascii_fold(c);
+            }
+        }
+    }
+
+    const char* find(const char* p, const char* end) const {
+        size_t m = pattern_.size();
+        if (static_cast<size_t>(end - p) < m) {
+            return nullptr;
+        }
+        if (!ignore_case_) {
+            return static_cast<const char*>(memmem(p, end - p, pattern_.data(), m));
+        }
+        const char* last_start = end - m;
+#ifdef __SSE2__
+        const __m128i first_lo = _mm_set1_epi8(pattern_[0]);
+        const __m128i first_up = _mm_set1_epi8(upper(pattern_[0]));
+        const __m128i last_lo = _mm_set1_epi8(pattern_[m - 1]);
+        const __m128i last_up = _mm_set1_epi8(upper(pattern_[m - 1]));
+        for (; p + 16 <= last_start + 1; p += 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + m - 1));
+            __m128i first = _mm_or_si128(_mm_cmpeq_epi8(a, first_lo), _mm_cmpeq_epi8(a, first_up));
+            __m128i last = _mm_or_si128(_mm_cmpeq_epi8(b, last_lo), _mm_cmpeq_epi8(b, last_up));
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(first, last));
+            while (mask != 0) {
+                const char* candidate = p + __builtin_ctz(mask);
+                if (matches_at(candidate)) {
+                    return candidate;
+                }
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; p <= last_start; p++) {
+            if (matches_at(p)) {
+                return p;
+            }
+        }
+        return nullptr;
+    }
+
+ private:
+    static char upper(char c) {
+        return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+    }
+
+    bool matches_at(const char* p) const {
+        for (size_t i = 0; i < pattern_.size(); i++) {
+            if (ascii_fold(p[i]) != static_cast<unsigned char>(pattern_[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string pattern_;
+    bool ignore_case_;
+};
+
+// Decides for a line whether it passes every filter of a chain.
+class grep_matcher {
+ public:
+    explicit grep_matcher(const std::vector<grep_filter>& filters)
+        : exact_(false), folded_(true), has_prefilter_(false) {
+        size_t prefilter_len = 0;
+        for (size_t i = 0; i < filters.size(); i++) {
+            const grep_filter& f = filters[i];
+            uint64_t bit = uint64_t(1) << i;
+            (f.ignore_case ? folded_ : exact_).add(f.pattern, bit);
+            (f.invert ? inverted_ : required_) |= bit;
+
+            // Lines without the longest required pattern can't pass, so
+            // that one is searched for first and only the lines it turns
+            // up go through the automata.
+            if (!f.invert && f.pattern.size() > prefilter_len) {
+                prefilter_ = literal_finder(f.pattern, f.ignore_case);
+                prefilter_len = f.pattern.size();
+                has_prefilter_ = true;
+            }
+        }
+        exact_.build();
+        folded_.build();
+    }
+
+    bool has_prefilter() const { return has_prefilter_; }
+
+    // Returns the next occurrence of the prefilter pattern in [p, end), or
+    // nullptr if no line of the range can pass.
+    const char* next_candidate(const char* p, const char* end) const {
+        return prefilter_.find(p, end);
+    }
+
+    uint64_t hits(const char* line, size_t len) const {
+        uint64_t required = required_;
+        uint64_t inverted = inverted_;
+        // Once an inverted pattern shows up, or every required one has and
+        // there is nothing inverted to look for, the verdict is known.
+        auto done = [required, inverted](uint64_t h) {
+            return (h & inverted) != 0 || (inverted == 0 && (h & required) == required);
+        };
+        uint64_t h = 0;
+        if (!exact_.empty()) {
+            exact_.scan(line, line + len, h, done);
+        }
+        if (!folded_.empty() && !done(h)) {
+            folded_.scan(line, line + len, h, done);
+        }
+        return h;
+    }
+
+    bool passes(uint64_t hits) const {
+        return (hits & required_) == required_ && (hits & inverted_) == 0;
+    }
+
+    // Whether the line passes the first filter on its own.
+    bool passes_first(uint64_t hits) const {
+        return ((hits ^ inverted_) & 1) != 0;
+    }
+
+ private:
+    multi_literal exact_;
+    multi_literal folded_;
+    literal_finder prefilter_;
+    bool has_prefilter_;
+    uint64_t required_ = 0;
+    uint64_t inverted_ = 0;
+};
+
+#endif  // GREP_MATCHER_H_
@@ -0,0 +1,424 @@
+#include "io_engine.h"
+
+#include <fcntl.h>  // for fcntl(), O_APPEND
+#include <linux/io_uring.h>
+#include <sys/mman.h>     // for mmap()
+#include <sys/stat.h>     // for fstat()
+#include <sys/syscall.h>  // for SYS_io_uring_setup, ...
+#include <sys/uio.h>      // for struct iovec
+#include <unistd.h>       // for syscall(), read(), lseek()
+
+#include <algorithm>  // for std::min(), std::max()
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>  // for getenv()
+#include <cstring>  // for memset(), strcmp()
+#include <memory>
+
+#include "builtins.h"
+#include "latency.h"
+#include "metrics.h"
+
+using std::unique_ptr;
+
+static const size_t kBufferSize = 128 * 1024;
+static const unsigned kBuffers = 8;  // in flight at most, reads and writes together
+static const unsigned kEntries = 16;
+
+static bool blocking_forced() {
+    static const bool forced = getenv("PIPE_SHELL_IO") != nullptr &&
+                               strcmp(getenv("PIPE_SHELL_IO"), "blocking") == 0;
+    return forced;
+}
+
+static copy_status blocking_copy(int in_fd, int out_fd) {
+    static thread_local char buf[kBufferSize];
+    while (true) {
+        ssize_t n = read(in_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return kCopyReadError;
+        }
+        if (n == 0) {
+            return kCopyDone;
+        }
+        if (!write_all(out_fd, buf, n)) {
+            return kCopyWriteError;
+        }
+        count_metric(metrics.builtin_bytes, n);
+    }
+}
+
+namespace {
+
+// One io_uring instance, with kBuffers buffers and two file slots (0 for
+// the input, 1 for the output) registered.  There is one per thread, so
+// stages copying at the same time don't share a ring.
+class uring_pump {
+ public:
+    uring_pump();
+    ~uring_pump();
+
+    bool ok() const { return fd_ >= 0; }
+
+    copy_status copy(int in_fd, int out_fd);
+
+ private:
+    enum slot_state { kFree, kReading, kFull, kWriting };
+
+    // A buffer and the chunk of input it holds.
+    struct slot {
+        slot_state state;
+        uint64_t chunk;  // index of the chunk of input
+        size_t len;      // bytes read into the buffer
+        size_t written;  // bytes of those written out
+    };
+
+    void queue(uint8_t opcode, unsigned index, int file, size_t skip, size_t len,
+               int64_t offset);
+    void queue_cancel(unsigned index);
+    void submit_and_wait();
+    void teardown();
+
+    int fd_;
+    char* buffers_;
+    void* sq_map_;
+    size_t sq_map_size_;
+    void* cq_map_;
+    size_t cq_map_size_;
+    io_uring_sqe* sqes_;
+    size_t sqes_size_;
+
+    unsigned* sq_tail_;
+    unsigned* sq_mask_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned* cq_mask_;
+    io_uring_cqe* cqes_;
+    unsigned to_submit_;
+
+    slot slots_[kBuffers];
+};
+
+uring_pump::uring_pump()
+    : fd_(-1), buffers_(nullptr), sq_map_(MAP_FAILED), cq_map_(MAP_FAILED),
+      sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)), to_submit_(0) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd_ = syscall(SYS_io_uring_setup, kEntries, &p);
+    if (fd_ < 0) {
+        return;
+    }
+
+    sq_map_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_map_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        sq_map_size_ = cq_map_size_ = std::max(sq_map_size_, cq_map_size_);
+    }
+    sq_map_ = mmap(nullptr, sq_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd_, IORING_OFF_SQ_RING);
+    cq_map_ = single ? sq_map_
+                     : mmap(nullptr, cq_map_size_, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+    void* buffers = mmap(nullptr, kBuffers * kBufferSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sq_map_ == MAP_FAILED || cq_map_ == MAP_FAILED || sqes_ == MAP_FAILED ||
+        buffers == MAP_FAILED) {
+        teardown();
+        return;
+    }
+    buffers_ = static_cast<char*>(buffers);
+
+    char* sq = static_cast<char*>(sq_map_);
+    char* cq = static_cast<char*>(cq_map_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    // The buffers are pinned once here instead of on every read and write,
+    // and so are the two file slots, filled in per copy.
+    iovec iov[kBuffers];
+    for (unsigned i = 0; i < kBuffers; i++) {
+        iov[i].iov_base = buffers_ + i * kBufferSize;
+        iov[i].iov_len = kBufferSize;
+    }
+    int no_files[2] = {-1, -1};
+    if (syscall(SYS_io_uring_register, fd_, IORING_REGISTER_BUFFERS, iov, kBuffers) < 0 ||
+        syscall(SYS_io_uring_register, fd_, IORING_REGISTER_FILES, no_files, 2) < 0) {
+        teardown();
+    }
+}
+
+uring_pump::~uring_pump() {
+    teardown();
+}
+
+void uring_pump::teardown() {
+    if (sqes_ != MAP_FAILED) {
+        munmap(sqes_, sqes_size_);
+    }
+    if (cq_map_ != MAP_FAILED && cq_map_ != sq_map_) {
+        munmap(cq_map_, cq_map_size_);
+    }
+    if (sq_map_ != MAP_FAILED) {
+        munmap(sq_map_, sq_map_size_);
+    }
+    if (buffers_ != nullptr) {
+        munmap(buffers_, kBuffers * kBufferSize);
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+    sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+    sq_map_ = cq_map_ = MAP_FAILED;
+    buffers_ = nullptr;
+    fd_ = -1;
+}
+
+// Queues a read into (or write from) buffer index, starting skip bytes
+// into it.  offset -1 means the file's current position.
+void uring_pump::queue(uint8_t opcode, unsigned index, int file, size_t skip, size_t len,
+                       int64_t offset) {
+    unsigned tail = *sq_tail_;
+    unsigned at = tail & *sq_mask_;
+    io_uring_sqe* sqe = &sqes_[at];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = file;
+    sqe->off = static_cast<uint64_t>(offset);
+    sqe->addr = reinterpret_cast<uint64_t>(buffers_ + index * kBufferSize + skip);
+    sqe->len = static_cast<uint32_t>(len);
+    sqe->buf_index = static_cast<uint16_t>(index);
+    sqe->user_data = index;
+    sq_array_[at] = at;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    to_submit_++;
+}
+
+// Queues the cancellation of the read or write into buffer index.
+void uring_pump::queue_cancel(unsigned index) {
+    unsigned tail = *sq_tail_;
+    unsigned at = tail & *sq_mask_;
+    io_uring_sqe* sqe = &sqes_[at];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = index;
+    sqe->user_data = kBuffers + index;
+    sq_array_[at] = at;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    to_submit_++;
+}
+
+void uring_pump::submit_and_wait() {
+    while (syscall(SYS_io_uring_enter, fd_, to_submit_, 1, IORING_ENTER_GETEVENTS, nullptr,
+                   0) < 0 && errno == EINTR) {
+    }
+    to_submit_ = 0;
+}
+
+copy_status uring_pump::copy(int in_fd, int out_fd) {
+    int files[2] = {in_fd, out_fd};
+    io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.fds = reinterpret_cast<uint64_t>(files);
+    if (syscall(SYS_io_uring_register, fd_, IORING_REGISTER_FILES_UPDATE, &update, 2) < 0) {
+        return blocking_copy(in_fd, out_fd);
+    }
+
+    // Between regular files every chunk has a known place in both files,
+    // so all buffers can be read and written at once, each at its own
+    // offset.  A pipe (or O_APPEND output) takes its data in order: one
+    // read at a time and writes in chunk order, at the current position.
+    struct stat in_st;
+    struct stat out_st;
+    off_t in_base = lseek(in_fd, 0, SEEK_CUR);
+    off_t out_base = lseek(out_fd, 0, SEEK_CUR);
+    bool positioned = fstat(in_fd, &in_st) == 0 && S_ISREG(in_st.st_mode) &&
+                      in_st.st_size > 0 && fstat(out_fd, &out_st) == 0 &&
+                      S_ISREG(out_st.st_mode) && in_base >= 0 && out_base >= 0 &&
+                      (fcntl(out_fd, F_GETFL) & O_APPEND) == 0;
+
+    for (auto& s : slots_) {
+        s.state = kFree;
+    }
+    uint64_t next_chunk = 0;        // next chunk to read
+    uint64_t next_write = 0;        // next chunk to write, when in order
+    uint64_t eof_chunk = UINT64_MAX;  // first chunk past the end of the input
+    unsigned reading = 0;
+    unsigned writing = 0;
+    unsigned cancelling = 0;
+    bool cancelled = false;
+    copy_status status = kCopyDone;
+    int error = 0;
+    uint64_t copied = 0;
+
+    while (true) {
+        for (unsigned i = 0; i < kBuffers && status == kCopyDone; i++) {
+            slot& s = slots_[i];
+            if (s.state == kFree && next_chunk < eof_chunk && (positioned || reading == 0)) {
+                s = {kReading, next_chunk++, 0, 0};
+                queue(IORING_OP_READ_FIXED, i, 0, 0, kBufferSize,
+                      positioned ? in_base + s.chunk * kBufferSize : -1);
+                reading++;
+            }
+        }
+        for (unsigned i = 0; i < kBuffers && status == kCopyDone; i++) {
+            slot& s = slots_[i];
+            if (s.state == kFull && (positioned || (writing == 0 && s.chunk == next_write))) {
+                s.state = kWriting;
+                queue(IORING_OP_WRITE_FIXED, i, 1, s.written, s.len - s.written,
+                      positioned ? out_base + s.chunk * kBufferSize + s.written : -1);
+                writing++;
+                if (!positioned) {
+                    break;
+                }
+            }
+        }
+        if (reading + writing + cancelling == 0) {
+            break;
+        }
+        submit_and_wait();
+
+        unsigned head = *cq_head_;
+        while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+            uint64_t index = cqe.user_data;
+            int res = cqe.res;
+            head++;
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            if (index >= kBuffers) {
+                cancelling--;
+                continue;
+            }
+            slot& s = slots_[index];
+
+            if (s.state == kReading) {
+                reading--;
+                if (res < 0 && res != -EINTR && res != -EAGAIN) {
+                    if (status == kCopyDone) {
+                        status = kCopyReadError;
+                        error = -res;
+                    }
+                    s.state = kFree;
+                    continue;
+                }
+                if (status != kCopyDone) {
+                    s.state = kFree;
+                    continue;
+                }
+                bool retry = res < 0;
+                s.len += std::max(res, 0);
+                if (s.chunk >= eof_chunk) {
+                    s.state = kFree;
+                } else if (!retry && (res == 0 || !positioned)) {
+                    if (res == 0) {
+                        eof_chunk = std::min(eof_chunk, s.len > 0 ? s.chunk + 1 : s.chunk);
+                    }
+                    s.state = s.len > 0 ? kFull : kFree;
+                } else if (s.len < kBufferSize) {
+                    // Short read: get the rest of the chunk (or learn that
+                    // this is where the file ends).
+                    queue(IORING_OP_READ_FIXED, index, 0, s.len, kBufferSize - s.len,
+                          positioned ? in_base + s.chunk * kBufferSize + s.len : -1);
+                    reading++;
+                } else {
+                    s.state = kFull;
+                }
+            } else {
+                writing--;
+                if (res < 0 && res != -EINTR && res != -EAGAIN) {
+                    if (status == kCopyDone) {
+                        status = kCopyWriteError;
+                        error = -res;
+                    }
+                    s.state = kFree;
+                    continue;
+                }
+                s.written += std::max(res, 0);
+                note_output(out_fd);
+                if (s.written < s.len) {
+                    s.state = kFull;
+                } else {
+                    copied += s.len;
+                    count_metric(metrics.builtin_bytes, s.len);
+                    s.state = kFree;
+                    next_write++;
+                }
+            }
+        }
+        if (status != kCopyDone && !cancelled) {
+            // Nothing new is queued; a read still waiting on a pipe could
+            // wait forever, so cancel what is in flight and wait for that.
+            cancelled = true;
+            for (unsigned i = 0; i < kBuffers; i++) {
+                if (slots_[i].state == kReading || slots_[i].state == kWriting) {
+                    queue_cancel(i);
+                    cancelling++;
+                } else {
+                    slots_[i].state = kFree;
+                }
+            }
+        }
+    }
+
+    if (positioned) {
+        lseek(in_fd, in_base + copied, SEEK_SET);
+        lseek(out_fd, out_base + copied, SEEK_SET);
+    }
+
+    // A registered file stays open for as long as it is registered: left
+    // in its slot, a pipe's write end would keep the reader from ever
+    // seeing EOF after the shell closes it.
+    int no_files[2] = {-1, -1};
+    update.fds = reinterpret_cast<uint64_t>(no_files);
+    syscall(SYS_io_uring_register, fd_, IORING_REGISTER_FILES_UPDATE, &update, 2);
+    errno = error;
+    return status;
+}
+
+static thread_local unique_ptr<uring_pump> thread_ring;
+static thread_local bool thread_ring_tried = false;
+
+uring_pump* thread_pump() {
+    if (!thread_ring_tried) {
+        thread_ring_tried = true;
+        if (!blocking_forced()) {
+            thread_ring.reset(new uring_pump);
+            if (!thread_ring->ok()) {
+                thread_ring.reset();
+            }
+        }
+    }
+    return thread_ring.get();
+}
+
+}  // namespace
+
+copy_status copy_fd(int in_fd, int out_fd) {
+    uring_pump* pump = thread_pump();
+    return pump != nullptr ? pump->copy(in_fd, out_fd) : blocking_copy(in_fd, out_fd);
+}
+
+void io_engine_forked() {
+    // The ring's memory is shared with the kernel and so with the parent:
+    // dropping it here only unmaps the child's view of it.
+    thread_ring.reset();
+    thread_ring_tried = false;
+}
+
+const char* io_engine_name() {
+    return thread_pump() != nullptr ? "io_uring" : "blocking";
+}
@@ -0,0 +1,34 @@
+#ifndef IO_ENGINE_H_
+#define IO_ENGINE_H_
+
+// How builtins move file data in bulk (cat of a file into a pipe or into a
+// redirected file).
+//
+// The io_uring engine keeps several reads and writes in flight at once,
+// into buffers and file slots registered with the kernel up front, so a
+// copy costs a few system calls per batch of buffers instead of a
+// blocking read() and write() per buffer.  Where io_uring can't be set up
+// (old kernel, seccomp, io_uring_disabled) copies fall back to the
+// blocking engine.  PIPE_SHELL_IO=blocking picks the blocking engine.
+
+enum copy_status {
+    kCopyDone,
+    kCopyReadError,   // errno says why
+    kCopyWriteError,  // errno says why
+};
+
+// Copies everything readable from in_fd to out_fd.  Both descriptors are
+// left positioned after what was copied, as if read() and write() had
+// been used.
+copy_status copy_fd(int in_fd, int out_fd);
+
+// In a forked copy of the shell that goes on running builtins: forgets the
+// calling thread's ring, which the copy shares with the parent, so the
+// next copy sets up one of its own.
+void io_engine_forked();
+
+// The name of the engine copy_fd() uses on this thread: "io_uring" or
+// "blocking".
+const char* io_engine_name();
+
+#endif  // IO_ENGINE_H_
@@ -0,0 +1,231 @@
+#include "latency.h"
+
+#include <algorithm>  // for std::sort(), std::min()
+#include <cmath>      // for ceil()
+#include <cstdio>     // for snprintf()
+#include <cstdlib>    // for EXIT_SUCCESS, EXIT_FAILURE
+#include <cstring>    // for strncmp(), strcmp()
+#include <iostream>
+
+#include "trace.h"
+
+using std::atomic;
+using std::endl;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::string;
+using std::vector;
+
+latency_histogram::latency_histogram() {
+    clear();
+}
+
+unsigned latency_histogram::bucket_of(uint64_t ns) {
+    const uint64_t kLimit = uint64_t(1) << (kMaxExponent + 1);
+    if (ns >= kLimit) {
+        ns = kLimit - 1;
+    }
+    if (ns < (uint64_t(1) << kSubBits)) {
+        return ns;
+    }
+    // The top kSubBits + 1 bits: the leading one picks the power of two,
+    // the rest the sub-bucket within it.
+    unsigned exponent = 63 - __builtin_clzll(ns);
+    unsigned sub = (ns >> (exponent - kSubBits)) & ((1u << kSubBits) - 1);
+    return ((exponent - kSubBits + 1) << kSubBits) + sub;
+}
+
+uint64_t latency_histogram::bucket_value(unsigned bucket) {
+    if (bucket < (1u << kSubBits)) {
+        return bucket;
+    }
+    unsigned shift = (bucket >> kSubBits) - 1;
+    uint64_t low = (uint64_t((1u << kSubBits) + (bucket & ((1u << kSubBits) - 1)))) << shift;
+    return low + (uint64_t(1) << shift) - 1;
+}
+
+void latency_histogram::record(uint64_t ns) {
+    counts_[bucket_of(ns)].fetch_add(1, memory_order_relaxed);
+    count_.fetch_add(1, memory_order_relaxed);
+    sum_.fetch_add(ns, memory_order_relaxed);
+    uint64_t seen = max_.load(memory_order_relaxed);
+    while (ns > seen && !max_.compare_exchange_weak(seen, ns, memory_order_relaxed)) {
+    }
+}
+
+void latency_histogram::clear() {
+    for (auto& c : counts_) {
+        c.store(0, memory_order_relaxed);
+    }
+    count_.store(0, memory_order_relaxed);
+    max_.store(0, memory_order_relaxed);
+    sum_.store(0, memory_order_relaxed);
+}
+
+uint64_t latency_histogram::percentile(double fraction) const {
+    uint64_t total = count();
+    uint64_t wanted = std::max<uint64_t>(1, static_cast<uint64_t>(ceil(fraction * total)));
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < kBuckets; b++) {
+        seen += counts_[b].load(memory_order_relaxed);
+        if (seen >= wanted) {
+            return std::min(bucket_value(b), max());
+        }
+    }
+    // Values recorded while we looked.
+    return max();
+}
+
+namespace {
+
+// A histogram per command name, in a fixed open-addressed table: a slot is
+// claimed once, with a compare-and-swap, and never given back.
+struct command_slot {
+    enum { kEmpty, kClaiming, kReady };
+    atomic<int> state;
+    char name[32];
+    latency_histogram hist;
+};
+
+const size_t kCommandSlots = 64;
+
+}  // namespace
+
+static latency_histogram session[kNumSessionMetrics];
+static command_slot commands[kCommandSlots];
+static latency_histogram other_commands;
+
+atomic<int> first_byte_fd(-1);
+static atomic<uint64_t> first_byte_start(0);
+
+void record_latency(session_metric metric, uint64_t ns) {
+    session[metric].record(ns);
+}
+
+const latency_histogram& session_latency(session_metric metric) {
+    return session[metric];
+}
+
+static latency_histogram& command_histogram(const char* name, size_t len) {
+    len = std::min(len, sizeof(commands[0].name) - 1);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ static_cast<unsigned char>(name[i])) * 16777619u;
+    }
+    for (size_t probe = 0; probe < kCommandSlots; probe++) {
+        command_slot& slot = commands[(hash + probe) % kCommandSlots];
+        int state = slot.state.load(memory_order_acquire);
+        if (state == command_slot::kEmpty) {
+            if (slot.state.compare_exchange_strong(state, command_slot::kClaiming,
+                                                   memory_order_acquire)) {
+                memcpy(slot.name, name, len);
+                slot.name[len] = '\0';
+                slot.state.store(command_slot::kReady, memory_order_release);
+                return slot.hist;
+            }
+        }
+        // Another thread is naming this slot; it is only a few bytes.
+        while (state == command_slot::kClaiming) {
+            state = slot.state.load(memory_order_acquire);
+        }
+        if (strncmp(slot.name, name, len) == 0 && slot.name[len] == '\0') {
+            return slot.hist;
+        }
+    }
+    return other_commands;
+}
+
+void record_command(const string& argv0, uint64_t ns) {
+    size_t slash = argv0.rfind('/');
+    size_t start = slash == string::npos ? 0 : slash + 1;
+    command_histogram(argv0.data() + start, argv0.size() - start).record(ns);
+}
+
+void arm_first_byte(int out_fd, uint64_t start) {
+    first_byte_start.store(start, memory_order_relaxed);
+    first_byte_fd.store(out_fd, memory_order_release);
+}
+
+void disarm_first_byte() {
+    first_byte_fd.store(-1, memory_order_relaxed);
+}
+
+void note_first_byte(int fd) {
+    // Only the first writer after arming records.
+    if (first_byte_fd.compare_exchange_strong(fd, -1, memory_order_acquire)) {
+        session[kFirstByte].record(trace_now() - first_byte_start.load(memory_order_relaxed));
+    }
+}
+
+// 850ns, 12.3us, 4.56ms, 1.20s.
+static string format_ns(uint64_t ns) {
+    char buf[32];
+    if (ns < 1000) {
+        snprintf(buf, sizeof(buf), "%lluns", static_cast<unsigned long long>(ns));
+    } else if (ns < 1000000) {
+        snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, sizeof(buf), "%.2fms", ns / 1e6);
+    } else {
+        snprintf(buf, sizeof(buf), "%.2fs", ns / 1e9);
+    }
+    return buf;
+}
+
+static void add_row(string& out, const char* name, const latency_histogram& h) {
+    if (h.count() == 0) {
+        return;
+    }
+    char line[256];
+    snprintf(line, sizeof(line), "%-20s %8llu %9s %9s %9s %9s %9s\n", name,
+             static_cast<unsigned long long>(h.count()), format_ns(h.percentile(0.5)).c_str(),
+             format_ns(h.percentile(0.9)).c_str(), format_ns(h.percentile(0.99)).c_str(),
+             format_ns(h.percentile(0.999)).c_str(), format_ns(h.max()).c_str());
+    out += line;
+}
+
+int builtin_stats(const vector<string>& args, StageIO& io) {
+    bool reset = false;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (args[i] == "-r") {
+            reset = true;
+        } else {
+            stage_err(io) << "usage: stats [-r]" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    static const char* const kSessionNames[kNumSessionMetrics] = {
+        "prompt to prompt", "spawn (process)", "spawn (thread)", "first byte",
+    };
+    string out = "                        count       p50       p90       p99     p99.9"
+                 "       max\n";
+    for (int m = 0; m < kNumSessionMetrics; m++) {
+        add_row(out, kSessionNames[m], session[m]);
+    }
+    vector<const command_slot*> named;
+    for (const auto& slot : commands) {
+        if (slot.state.load(memory_order_acquire) == command_slot::kReady) {
+            named.push_back(&slot);
+        }
+    }
+    std::sort(named.begin(), named.end(), [](const command_slot* a, const command_slot* b) {
+        return strcmp(a->name, b->name) < 0;
+    });
+    for (const command_slot* slot : named) {
+        add_row(out, slot->name, slot->hist);
+    }
+    add_row(out, "(other)", other_commands);
+
+    if (reset) {
+        for (auto& h : session) {
+            h.clear();
+        }
+        for (auto& slot : commands) {
+            slot.hist.clear();
+        }
+        other_commands.clear();
+    }
+    return stage_write(io, out.data(), out.size()) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,82 @@
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "builtins.h"
+
+// Latency histograms kept for the whole session, printed by `stats`.
+//
+// The histograms are HDR-style: 32 linear sub-buckets per power of two,
+// so every recorded value is kept to within about 3%, from nanoseconds up
+// to hours, in a fixed array of counters.  Recording is a few relaxed
+// atomic increments, with no lock and no allocation, so it stays on all
+// the time.
+class latency_histogram {
+ public:
+    latency_histogram();
+
+    void record(uint64_t ns);
+    void clear();
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+
+    // The value below which fraction (0 to 1) of the recorded values lie.
+    uint64_t percentile(double fraction) const;
+
+ private:
+    static const unsigned kSubBits = 5;        // 32 sub-buckets
+    static const unsigned kMaxExponent = 43;   // 2^44 ns: about 4.9 hours
+    static const unsigned kBuckets = (kMaxExponent - kSubBits + 2) << kSubBits;
+
+    static unsigned bucket_of(uint64_t ns);
+    static uint64_t bucket_value(unsigned bucket);  // its upper end
+
+    std::atomic<uint64_t> counts_[kBuckets];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> max_;
+    std::atomic<uint64_t> sum_;
+};
+
+// What the session measures besides per-command wall time.
+enum session_metric {
+    kPromptToPrompt,  // from one prompt to the next
+    kSpawnProcess,    // fork() until the stage's exec() went through
+    kSpawnThread,     // starting a builtin stage's thread until it runs
+    kFirstByte,       // start of a pipeline until its output's first byte
+    kNumSessionMetrics,
+};
+
+void record_latency(session_metric metric, uint64_t ns);
+const latency_histogram& session_latency(session_metric metric);
+
+// Records a stage's wall time under its command name (argv[0] without the
+// directory).  A fixed number of names get histograms of their own; the
+// rest share an "(other)" one.
+void record_command(const std::string& argv0, uint64_t ns);
+
+// Time to first byte is measured for a pipeline whose last stage runs in
+// the shell: arm it with the pipeline's output and start time, and the
+// first builtin write there (note_output() in stage_write()) records it.
+void arm_first_byte(int out_fd, uint64_t start);
+void disarm_first_byte();
+
+extern std::atomic<int> first_byte_fd;
+void note_first_byte(int fd);
+
+// Called after every write to an fd; a single load unless armed for it.
+inline void note_output(int fd) {
+    if (first_byte_fd.load(std::memory_order_relaxed) == fd) {
+        note_first_byte(fd);
+    }
+}
+
+// stats [-r]: prints the percentiles of every histogram; -r clears them.
+int builtin_stats(const std::vector<std::string>& args, StageIO& io);
+
+#endif  // LATENCY_H_
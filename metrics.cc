@@ -0,0 +1,208 @@
+#include "metrics.h"
+
+#include <fcntl.h>       // for open()
+#include <sys/socket.h>  // for socket(), sendto()
+#include <sys/un.h>      // for sockaddr_un
+#include <unistd.h>      // for write(), close(), getpid()
+
+#include <algorithm>  // for std::min()
+#include <chrono>
+#include <cstdarg>   // for va_list
+#include <cstdio>    // for vsnprintf(), rename()
+#include <cstdlib>   // for getenv(), strtod(), atexit()
+#include <cstring>   // for memset(), memcpy(), strlen()
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "builtins.h"
+#include "latency.h"
+
+using std::string;
+
+shell_metrics metrics;
+
+namespace {
+
+// Where the exports go; set once, before the export thread starts.
+struct metrics_target {
+    string path;
+    string temp_path;
+    int socket = -1;
+    sockaddr_un addr;
+    double interval;
+};
+
+struct counter_info {
+    const char* name;
+    const char* help;
+    const std::atomic<uint64_t>* value;
+};
+
+const counter_info kCounters[] = {
+    {"pipelines", "Command lines run.", &metrics.pipelines},
+    {"forks", "Pipeline stages forked.", &metrics.forks},
+    {"exec_failures", "Forked stages whose exec failed.", &metrics.exec_failures},
+    {"builtin_bytes", "Bytes written by builtin stages.", &metrics.builtin_bytes},
+    {"path_cache_hits", "Command paths found in the cache.", &metrics.path_hits},
+    {"path_cache_misses", "Command paths searched for in PATH.", &metrics.path_misses},
+};
+
+const struct {
+    session_metric metric;
+    const char* kind;
+} kSpawnKinds[] = {
+    {kSpawnProcess, "process"},
+    {kSpawnThread, "thread"},
+};
+
+const double kQuantiles[] = {0.5, 0.9, 0.99};
+
+}  // namespace
+
+static void append(string& out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(string& out, const char* format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    out.append(buf, std::min<size_t>(len, sizeof(buf) - 1));
+}
+
+static unsigned long long load(const std::atomic<uint64_t>& value) {
+    return value.load(std::memory_order_relaxed);
+}
+
+static string prometheus_text() {
+    string out;
+    for (const auto& c : kCounters) {
+        append(out, "# HELP pipe_shell_%s_total %s\n", c.name, c.help);
+        append(out, "# TYPE pipe_shell_%s_total counter\n", c.name);
+        append(out, "pipe_shell_%s_total %llu\n", c.name, load(*c.value));
+    }
+    out += "# HELP pipe_shell_children Forked stages running.\n";
+    out += "# TYPE pipe_shell_children gauge\n";
+    append(out, "pipe_shell_children %lld\n",
+           static_cast<long long>(metrics.children.load(std::memory_order_relaxed)));
+    out += "# HELP pipe_shell_spawn_seconds Time for a stage to start running.\n";
+    out += "# TYPE pipe_shell_spawn_seconds summary\n";
+    for (const auto& k : kSpawnKinds) {
+        const latency_histogram& h = session_latency(k.metric);
+        for (double q : kQuantiles) {
+            append(out, "pipe_shell_spawn_seconds{kind=\"%s\",quantile=\"%g\"} %.9f\n", k.kind, q,
+                   h.count() > 0 ? h.percentile(q) / 1e9 : 0.0);
+        }
+        append(out, "pipe_shell_spawn_seconds_sum{kind=\"%s\"} %.9f\n", k.kind, h.sum() / 1e9);
+        append(out, "pipe_shell_spawn_seconds_count{kind=\"%s\"} %llu\n", k.kind,
+               static_cast<unsigned long long>(h.count()));
+    }
+    return out;
+}
+
+static string json_text() {
+    string out = "{";
+    for (const auto& c : kCounters) {
+        append(out, "\"%s\":%llu,", c.name, load(*c.value));
+    }
+    append(out, "\"children\":%lld",
+           static_cast<long long>(metrics.children.load(std::memory_order_relaxed)));
+    for (const auto& k : kSpawnKinds) {
+        const latency_histogram& h = session_latency(k.metric);
+        append(out, ",\"spawn_%s\":{\"count\":%llu,\"sum_ns\":%llu", k.kind,
+               static_cast<unsigned long long>(h.count()),
+               static_cast<unsigned long long>(h.sum()));
+        for (double q : kQuantiles) {
+            append(out, ",\"p%g_ns\":%llu", q * 100,
+                   static_cast<unsigned long long>(h.count() > 0 ? h.percentile(q) : 0));
+        }
+        append(out, ",\"max_ns\":%llu}", static_cast<unsigned long long>(h.max()));
+    }
+    out += "}\n";
+    return out;
+}
+
+// Writes the text file through a temporary one in the same directory, so
+// the rename replaces it in one step.
+static void write_file(const metrics_target& target, const string& text) {
+    int fd = open(target.temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    bool ok = write_all(fd, text.data(), text.size());
+    if (close(fd) < 0 || !ok || rename(target.temp_path.c_str(), target.path.c_str()) < 0) {
+        unlink(target.temp_path.c_str());
+    }
+}
+
+// The target of the exports, for the last one at exit, and the shell's
+// pid, so a forked child leaving through exit() doesn't export.
+static const metrics_target* exit_target = nullptr;
+static pid_t export_pid;
+
+// Keeps the export thread and the one at exit from writing the temporary
+// file at once.
+static std::mutex export_mutex;
+
+static void export_once(const metrics_target& target) {
+    std::lock_guard<std::mutex> lock(export_mutex);
+    if (!target.path.empty()) {
+        write_file(target, prometheus_text());
+    }
+    if (target.socket >= 0) {
+        string text = json_text();
+        // A missing collector must not hold the export up.
+        sendto(target.socket, text.data(), text.size(), MSG_DONTWAIT,
+               reinterpret_cast<const sockaddr*>(&target.addr), sizeof(target.addr));
+    }
+}
+
+static void export_loop(const metrics_target* target) {
+    auto interval = std::chrono::duration<double>(target->interval);
+    while (true) {
+        std::this_thread::sleep_for(interval);
+        export_once(*target);
+    }
+}
+
+// A session shorter than the interval still leaves its counts behind, and
+// a longer one leaves its final ones rather than those of the last tick.
+static void export_at_exit() {
+    if (getpid() == export_pid) {
+        export_once(*exit_target);
+    }
+}
+
+void metrics_init() {
+    const char* path = getenv("PIPE_SHELL_METRICS");
+    const char* socket_path = getenv("PIPE_SHELL_METRICS_SOCKET");
+    bool to_file = path != nullptr && *path != '\0';
+    bool to_socket = socket_path != nullptr && *socket_path != '\0' &&
+                     strlen(socket_path) < sizeof(sockaddr_un::sun_path);
+    if (!to_file && !to_socket) {
+        return;
+    }
+    // Never freed: the export thread runs until the shell exits.
+    metrics_target* target = new metrics_target;
+    target->interval = 10;
+    const char* interval = getenv("PIPE_SHELL_METRICS_INTERVAL");
+    if (interval != nullptr && strtod(interval, nullptr) > 0) {
+        target->interval = strtod(interval, nullptr);
+    }
+    if (to_file) {
+        target->path = path;
+        target->temp_path = target->path + ".tmp." + std::to_string(getpid());
+    }
+    if (to_socket) {
+        target->socket = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        memset(&target->addr, 0, sizeof(target->addr));
+        target->addr.sun_family = AF_UNIX;
+        memcpy(target->addr.sun_path, socket_path, strlen(socket_path));
+    }
+    exit_target = target;
+    export_pid = getpid();
+    // The shell leaves through exit() when its input ends.
+    atexit(export_at_exit);
+    std::thread(export_loop, target).detach();
+}
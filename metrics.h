@@ -0,0 +1,43 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Counters of what the shell has done, for running it as a long-lived
+// batch executor.
+//
+// With PIPE_SHELL_METRICS=FILE set, a background thread writes them, with
+// the spawn latency summaries (see latency.h), to FILE every
+// PIPE_SHELL_METRICS_INTERVAL seconds (default 10) in the Prometheus
+// textfile format, for node_exporter's textfile collector to pick up,
+// and once more when the shell exits.
+// Each export goes to a temporary file that is renamed over FILE, so a
+// reader never sees half of one.  With PIPE_SHELL_METRICS_SOCKET=PATH set,
+// each export is also sent as one JSON datagram to the unix socket PATH.
+//
+// Counting is a relaxed atomic increment where it happens; everything
+// else, formatting and writing included, is on the export thread.  That
+// thread only uses malloc and raw syscalls, both safe in a child forked
+// while it runs.
+struct shell_metrics {
+    std::atomic<uint64_t> pipelines;       // command lines run
+    std::atomic<uint64_t> forks;           // stages forked
+    std::atomic<uint64_t> exec_failures;   // forked stages whose exec failed
+    std::atomic<uint64_t> builtin_bytes;   // written by builtin stages
+    std::atomic<uint64_t> path_hits;       // command paths found in the cache
+    std::atomic<uint64_t> path_misses;     // command paths searched for in PATH
+    std::atomic<int64_t> children;         // forked stages not reaped yet
+};
+
+extern shell_metrics metrics;
+
+inline void count_metric(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+// Reads the PIPE_SHELL_METRICS variables and, if set, starts exporting.
+void metrics_init();
+
+#endif  // METRICS_H_
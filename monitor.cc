@@ -0,0 +1,302 @@
+#include "monitor.h"
+
+#include <poll.h>          // for poll()
+#include <sys/eventfd.h>   // for eventfd()
+#include <sys/ioctl.h>     // for ioctl(), FIONREAD
+#include <sys/syscall.h>   // for SYS_pidfd_open, SYS_gettid
+#include <sys/wait.h>      // for waitid()
+#include <fcntl.h>         // for fcntl(), F_GETPIPE_SZ
+#include <unistd.h>        // for close(), read(), write(), sysconf()
+
+#include <algorithm>
+#include <cstdio>   // for snprintf(), sscanf()
+#include <cstring>  // for strrchr()
+#include <ctime>    // for clock_gettime()
+#include <fstream>
+#include <sstream>
+
+#include "byte_ring.h"
+
+using std::endl;
+using std::ostream;
+using std::string;
+using std::vector;
+
+// Fill levels at or above kFull (below kEmpty) percent count as full
+// (empty) when looking for the bottleneck.
+static const int kFull = 90;
+static const int kEmpty = 10;
+
+// At most this many lines of timeline; longer runs show every n-th sample.
+static const size_t kTimelineLines = 40;
+
+static double now_seconds() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+pipeline_monitor::pipeline_monitor(int interval_ms, const vector<string>& names)
+    : interval_ms_(std::max(interval_ms, 1)),
+      links_(names.empty() ? 0 : names.size() - 1),
+      event_fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+    for (const auto& name : names) {
+        stages_.emplace_back(new stage);
+        stages_.back()->name = name;
+    }
+    start_ = last_ = now_seconds();
+}
+
+pipeline_monitor::~pipeline_monitor() {
+    for (size_t i = 0; i < links_.size(); i++) {
+        drop_link(i);
+    }
+    for (auto& s : stages_) {
+        if (s->pidfd >= 0) {
+            close(s->pidfd);
+        }
+    }
+    if (event_fd_ >= 0) {
+        close(event_fd_);
+    }
+}
+
+void pipeline_monitor::watch_pipe(size_t i, int read_fd) {
+    link& l = links_[i];
+    l.fd = fcntl(read_fd, F_DUPFD_CLOEXEC, 3);
+    int size = fcntl(read_fd, F_GETPIPE_SZ);
+    l.capacity = size > 0 ? size : 64 * 1024;
+}
+
+void pipeline_monitor::watch_ring(size_t i, byte_ring* ring) {
+    links_[i].ring = ring;
+    links_[i].capacity = ring->capacity();
+}
+
+void pipeline_monitor::watch_process(size_t i, pid_t pid) {
+    stages_[i]->pid = pid;
+    // Without pidfds (before Linux 5.3) the loop still notices exits at
+    // the next sample.
+    stages_[i]->pidfd = syscall(SYS_pidfd_open, pid, 0);
+}
+
+void pipeline_monitor::watch_thread(size_t i) {
+    stages_[i]->threaded = true;
+}
+
+void pipeline_monitor::thread_started(size_t i) {
+    stages_[i]->tid = static_cast<int>(syscall(SYS_gettid));
+}
+
+void pipeline_monitor::thread_finished(size_t i) {
+    stages_[i]->finished = true;
+    uint64_t one = 1;
+    ssize_t ignored = write(event_fd_, &one, sizeof(one));
+    (void) ignored;
+}
+
+void pipeline_monitor::drop_link(size_t i) {
+    if (links_[i].fd >= 0) {
+        close(links_[i].fd);
+    }
+    links_[i].fd = -1;
+    links_[i].ring = nullptr;
+}
+
+void pipeline_monitor::check_stages() {
+    for (size_t i = 0; i < stages_.size(); i++) {
+        stage& s = *stages_[i];
+        if (s.done) {
+            continue;
+        }
+        if (s.pid > 0) {
+            siginfo_t info;
+            info.si_pid = 0;
+            s.done = waitid(P_PID, s.pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0 ||
+                     info.si_pid == s.pid;
+        } else {
+            s.done = !s.threaded || s.finished;
+        }
+        if (s.done) {
+            // Our duplicate of its input must not keep the pipe open for
+            // a writer that ought to get EPIPE now.
+            if (i > 0) {
+                drop_link(i - 1);
+            }
+            if (s.pidfd >= 0) {
+                close(s.pidfd);
+                s.pidfd = -1;
+            }
+        }
+    }
+}
+
+unsigned long long pipeline_monitor::cpu_ticks(const stage& s) const {
+    string path = s.pid > 0 ? "/proc/" + std::to_string(s.pid) + "/stat"
+                : s.tid > 0 ? "/proc/self/task/" + std::to_string(s.tid) + "/stat"
+                : "";
+    std::ifstream in(path);
+    std::stringstream text;
+    text << in.rdbuf();
+    string stat = text.str();
+    size_t paren = stat.rfind(')');
+    unsigned long long utime;
+    unsigned long long stime;
+    // utime and stime are the 14th and 15th fields, the 12th and 13th
+    // after the command name.
+    if (path.empty() || paren == string::npos ||
+        sscanf(stat.c_str() + paren + 1,
+               " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+        return s.last_ticks;
+    }
+    return utime + stime;
+}
+
+void pipeline_monitor::take_sample(double now) {
+    sample smp;
+    smp.time = now - start_;
+    for (const auto& l : links_) {
+        long used = -1;
+        if (l.fd >= 0) {
+            int n;
+            used = ioctl(l.fd, FIONREAD, &n) == 0 ? n : -1;
+        } else if (l.ring != nullptr) {
+            used = static_cast<long>(l.ring->used());
+        }
+        long capacity = static_cast<long>(l.capacity);
+        smp.fill.push_back(used < 0 ? -1 : static_cast<int>(std::min(100L, used * 100 / capacity)));
+    }
+    static const long hz = sysconf(_SC_CLK_TCK);
+    double elapsed = std::max(now - last_, 1e-3);
+    for (auto& s : stages_) {
+        if (s->done) {
+            smp.cpu.push_back(-1);
+            continue;
+        }
+        unsigned long long ticks = cpu_ticks(*s);
+        smp.cpu.push_back(static_cast<int>((ticks - s->last_ticks) * 100 / (hz * elapsed)));
+        s->last_ticks = ticks;
+    }
+    samples_.push_back(smp);
+    last_ = now;
+}
+
+void pipeline_monitor::run() {
+    double next = start_ + interval_ms_ / 1000.0;
+    while (true) {
+        check_stages();
+        vector<pollfd> fds;
+        fds.push_back({event_fd_, POLLIN, 0});
+        bool running = false;
+        for (const auto& s : stages_) {
+            running = running || !s->done;
+            if (!s->done && s->pidfd >= 0) {
+                fds.push_back({s->pidfd, POLLIN, 0});
+            }
+        }
+        if (!running) {
+            break;
+        }
+        double now = now_seconds();
+        if (now >= next) {
+            take_sample(now);
+            while (next <= now) {
+                next += interval_ms_ / 1000.0;
+            }
+        }
+        int timeout = static_cast<int>((next - now) * 1000) + 1;
+        if (poll(fds.data(), fds.size(), timeout) > 0 && fds[0].revents != 0) {
+            uint64_t count;
+            ssize_t ignored = read(event_fd_, &count, sizeof(count));
+            (void) ignored;
+        }
+    }
+}
+
+// Percentages right-aligned in columns of 6, "-" for the missing ones.
+static string columns(const vector<int>& percents) {
+    string s;
+    char buf[16];
+    for (int p : percents) {
+        if (p < 0) {
+            snprintf(buf, sizeof(buf), "%6s", "-");
+        } else {
+            snprintf(buf, sizeof(buf), "%6d", p);
+        }
+        s += buf;
+    }
+    return s;
+}
+
+void pipeline_monitor::report(ostream& out) const {
+    char buf[64];
+    out << "monitor: " << samples_.size() << " samples, every " << interval_ms_ << " ms"
+        << endl;
+    for (size_t i = 0; i < stages_.size(); i++) {
+        out << "  " << i + 1 << "  " << stages_[i]->name << endl;
+    }
+    if (samples_.empty()) {
+        return;
+    }
+
+    string cpu_title = "  cpu% per stage";
+    cpu_title.resize(std::max(cpu_title.size(), 6 * stages_.size()), ' ');
+    out << "       " << cpu_title << " |  fill% per pipe" << endl;
+    out << "   time";
+    for (size_t i = 0; i < stages_.size(); i++) {
+        snprintf(buf, sizeof(buf), "%6zu", i + 1);
+        out << buf;
+    }
+    out << string(cpu_title.size() - 6 * stages_.size(), ' ') << " | ";
+    for (size_t i = 0; i < links_.size(); i++) {
+        snprintf(buf, sizeof(buf), "%4zu>%zu", i + 1, i + 2);
+        out << buf;
+    }
+    out << endl;
+    size_t step = (samples_.size() + kTimelineLines - 1) / kTimelineLines;
+    for (size_t k = 0; k < samples_.size(); k += step) {
+        const sample& smp = samples_[k];
+        snprintf(buf, sizeof(buf), "%6.2fs", smp.time);
+        out << buf;
+        string cpu = columns(smp.cpu);
+        cpu.resize(cpu_title.size(), ' ');
+        out << cpu << " | " << columns(smp.fill) << endl;
+    }
+
+    // The bottleneck has a full pipe in front of it (or is the source) and
+    // an empty one behind it (or is the sink).
+    size_t best = 0;
+    size_t best_count = 0;
+    long best_cpu = -1;
+    for (size_t i = 0; i < stages_.size(); i++) {
+        size_t count = 0;
+        long cpu = 0;
+        for (const auto& smp : samples_) {
+            if (smp.cpu[i] < 0) {
+                continue;
+            }
+            bool input_full = i == 0 || smp.fill[i - 1] >= kFull;
+            bool output_empty = i + 1 == stages_.size() ||
+                                (smp.fill[i] >= 0 && smp.fill[i] <= kEmpty);
+            if (input_full && output_empty) {
+                count++;
+                cpu += smp.cpu[i];
+            }
+        }
+        if (count > best_count || (count == best_count && count > 0 && cpu > best_cpu)) {
+            best = i;
+            best_count = count;
+            best_cpu = cpu;
+        }
+    }
+    if (best_count == 0) {
+        out << "no clear bottleneck" << endl;
+        return;
+    }
+    const char* why = best == 0 ? "output empty"
+                    : best + 1 == stages_.size() ? "input full"
+                    : "input full and output empty";
+    out << "likely bottleneck: stage " << best + 1 << " (" << stages_[best]->name << "), "
+        << why << " in " << best_count << " of " << samples_.size()
+        << " samples, " << best_cpu / static_cast<long>(best_count) << "% cpu while so" << endl;
+}
@@ -0,0 +1,93 @@
+#ifndef MONITOR_H_
+#define MONITOR_H_
+
+#include <sys/types.h>  // for pid_t
+
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class byte_ring;
+
+// `monitor [-i MS] PIPELINE` runs the pipeline stage by stage while the
+// shell samples, every MS milliseconds (default 100), how full each pipe
+// (or ring) between the stages is and how much CPU each stage uses.  At
+// the end it prints the samples as a timeline and names the likely
+// bottleneck: the stage that most often had a full input and an empty
+// output, i.e. the one everything upstream waits for and everything
+// downstream starves on.
+//
+// The sampling is the shell's own wait for the pipeline, a single poll()
+// loop on the stages' pidfds and an eventfd the builtin threads signal,
+// not a thread per pipe.  Pipes are sampled with FIONREAD on a duplicate
+// of their read end, which is dropped as soon as the reading stage ends so
+// the writer still sees EPIPE.
+class pipeline_monitor {
+ public:
+    pipeline_monitor(int interval_ms, const std::vector<std::string>& names);
+    ~pipeline_monitor();
+
+    pipeline_monitor(const pipeline_monitor&) = delete;
+    pipeline_monitor& operator=(const pipeline_monitor&) = delete;
+
+    // The connection between stage i and stage i + 1.
+    void watch_pipe(size_t i, int read_fd);
+    void watch_ring(size_t i, byte_ring* ring);
+
+    // Stage i is a forked child.
+    void watch_process(size_t i, pid_t pid);
+
+    // Stage i runs on a builtin thread, which calls thread_started() and
+    // thread_finished() when it starts and when it is done.
+    void watch_thread(size_t i);
+    void thread_started(size_t i);
+    void thread_finished(size_t i);
+
+    // Samples until every watched stage is done; the children are left to
+    // be reaped.
+    void run();
+
+    // Prints the timeline and the verdict.
+    void report(std::ostream& out) const;
+
+ private:
+    struct stage {
+        std::string name;
+        pid_t pid = -1;
+        int pidfd = -1;
+        bool threaded = false;
+        std::atomic<int> tid{0};
+        std::atomic<bool> finished{false};
+        bool done = false;
+        unsigned long long last_ticks = 0;
+    };
+
+    struct link {
+        int fd = -1;
+        byte_ring* ring = nullptr;
+        size_t capacity = 0;
+    };
+
+    struct sample {
+        double time;
+        std::vector<int> fill;  // percent full, -1 once unwatched
+        std::vector<int> cpu;   // percent of a core, -1 once done
+    };
+
+    void take_sample(double now);
+    void check_stages();
+    void drop_link(size_t i);
+    unsigned long long cpu_ticks(const stage& s) const;
+
+    int interval_ms_;
+    std::vector<std::unique_ptr<stage>> stages_;
+    std::vector<link> links_;
+    std::vector<sample> samples_;
+    int event_fd_;
+    double start_;
+    double last_;
+};
+
+#endif  // MONITOR_H_
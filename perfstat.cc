@@ -0,0 +1,170 @@
+#include "perfstat.h"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>  // for SYS_perf_event_open
+#include <unistd.h>       // for syscall(), read(), close()
+
+#include <cerrno>
+#include <cstdio>   // for snprintf()
+#include <cstring>  // for memset(), strerror()
+
+using std::endl;
+using std::ostream;
+using std::string;
+using std::vector;
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char* name;
+} kCounters[perf_stats::kNumCounters] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "ctx-switches"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults"},
+};
+
+static double cpu_ms(const rusage& usage) {
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+perf_stats::perf_stats(const vector<string>& names) : stages_(names.size()), open_error_(0) {
+    for (size_t i = 0; i < names.size(); i++) {
+        stage& s = stages_[i];
+        s.name = names[i];
+        for (int c = 0; c < kNumCounters; c++) {
+            s.fds[c] = -1;
+            s.values[c] = 0;
+            s.have[c] = false;
+        }
+        memset(&s.usage, 0, sizeof(s.usage));
+        s.cpu_ms = 0;
+    }
+}
+
+perf_stats::~perf_stats() {
+    for (auto& s : stages_) {
+        for (int fd : s.fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+}
+
+void perf_stats::open_counters(stage& s, pid_t pid, bool on_exec) {
+    for (int c = 0; c < kNumCounters; c++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = kCounters[c].type;
+        attr.config = kCounters[c].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.inherit = 1;
+        attr.disabled = on_exec;
+        attr.enable_on_exec = on_exec;
+        int fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0 && errno == EACCES) {
+            // perf_event_paranoid may still allow counting user space only.
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+        if (fd < 0 && open_error_ == 0) {
+            open_error_ = errno;
+        }
+        s.fds[c] = fd;
+    }
+}
+
+void perf_stats::read_counters(stage& s) {
+    for (int c = 0; c < kNumCounters; c++) {
+        uint64_t v[3];  // value, time enabled, time running
+        if (s.fds[c] < 0 || read(s.fds[c], v, sizeof(v)) != sizeof(v)) {
+            continue;
+        }
+        // Scale up a counter the PMU multiplexed with others.
+        s.values[c] = v[2] > 0 && v[2] < v[1]
+                          ? static_cast<uint64_t>(v[0] * (static_cast<double>(v[1]) / v[2]))
+                          : v[0];
+        s.have[c] = true;
+        close(s.fds[c]);
+        s.fds[c] = -1;
+    }
+}
+
+void perf_stats::attach(size_t index, pid_t pid) {
+    open_counters(stages_[index], pid, true);
+}
+
+void perf_stats::start_thread(size_t index) {
+    stage& s = stages_[index];
+    getrusage(RUSAGE_THREAD, &s.usage);
+    open_counters(s, 0, false);
+}
+
+void perf_stats::stop_thread(size_t index) {
+    stage& s = stages_[index];
+    read_counters(s);
+    rusage now;
+    getrusage(RUSAGE_THREAD, &now);
+    s.cpu_ms = cpu_ms(now) - cpu_ms(s.usage);
+    now.ru_nvcsw -= s.usage.ru_nvcsw;
+    now.ru_nivcsw -= s.usage.ru_nivcsw;
+    now.ru_minflt -= s.usage.ru_minflt;
+    now.ru_majflt -= s.usage.ru_majflt;
+    s.usage = now;
+}
+
+void perf_stats::reaped(size_t index, const rusage& usage) {
+    stage& s = stages_[index];
+    read_counters(s);
+    s.usage = usage;
+    s.cpu_ms = cpu_ms(usage);
+}
+
+void perf_stats::fuse() {
+    string name = "fused:";
+    for (const auto& s : stages_) {
+        name += (name.size() > 6 ? " | " : " ") + s.name;
+    }
+    stages_.resize(1);
+    stages_[0].name = name;
+}
+
+void perf_stats::print(ostream& out) {
+    char line[256];
+    for (int c = 0; c < kNumCounters; c++) {
+        snprintf(line, sizeof(line), "%14s", kCounters[c].name);
+        out << line;
+    }
+    out << "    cpu-ms  stage" << endl;
+    for (auto& s : stages_) {
+        // Without software counters, getrusage() still knows these two.
+        if (!s.have[kContextSwitches]) {
+            s.values[kContextSwitches] = s.usage.ru_nvcsw + s.usage.ru_nivcsw;
+            s.have[kContextSwitches] = true;
+        }
+        if (!s.have[kPageFaults]) {
+            s.values[kPageFaults] = s.usage.ru_minflt + s.usage.ru_majflt;
+            s.have[kPageFaults] = true;
+        }
+        for (int c = 0; c < kNumCounters; c++) {
+            if (s.have[c]) {
+                snprintf(line, sizeof(line), "%14llu",
+                         static_cast<unsigned long long>(s.values[c]));
+            } else {
+                snprintf(line, sizeof(line), "%14s", "-");
+            }
+            out << line;
+        }
+        snprintf(line, sizeof(line), "%10.1f  ", s.cpu_ms);
+        out << line << s.name << endl;
+    }
+    if (open_error_ != 0) {
+        out << "(counters shown as - could not be opened: " << strerror(open_error_) << ")"
+            << endl;
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef PERFSTAT_H_
+#define PERFSTAT_H_
+
+#include <sys/resource.h>  // for struct rusage
+#include <sys/types.h>     // for pid_t
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// `perfstat PIPELINE` runs the pipeline with counters on every stage and
+// then prints a table of what each stage cost, e.g. to tell whether the
+// `grep -i` or the plumbing around it burns the cycles.
+//
+// A forked stage gets perf_event_open() counters attached by the shell
+// between fork() and exec() (the child waits for that); they start with
+// the exec (enable_on_exec) and include the stage's own children
+// (inherit).  A builtin stage gets counters on its thread in the shell.
+// Hardware counters (cycles, instructions, cache misses) that can't be
+// opened (a VM without a PMU, perf_event_paranoid) are shown as "-";
+// context switches and page faults come from the software counters, or
+// from getrusage() where perf events aren't allowed at all.  CPU time is
+// always from getrusage().
+class perf_stats {
+ public:
+    enum counter { kCycles, kInstructions, kCacheMisses, kContextSwitches, kPageFaults,
+                   kNumCounters };
+
+    // One stage per name.
+    explicit perf_stats(const std::vector<std::string>& names);
+    ~perf_stats();
+
+    perf_stats(const perf_stats&) = delete;
+    perf_stats& operator=(const perf_stats&) = delete;
+
+    // Attaches counters to a forked stage that hasn't exec'd yet.
+    void attach(size_t index, pid_t pid);
+
+    // Brackets a builtin stage on the thread that runs it.
+    void start_thread(size_t index);
+    void stop_thread(size_t index);
+
+    // Takes the rusage of a forked stage once it has been reaped.
+    void reaped(size_t index, const rusage& usage);
+
+    // The stages run fused into one (see fusion.h): there is a single row.
+    void fuse();
+
+    // Prints the table, one row per stage.
+    void print(std::ostream& out);
+
+ private:
+    struct stage {
+        std::string name;
+        int fds[kNumCounters];
+        uint64_t values[kNumCounters];
+        bool have[kNumCounters];
+        rusage usage;  // the stage's own, or at its start for a thread
+        double cpu_ms;
+    };
+
+    void open_counters(stage& s, pid_t pid, bool on_exec);
+    void read_counters(stage& s);
+
+    std::vector<stage> stages_;
+    int open_error_;  // why a counter couldn't be opened, or 0
+};
+
+#endif  // PERFSTAT_H_
@@ -12,15 +12,40 @@
 #include <unistd.h>    // for fork()
 #include <sys/types.h> // for pid_t
 #include <sys/wait.h>  // for wait(), waitpid(), etc.
+#include <sys/stat.h>  // for stat(), fstat()
+#include <fcntl.h>     // for open()
+#include <poll.h>      // for poll()
+#include <sys/mman.h>  // for memfd_create()
+#include <sys/epoll.h> // for epoll_create1(), epoll_wait()
 
 #include <iostream>
 #include <string>
 #include <cstring> // for strerror
+#include <csignal> // for signal()
+#include <clocale> // for setlocale()
 
 #include <cstdlib>  // for exit(), EXIT_SUCCESS, and EXIT_FAILURE
 
 #include <boost/algorithm/string.hpp> // for split(), trim()
+#include <algorithm>
 #include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+
+#include "builtins.h"
+#include "byte_ring.h"
+#include "command_path.h"
+#include "fusion.h"
+#include "io_engine.h"
+#include "latency.h"
+#include "metrics.h"
+#include "monitor.h"
+#include "perfstat.h"
+#include "plugins.h"
+#include "replicate.h"
+#include "spawn.h"
+#include "trace.h"
 
 using std::cin;
 using std::cout;
@@ -28,37 +53,205 @@ using std::string;
 using std::endl;
 using std::cerr;
 using std::vector;
+using std::thread;
+using std::unique_ptr;
 
 int read_args(vector<string>&);
 
 bool to_quit(string);
 
-int run_cmd(const vector<string>&);
+// Where a pipeline reads and writes: `< FILE` on its first command and
+// `> FILE` (or `>> FILE`) on its last one replace the shell's stdin and
+// stdout.  A here-document (`<<DELIM`) or here-string (`<<< WORD`) on the
+// first command makes its stdin here_text instead.  The output of a
+// command substitution goes to capture.
+struct redirection {
+    string in_file;
+    string out_file;
+    bool append = false;
+    bool here = false;
+    bool here_string = false;  // here_text is a word still to be expanded
+    bool here_body = false;    // here_text is a body whose $(...) are still to be run
+    string here_text;
+    int in = STDIN_FILENO;
+    int out = STDOUT_FILENO;
+    string* capture = nullptr;
+};
+
+int run_cmd(const vector<string>&, const redirection& = redirection(),
+            perf_stats* perf = nullptr);
 
 void parse_commands(const vector<string>&, vector<vector<string>>&);
 
-void pipe_cmds(const vector<vector<string>>& cmds);
+bool parse_fan_out(vector<string>& args, vector<vector<string>>& branches);
+
+bool parse_merge(vector<string>& args, vector<vector<string>>& producers, bool& ordered);
+
+bool take_redirections(vector<vector<string>>& cmds, redirection& redir);
+
+bool open_redirections(redirection& redir);
+
+void close_redirections(redirection& redir);
+
+void plan_pipeline(vector<vector<string>>& cmds);
+
+void pipe_cmds(const vector<vector<string>>& cmds, const redirection& redir,
+               perf_stats* perf = nullptr, pipeline_monitor* monitor = nullptr);
+
+void run_fan_out(const vector<vector<string>>& trunk, const vector<vector<string>>& branches,
+                 const redirection& redir);
+
+void run_merge(const vector<vector<string>>& producers, bool ordered,
+               vector<vector<string>>& cmds, const vector<vector<string>>& branches,
+               const redirection& redir);
+
+void explain_pipeline(const vector<vector<string>>& cmds, const redirection& redir);
+
+static void explain_line(vector<string> args);
+
+static void split_words(const string& line, vector<string>& words);
+
+static void read_here_documents(vector<string>& args);
+
+static bool expand_pipeline(vector<vector<string>>& cmds, redirection& redir, size_t depth);
+
+static void finish_substitutions(size_t from);
+
+static string join_args(const vector<string>& cmd);
 
 int main() {
     // Todo: implement
 
+    // Builtins write to pipes from inside the shell; a reader that went
+    // away must fail that write, not kill the shell.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Builtins that sort names (ls) collate like their coreutils versions,
+    // and grep knows whether the locale's characters are bytes.
+    setlocale(LC_COLLATE, "");
+    setlocale(LC_CTYPE, "");
+
+    load_startup_plugins();
+    trace_init();
+    metrics_init();
+
+    uint64_t last_prompt = 0;
     while (true) {
 
         // shell signature
+        trace_instant("prompt", kShellTrack);
+        uint64_t now = trace_now();
+        if (last_prompt != 0) {
+            record_latency(kPromptToPrompt, now - last_prompt);
+        }
+        last_prompt = now;
         cout << "$ ";
 
         vector<string> args;
         int n = read_args(args);
 
-        if (n == 0) {
-            run_cmd(args);
-        } else {
-            // Parse the input into individual commands.
-            vector<vector<string>> cmds;
-            parse_commands(args, cmds);
+        // `explain PIPELINE` prints how the pipeline would run instead of
+        // running it.
+        if (args.size() > 1 && args[0].compare("explain") == 0) {
+            args.erase(args.begin());
+            explain_line(args);
+            continue;
+        }
 
-            // Execute the pipeline of commands.
-            pipe_cmds(cmds);
+        // `perfstat PIPELINE` runs the pipeline with counters on each
+        // stage and then prints what each one cost.
+        bool perfstat = args.size() > 1 && args[0].compare("perfstat") == 0;
+        if (perfstat) {
+            args.erase(args.begin());
+        }
+
+        // `monitor [-i MS] PIPELINE` samples the pipes and stages while
+        // the pipeline runs and then points at the bottleneck.
+        int monitor_ms = 0;
+        if (args.size() > 1 && args[0].compare("monitor") == 0) {
+            monitor_ms = 100;
+            args.erase(args.begin());
+            if (args.size() > 2 && args[0].compare("-i") == 0) {
+                monitor_ms = atoi(args[1].c_str());
+                args.erase(args.begin(), args.begin() + 2);
+            }
+            if (monitor_ms <= 0) {
+                cerr << "monitor: invalid interval" << endl;
+                continue;
+            }
+        }
+
+        // Parse the input into individual commands, the producers of a
+        // merge at its start and the branches of a fan-out at its end.
+        vector<vector<string>> cmds;
+        vector<vector<string>> producers;
+        vector<vector<string>> branches;
+        redirection redir;
+        bool ordered;
+        bool parsed;
+        {
+            trace_scope parsing("parse");
+            parsed = parse_merge(args, producers, ordered) && parse_fan_out(args, branches);
+            if (parsed) {
+                parse_commands(args, cmds);
+                parsed = take_redirections(cmds, redir);
+            }
+        }
+        if (parsed) {
+            trace_scope expanding("expand");
+            parsed = expand_pipeline(cmds, redir, 0);
+        }
+        if (!parsed || !open_redirections(redir)) {
+            finish_substitutions(0);
+            continue;
+        }
+        if (!producers.empty()) {
+            count_metric(metrics.pipelines);
+            run_merge(producers, ordered, cmds, branches, redir);
+            close_redirections(redir);
+            finish_substitutions(0);
+            continue;
+        }
+        if (cmds[0].empty()) {
+            // Just `> FILE`: creating (or truncating) the file was all.
+            close_redirections(redir);
+            finish_substitutions(0);
+            continue;
+        }
+
+        count_metric(metrics.pipelines);
+        if (!branches.empty()) {
+            // perfstat and monitor look at the stages of a single pipeline.
+            run_fan_out(cmds, branches, redir);
+            close_redirections(redir);
+            finish_substitutions(0);
+            continue;
+        }
+        if (n > 0) {
+            trace_scope planning("plan");
+            plan_pipeline(cmds);
+        }
+
+        // Execute the pipeline of commands.
+        vector<string> names;
+        for (const auto& cmd : cmds) {
+            names.push_back(join_args(cmd));
+        }
+        unique_ptr<perf_stats> perf(perfstat ? new perf_stats(names) : nullptr);
+        unique_ptr<pipeline_monitor> monitor(
+            monitor_ms > 0 && cmds.size() > 1 ? new pipeline_monitor(monitor_ms, names) : nullptr);
+        if (cmds.size() == 1) {
+            run_cmd(cmds[0], redir, perf.get());
+        } else {
+            pipe_cmds(cmds, redir, perf.get(), monitor.get());
+        }
+        close_redirections(redir);
+        finish_substitutions(0);
+        if (perf) {
+            perf->print(cerr);
+        }
+        if (monitor) {
+            monitor->report(cerr);
         }
 
     }
@@ -72,6 +265,16 @@ void parse_commands(const vector<string>& args, vector<vector<string>>& cmds) {
         if (arg.compare("|") == 0) {
             cmds.push_back(t);
             t.clear();
+        } else if (arg.compare("|!") == 0) {
+            // `a |! b` is `a | meter | b`, the meter named after the pipe.
+            cmds.push_back(t);
+            t.clear();
+            string name = cmds.back().empty() ? "" : cmds.back()[0];
+            name = name.substr(name.rfind('/') + 1) + "|!";
+            cmds.push_back({"meter", "-n", name});
+        } else if (is_replica_count(arg) && !t.empty() && !is_replicated_stage(t)) {
+            // `grep x &4` runs four copies of grep x (see replicate.h).
+            t.insert(t.begin(), arg);
         } else {
             t.push_back(arg);
         }
@@ -81,66 +284,1639 @@ void parse_commands(const vector<string>& args, vector<vector<string>>& cmds) {
 
 }
 
-void pipe_cmds(const vector<vector<string>>& cmds) {
+// Cuts a fan-out, `TRUNK |{ BRANCH ; BRANCH ... }`, off the end of args:
+// args keeps the trunk and any redirection after the }, which is where
+// the branches' output goes, and branches gets each branch's words, which
+// may end in a fan-out of their own.  Returns false after printing why if
+// the braces don't make sense.
+bool parse_fan_out(vector<string>& args, vector<vector<string>>& branches) {
+    size_t open = std::find(args.begin(), args.end(), "|{") - args.begin();
+    if (open == args.size()) {
+        return true;
+    }
+    int depth = 0;
+    size_t close = open;
+    branches.emplace_back();
+    for (size_t i = open + 1; i < args.size(); i++) {
+        if (args[i] == "|{") {
+            depth++;
+        } else if (args[i] == "}" && depth-- == 0) {
+            close = i;
+            break;
+        } else if (args[i] == ";" && depth == 0) {
+            branches.emplace_back();
+            continue;
+        }
+        branches.back().push_back(args[i]);
+    }
+    if (close == open) {
+        cerr << "pipe_shell: missing } after |{" << endl;
+        return false;
+    }
+    for (const auto& branch : branches) {
+        if (branch.empty()) {
+            cerr << "pipe_shell: missing command in fan-out" << endl;
+            return false;
+        }
+    }
+    for (size_t i = close + 1; i < args.size(); i++) {
+        if (args[i].empty() || args[i][0] != '>') {
+            cerr << "pipe_shell: only > or >> can follow a fan-out's }" << endl;
+            return false;
+        }
+        if (args[i] == ">" || args[i] == ">>") {
+            i++;  // the file name
+        }
+    }
+    vector<string> trunk(args.begin(), args.begin() + open);
+    trunk.insert(trunk.end(), args.begin() + close + 1, args.end());
+    args.swap(trunk);
+    return true;
+}
+
+// Cuts a merge, `merge [-o] { PRODUCER ; PRODUCER ... }`, off the start of
+// args: producers gets each producer's words, ordered whether -o was
+// given, and args keeps what reads the merged output -- the consumer
+// after a |, or nothing -- and any redirection.  Leaves args alone if it
+// doesn't start with a merge.  Returns false after printing why if the
+// braces don't make sense.
+bool parse_merge(vector<string>& args, vector<vector<string>>& producers, bool& ordered) {
+    ordered = args.size() > 1 && args[1] == "-o";
+    size_t open = ordered ? 2 : 1;
+    if (args.size() <= open || args[0] != "merge" || args[open] != "{") {
+        ordered = false;
+        return true;
+    }
+    int depth = 0;
+    size_t close = open;
+    producers.emplace_back();
+    for (size_t i = open + 1; i < args.size(); i++) {
+        if (args[i] == "{" || args[i] == "|{") {
+            depth++;
+        } else if (args[i] == "}" && depth-- == 0) {
+            close = i;
+            break;
+        } else if (args[i] == ";" && depth == 0) {
+            producers.emplace_back();
+            continue;
+        }
+        producers.back().push_back(args[i]);
+    }
+    if (close == open) {
+        cerr << "pipe_shell: missing } after merge {" << endl;
+        return false;
+    }
+    for (const auto& producer : producers) {
+        if (producer.empty()) {
+            cerr << "pipe_shell: missing command in merge" << endl;
+            return false;
+        }
+    }
+    vector<string> rest(args.begin() + close + 1, args.end());
+    if (!rest.empty() && rest[0] == "|") {
+        rest.erase(rest.begin());
+        if (rest.empty() || rest[0][0] == '>') {
+            cerr << "pipe_shell: missing command after merge's |" << endl;
+            return false;
+        }
+    } else if (!rest.empty() && rest[0][0] != '>') {
+        cerr << "pipe_shell: only | or a redirection can follow merge's }" << endl;
+        return false;
+    }
+    args.swap(rest);
+    return true;
+}
+
+// Whether word has a command or process substitution ($(, <( or >()
+// opening at i.
+static bool opens_substitution(const string& word, size_t i) {
+    return i + 1 < word.size() && word[i + 1] == '(' &&
+           (word[i] == '$' || word[i] == '<' || word[i] == '>');
+}
+
+// Splits line into words at spaces, except inside a $(...), <(...) or
+// >(...): a substitution stays one word however many spaces it has.
+static void split_words(const string& line, vector<string>& words) {
+    string word;
+    int depth = 0;
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (c == ' ' && depth == 0) {
+            if (!word.empty()) {
+                words.push_back(word);
+                word.clear();
+            }
+            continue;
+        }
+        if (opens_substitution(line, i)) {
+            depth++;
+            word += line[i++];
+        } else if (c == '(' && depth > 0) {
+            depth++;
+        } else if (c == ')' && depth > 0) {
+            depth--;
+        }
+        word += line[i];
+    }
+    if (!word.empty() || words.empty()) {
+        words.push_back(word);
+    }
+}
+
+// Where the ) closing the $( (or <( or >() whose contents start at start
+// is, or npos.
+static size_t closing_paren(const string& word, size_t start) {
+    int depth = 1;
+    for (size_t i = start; i < word.size(); i++) {
+        if (word[i] == '(') {
+            depth++;
+        } else if (word[i] == ')' && --depth == 0) {
+            return i;
+        }
+    }
+    return string::npos;
+}
+
+// Parses, expands and opens the redirections of a command line nested in
+// another (in a substitution or a fan-out branch) at the given depth:
+// cmds gets its pipeline and branches the branches of a fan-out ending
+// it.  Returns false after printing why if it can't run.
+static bool parse_nested(vector<string> args, vector<vector<string>>& cmds,
+                         vector<vector<string>>& branches, redirection& redir, size_t depth) {
+    if (!parse_fan_out(args, branches)) {
+        return false;
+    }
+    parse_commands(args, cmds);
+    return take_redirections(cmds, redir) && expand_pipeline(cmds, redir, depth + 1) &&
+           open_redirections(redir);
+}
+
+static bool parse_nested(const string& line, vector<vector<string>>& cmds,
+                         vector<vector<string>>& branches, redirection& redir, size_t depth) {
+    string trimmed = boost::algorithm::trim_copy(line);
+    vector<string> args;
+    split_words(trimmed, args);
+    return parse_nested(args, cmds, branches, redir, depth);
+}
+
+// Runs what parse_nested() made of a command line.
+static void run_nested(vector<vector<string>>& cmds, const vector<vector<string>>& branches,
+                       redirection& redir) {
+    if (!cmds[0].empty()) {
+        if (!branches.empty()) {
+            run_fan_out(cmds, branches, redir);
+        } else if (cmds.size() == 1) {
+            run_cmd(cmds[0], redir);
+        } else {
+            plan_pipeline(cmds);
+            pipe_cmds(cmds, redir);
+        }
+    }
+    close_redirections(redir);
+}
+
+// A <(...) or >(...): a forked copy of the shell running the command line
+// inside, and the end of the pipe to it that the shell holds open for the
+// command it is an argument of.
+struct process_substitution {
+    pid_t pid;
+    int fd;
+};
+
+// The process substitutions of the command lines being run, the innermost
+// line's last.
+static vector<process_substitution> substitutions;
+
+// The exit statuses of children wait_stages() reaped while it waited for
+// others: a process substitution can end while the pipeline it is an
+// argument of runs, or while a $(...) in a later word does.
+static std::map<pid_t, int> reaped_early;
+
+// A pipe end a merge's thread holds while the merge's consumer runs, with
+// the pipe's inode: the thread closes it when its producer is done, and
+// the number may be reused by then.
+struct merge_pipe {
+    int fd;
+    ino_t ino;
+};
+
+// The pipe ends of the merge whose consumer is running: the producers'
+// pipes and the write end of the merged one.  A forked copy of the shell
+// the consumer starts (a fan-out branch, a process substitution) must not
+// hold them, or the consumer would never see EOF.
+static vector<merge_pipe> merge_pipes;
+
+// In a forked copy of the shell that goes on to run a command line of its
+// own: closes the descriptors the shell holds for others, the pipes to
+// the process substitutions and those of a running merge, so no reader
+// waiting for EOF waits for this copy to exit too.  Drops the io_uring
+// ring it would share with the shell.
+static void enter_forked_copy(const vector<int>& shell_fds) {
+    for (int fd : shell_fds) {
+        close(fd);
+    }
+    for (const auto& other : substitutions) {
+        close(other.fd);
+    }
+    substitutions.clear();
+    for (const auto& pipe : merge_pipes) {
+        struct stat st;
+        if (fstat(pipe.fd, &st) == 0 && st.st_ino == pipe.ino) {
+            close(pipe.fd);
+        }
+    }
+    merge_pipes.clear();
+    io_engine_forked();
+}
+
+// Waits for a forked copy of the shell, unless wait_stages() already has.
+static void wait_forked_copy(pid_t pid) {
+    auto reaped = reaped_early.find(pid);
+    if (reaped != reaped_early.end()) {
+        reaped_early.erase(reaped);
+    } else {
+        int status;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+    }
+    metrics.children.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Starts the command line inside a <(...) (output: the command reads what
+// it writes) or a >(...) in a forked copy of the shell, so the command and
+// every substitution in it run at once.  Returns the /dev/fd path the
+// command opens to reach it, or "" after printing why it couldn't start.
+static string start_substitution(const string& line, bool output, size_t depth) {
+    // Not close-on-exec: the command's forked stages open the path too.
+    int fds[2];
+    if (pipe(fds) < 0) {
+        cerr << "pipe_shell: " << strerror(errno) << endl;
+        return "";
+    }
+    int keep = output ? fds[0] : fds[1];
+    int give = output ? fds[1] : fds[0];
+    cout.flush();
+    uint64_t start = trace_now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        cerr << "pipe_shell: " << strerror(errno) << endl;
+        close(fds[0]);
+        close(fds[1]);
+        return "";
+    }
+    if (pid == 0) {
+        enter_forked_copy({keep});
+        fcntl(give, F_SETFD, FD_CLOEXEC);
+        vector<vector<string>> cmds;
+        vector<vector<string>> branches;
+        redirection redir;
+        if (output) {
+            redir.out = give;
+        } else {
+            redir.in = give;
+        }
+        if (parse_nested(line, cmds, branches, redir, depth)) {
+            run_nested(cmds, branches, redir);
+        }
+        finish_substitutions(0);
+        cout.flush();
+        _exit(EXIT_SUCCESS);
+    }
+    trace_span("fork", kShellTrack, start, "pid", pid);
+    count_metric(metrics.forks);
+    metrics.children.fetch_add(1, std::memory_order_relaxed);
+    close(give);
+    substitutions.push_back({pid, keep});
+    return "/dev/fd/" + std::to_string(keep);
+}
+
+// Closes the shell's ends of the process substitutions started since the
+// first `from` and waits for them.  Closing comes first: it is what ends a
+// >(...)'s input, and what stops a <(...) nobody reads on a broken pipe.
+static void finish_substitutions(size_t from) {
+    for (size_t i = from; i < substitutions.size(); i++) {
+        close(substitutions[i].fd);
+    }
+    for (size_t i = from; i < substitutions.size(); i++) {
+        wait_forked_copy(substitutions[i].pid);
+    }
+    substitutions.resize(from);
+}
+
+// Runs the command line inside a $(...) at the given nesting depth and
+// returns its output.  The output lands in a buffer the shell keeps for
+// each depth, so a loop of substitutions doesn't allocate once it has
+// grown; it is valid until the next substitution at the same depth.  A
+// substitution made only of builtins doesn't fork.
+static const string& substitute(const string& line, size_t depth) {
+    static vector<unique_ptr<string>> arenas;
+    while (arenas.size() <= depth) {
+        arenas.emplace_back(new string);
+    }
+    string& out = *arenas[depth];
+    out.clear();
+
+    size_t running = substitutions.size();
+    vector<vector<string>> cmds;
+    vector<vector<string>> branches;
+    redirection redir;
+    redir.capture = &out;
+    if (parse_nested(line, cmds, branches, redir, depth)) {
+        run_nested(cmds, branches, redir);
+    }
+    finish_substitutions(running);
+    return out;
+}
+
+// Where the first substitution in word at or after from opens, or npos.
+static size_t find_substitution(const string& word, size_t from) {
+    for (size_t i = from; i + 1 < word.size(); i++) {
+        if (opens_substitution(word, i)) {
+            return i;
+        }
+    }
+    return string::npos;
+}
+
+// Replaces each $(...) in word with the output of the command line in it,
+// split into words at blanks as an unquoted substitution is in sh, and
+// each <(...) or >(...) with the path of a pipe from or to the command
+// line in it, and appends the result to words.  Returns false after
+// printing why if a substitution isn't closed or can't start.
+static bool expand_word(const string& word, vector<string>& words, size_t depth) {
+    if (find_substitution(word, 0) == string::npos) {
+        words.push_back(word);
+        return true;
+    }
+    string current;
+    size_t i = 0;
+    while (i < word.size()) {
+        size_t open = find_substitution(word, i);
+        if (open == string::npos) {
+            current.append(word, i, string::npos);
+            break;
+        }
+        current.append(word, i, open - i);
+        size_t close = closing_paren(word, open + 2);
+        if (close == string::npos) {
+            cerr << "pipe_shell: missing ) in " << word << endl;
+            return false;
+        }
+        if (word[open] != '$') {
+            string path = start_substitution(word.substr(open + 2, close - open - 2),
+                                             word[open] == '<', depth);
+            if (path.empty()) {
+                return false;
+            }
+            current += path;
+            i = close + 1;
+            continue;
+        }
+        const string& output = substitute(word.substr(open + 2, close - open - 2), depth);
+        // Trailing newlines go, the way sh drops them.
+        size_t end = output.find_last_not_of('\n') + 1;
+        for (size_t j = 0; j < end; j++) {
+            char c = output[j];
+            if (c == ' ' || c == '\t' || c == '\n') {
+                if (!current.empty()) {
+                    words.push_back(current);
+                    current.clear();
+                }
+            } else {
+                current += c;
+            }
+        }
+        i = close + 1;
+    }
+    if (!current.empty()) {
+        words.push_back(current);
+    }
+    return true;
+}
+
+// Replaces each $(...) in the body of a here-document with the output of
+// the command line in it, trailing newlines dropped, as sh does.  Unlike
+// in a word, the output isn't split into words, and <(...) and >(...) are
+// left as they are.  Returns false after printing why if a substitution
+// isn't closed.
+static bool expand_here_body(string& body, size_t depth) {
+    size_t open = body.find("$(");
+    if (open == string::npos) {
+        return true;
+    }
+    string expanded;
+    size_t i = 0;
+    for (; open != string::npos; open = body.find("$(", i)) {
+        expanded.append(body, i, open - i);
+        size_t close = closing_paren(body, open + 2);
+        if (close == string::npos) {
+            cerr << "pipe_shell: missing ) in here-document" << endl;
+            return false;
+        }
+        const string& output = substitute(body.substr(open + 2, close - open - 2), depth);
+        expanded.append(output, 0, output.find_last_not_of('\n') + 1);
+        i = close + 1;
+    }
+    expanded.append(body, i, string::npos);
+    body.swap(expanded);
+    return true;
+}
+
+// Expands the substitutions in cmds and in the redirected file
+// names.  Happens after the line is cut into commands, so a | or > in a
+// substitution's output is just a word.  Returns false after printing why
+// if something is wrong.
+static bool expand_pipeline(vector<vector<string>>& cmds, redirection& redir, size_t depth) {
+    for (auto& cmd : cmds) {
+        vector<string> words;
+        for (const auto& word : cmd) {
+            if (!expand_word(word, words, depth)) {
+                return false;
+            }
+        }
+        if (words.empty() && cmds.size() > 1) {
+            cerr << "pipe_shell: missing command in pipeline" << endl;
+            return false;
+        }
+        cmd.swap(words);
+    }
+    for (string* file : {&redir.in_file, &redir.out_file}) {
+        if (file->empty()) {
+            continue;
+        }
+        vector<string> words;
+        if (!expand_word(*file, words, depth)) {
+            return false;
+        }
+        if (words.size() != 1) {
+            cerr << "pipe_shell: " << *file << ": ambiguous redirect" << endl;
+            return false;
+        }
+        *file = words[0];
+    }
+    if (redir.here_string) {
+        // A here-string is one word however many its expansion makes.
+        vector<string> words;
+        if (!expand_word(redir.here_text, words, depth)) {
+            return false;
+        }
+        redir.here_text = boost::algorithm::join(words, " ") + "\n";
+        redir.here_string = false;
+    }
+    if (redir.here_body) {
+        redir.here_body = false;
+        return expand_here_body(redir.here_text, depth);
+    }
+    return true;
+}
+
+// Removes the redirections from cmds into redir.  `<` is only taken on the
+// first command and `>`/`>>` on the last, with the file name as the next
+// word or attached (`>out`).  Returns false after printing why if they
+// don't make sense.
+bool take_redirections(vector<vector<string>>& cmds, redirection& redir) {
+    for (size_t i = 0; i < cmds.size(); i++) {
+        vector<string> words;
+        for (size_t j = 0; j < cmds[i].size(); j++) {
+            const string& word = cmds[i][j];
+            string op = opens_substitution(word, 0) ? ""
+                      : word.compare(0, 3, "<<<") == 0 ? "<<<"
+                      : word.compare(0, 2, "<<") == 0 ? "<<"
+                      : word.compare(0, 2, ">>") == 0 ? ">>"
+                      : !word.empty() && (word[0] == '<' || word[0] == '>') ? word.substr(0, 1)
+                      : "";
+            if (op.empty()) {
+                words.push_back(word);
+                continue;
+            }
+            // read_args() left a here-document's body in its word, after
+            // the delimiter and a newline.
+            size_t body = word.find('\n');
+            string file = op == "<<" && body != string::npos ? word.substr(body + 1)
+                        : word.substr(op.size());
+            if (file.empty() && op != "<<" && j + 1 < cmds[i].size()) {
+                file = cmds[i][++j];
+            }
+            if (op == "<<" && body == string::npos) {
+                cerr << "pipe_shell: missing delimiter after <<" << endl;
+                return false;
+            }
+            if (file.empty() && op != "<<") {
+                cerr << "pipe_shell: missing " << (op == "<<<" ? "word" : "file name")
+                     << " after " << op << endl;
+                return false;
+            }
+            bool input = op[0] == '<';
+            if (input && i != 0) {
+                cerr << "pipe_shell: only the first command can read from " << op << endl;
+                return false;
+            }
+            if (!input && i != cmds.size() - 1) {
+                cerr << "pipe_shell: only the last command can write a file with " << op << endl;
+                return false;
+            }
+            if (op == "<") {
+                redir.in_file = file;
+                redir.here = false;
+            } else if (input) {
+                redir.in_file.clear();
+                redir.here = true;
+                redir.here_string = op == "<<<";
+                redir.here_body = op == "<<" && word[2] != '\'' && word[2] != '"';
+                redir.here_text = file;
+            } else {
+                redir.out_file = file;
+                redir.append = op == ">>";
+            }
+        }
+        if (words.empty() && cmds.size() > 1) {
+            cerr << "pipe_shell: missing command in pipeline" << endl;
+            return false;
+        }
+        cmds[i] = words;
+    }
+    return true;
+}
+
+// Whether here-documents go through a temporary file on disk, the way
+// other shells do it, instead of a memfd; for comparing the two.
+static bool here_tmpfile() {
+    static const bool tmpfile = getenv("PIPE_SHELL_HEREDOC") != nullptr &&
+                                strcmp(getenv("PIPE_SHELL_HEREDOC"), "tmpfile") == 0;
+    return tmpfile;
+}
+
+// The file a here-document or here-string is read from: a memfd sealed
+// against any change, so nothing lands on disk and no writer has to keep
+// a pipe fed while the stage reads.  The stage sees a regular file it can
+// seek in and stat() the size of.  Returns -1 on failure.
+static int here_fd(const string& text) {
+    int fd;
+    if (here_tmpfile()) {
+        string path = string(getenv("TMPDIR") != nullptr ? getenv("TMPDIR") : "/tmp") +
+                      "/pipe_shell_here.XXXXXX";
+        fd = mkostemp(&path[0], O_CLOEXEC);
+        if (fd >= 0) {
+            unlink(path.c_str());
+        }
+    } else {
+        fd = memfd_create("pipe_shell here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    if (!write_all(fd, text.data(), text.size()) || lseek(fd, 0, SEEK_SET) < 0 ||
+        (!here_tmpfile() &&
+         fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+bool open_redirections(redirection& redir) {
+    if (redir.here) {
+        redir.in = here_fd(redir.here_text);
+        if (redir.in < 0) {
+            cerr << "pipe_shell: here-document: " << strerror(errno) << endl;
+            redir.in = STDIN_FILENO;
+            return false;
+        }
+        string().swap(redir.here_text);
+    }
+    if (!redir.in_file.empty()) {
+        redir.in = open(redir.in_file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (redir.in < 0) {
+            cerr << "pipe_shell: " << redir.in_file << ": " << strerror(errno) << endl;
+            redir.in = STDIN_FILENO;
+            return false;
+        }
+    }
+    if (!redir.out_file.empty()) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (redir.append ? O_APPEND : O_TRUNC);
+        redir.out = open(redir.out_file.c_str(), flags, 0666);
+        if (redir.out < 0) {
+            cerr << "pipe_shell: " << redir.out_file << ": " << strerror(errno) << endl;
+            redir.out = STDOUT_FILENO;
+            close_redirections(redir);
+            return false;
+        }
+    }
+    return true;
+}
+
+void close_redirections(redirection& redir) {
+    if (redir.in != STDIN_FILENO) {
+        close(redir.in);
+        redir.in = STDIN_FILENO;
+    }
+    if (redir.out != STDOUT_FILENO) {
+        close(redir.out);
+        redir.out = STDOUT_FILENO;
+    }
+}
+
+// Whether cmd only reads its stdin, but could as well be handed a file.
+static bool could_read_file(const vector<string>& cmd) {
+    if (cmd[0].compare("tail") == 0) {
+        return !tail_has_file_operand(cmd);
+    }
+    grep_command grep;
+    return (cmd[0].compare("grep") == 0 || cmd[0].compare("grep-chain") == 0) &&
+           parse_grep(cmd, grep) && grep.files.empty();
+}
+
+// Rewrites the pipeline into a cheaper one that produces the same output.
+void plan_pipeline(vector<vector<string>>& cmds) {
+    // A bare `cat` between two stages just copies bytes from one pipe to
+    // the next.  A last one stays: it puts a pipe in front of the terminal,
+    // which ls and friends format for differently.
+    for (size_t i = 1; i + 1 < cmds.size(); i++) {
+        if (cmds[i].size() == 1 && cmds[i][0].compare("cat") == 0) {
+            cmds.erase(cmds.begin() + i);
+            i--;
+        }
+    }
+
+    // `grep a | grep -i b | grep -v c` becomes one grep-chain stage, which
+    // looks for all the patterns in a single pass over each line.
+    for (size_t i = 0; i < cmds.size(); i++) {
+        grep_command chain;
+        if (cmds[i][0].compare("grep") != 0 || !parse_grep(cmds[i], chain)) {
+            continue;
+        }
+        size_t merged = 0;
+        while (i + 1 < cmds.size() && !chain.count) {
+            grep_command next;
+            if (cmds[i + 1][0].compare("grep") != 0 || !parse_grep(cmds[i + 1], next) ||
+                !next.files.empty() || chain.files.size() > 1 ||
+                chain.filters.size() + next.filters.size() > 64) {
+                break;
+            }
+            chain.filters.insert(chain.filters.end(), next.filters.begin(), next.filters.end());
+            chain.count = next.count;
+            cmds.erase(cmds.begin() + i + 1);
+            merged++;
+        }
+        if (merged > 0) {
+            cmds[i] = grep_chain_args(chain);
+        }
+    }
+
+    // `cat FILE | tail ...` becomes `tail ... FILE`, so the builtin tail can
+    // map FILE and read it backwards from EOF instead of having the whole
+    // file pushed through a pipe.  The same goes for the builtin grep.
+    for (size_t i = 0; i + 1 < cmds.size(); i++) {
+        const vector<string>& cat = cmds[i];
+        vector<string>& next = cmds[i + 1];
+        if (cat.size() != 2 || cat[0].compare("cat") != 0 || cat[1][0] == '-' ||
+            !could_read_file(next)) {
+            continue;
+        }
+        struct stat st;
+        if (stat(cat[1].c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        next.push_back("--");
+        next.push_back(cat[1]);
+        cmds.erase(cmds.begin() + i);
+        i--;
+    }
+}
+
+// PIPE_SHELL_FUSE=0 runs every pipeline stage by stage, e.g. to compare.
+static bool fusion_enabled() {
+    static const bool enabled = getenv("PIPE_SHELL_FUSE") == nullptr ||
+                                strcmp(getenv("PIPE_SHELL_FUSE"), "0") != 0;
+    return enabled;
+}
+
+// cmd as it was typed: a replicated stage's `&N` goes back to its end.
+static string join_args(const vector<string>& cmd) {
+    bool replicated = is_replicated_stage(cmd);
+    string s;
+    for (size_t i = replicated ? 1 : 0; i < cmd.size(); i++) {
+        s += (s.empty() ? "" : " ") + cmd[i];
+    }
+    return replicated ? s + " " + cmd[0] : s;
+}
+
+void explain_pipeline(const vector<vector<string>>& cmds, const redirection& redir) {
+    cout << "pipeline:";
+    for (size_t i = 0; i < cmds.size(); i++) {
+        cout << (i == 0 ? " " : " | ") << join_args(cmds[i]);
+    }
+    cout << endl;
+    if (!redir.in_file.empty()) {
+        cout << "  stdin from      " << redir.in_file << endl;
+    } else if (redir.here) {
+        cout << "  stdin from      " << (redir.here_string ? "here-string" : "here-document")
+             << ", a sealed memfd" << endl;
+    }
+    if (!redir.out_file.empty()) {
+        cout << "  stdout " << (redir.append ? "appended to " : "to       ")
+             << redir.out_file << endl;
+    }
+
+    fused_pipeline fused;
+    if (cmds.size() > 1 && fusion_enabled() && fuse_pipeline(cmds, fused)) {
+        cout << fused.describe();
+        return;
+    }
+    for (size_t i = 0; i < cmds.size(); i++) {
+        bool builtin = find_builtin(cmds[i]) != nullptr;
+        if (i > 0) {
+            bool ring = builtin && find_builtin(cmds[i - 1]) != nullptr;
+            cout << "    | " << (ring ? "ring" : "pipe") << endl;
+        }
+        string how = !builtin ? "process"
+                   : is_replicated_stage(cmds[i]) ? "copies x" + cmds[i][0].substr(1)
+                   : !is_builtin_name(cmds[i][0]) ? "plugin thread"
+                   : cmds.size() == 1 ? "builtin" : "builtin thread";
+        cout << "  " << how << string(16 - how.size(), ' ') << join_args(cmds[i]) << endl;
+    }
+}
+
+// Explains the command line args for `explain`, and then each branch of a
+// fan-out at its end.
+static void explain_line(vector<string> args) {
+    vector<vector<string>> producers;
+    vector<vector<string>> branches;
+    vector<vector<string>> cmds;
+    redirection redir;
+    bool ordered;
+    if (!parse_merge(args, producers, ordered) || !parse_fan_out(args, branches)) {
+        return;
+    }
+    if (!producers.empty()) {
+        cout << "merge: " << producers.size() << " producers, "
+             << (ordered ? "concatenated in order with splice(2)"
+                         : "interleaved a line at a time with epoll") << endl;
+        for (size_t i = 0; i < producers.size(); i++) {
+            cout << "producer " << i + 1 << " ";
+            explain_line(producers[i]);
+        }
+        if (args.empty() || args[0][0] == '>') {
+            return;
+        }
+        cout << "consumer ";
+    }
+    parse_commands(args, cmds);
+    if (!take_redirections(cmds, redir)) {
+        return;
+    }
+    plan_pipeline(cmds);
+    explain_pipeline(cmds, redir);
+    if (branches.empty()) {
+        return;
+    }
+    cout << "    |{ tee(2) into " << branches.size() << " branches, output in branch order"
+         << endl;
+    for (size_t i = 0; i < branches.size(); i++) {
+        cout << "branch " << i + 1 << " ";
+        explain_line(branches[i]);
+    }
+}
+
+// For a command substitution whose last stage is forked: the pipe its
+// output goes through.  Returns the read end, or -1; write_fd is set to
+// the write end, or to -1 as well.
+static int capture_pipe(int& write_fd) {
+    int fds[2];
+    write_fd = -1;
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        cerr << "pipe_shell: " << strerror(errno) << endl;
+        return -1;
+    }
+    write_fd = fds[1];
+    return fds[0];
+}
+
+// Reads fd to its end into out, in large reads straight into out's own
+// buffer, and closes it.
+static void read_capture(int fd, string& out) {
+    const size_t kReadSize = 64 * 1024;
+    size_t used = out.size();
+    while (true) {
+        if (out.size() - used < kReadSize) {
+            out.resize(std::max(2 * out.size(), used + kReadSize));
+        }
+        ssize_t n = read(fd, &out[used], out.size() - used);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        used += n;
+    }
+    out.resize(used);
+    close(fd);
+}
+
+// A forked child reports a failed exec through a pipe that closes on a
+// successful one: the parent learns when (and whether) each exec went
+// through.  Returns the read end, or -1; status_fd is set to the write end.
+static int exec_status_pipe(int& status_fd) {
+    int fds[2];
+    status_fd = -1;
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    status_fd = fds[1];
+    return fds[0];
+}
+
+// In a forked child whose exec failed: passes errno up the status pipe.
+static void report_exec_failure(int status_fd) {
+    int error = errno;
+    if (status_fd >= 0) {
+        ssize_t ignored = write(status_fd, &error, sizeof(error));
+        (void) ignored;
+    }
+    errno = error;
+}
+
+// Records each exec on its stage's track, and how long it took from the
+// fork, as its status pipe (see exec_status_pipe()) closes, and closes the
+// pipes.
+static void watch_execs(const vector<int>& status_fds, const vector<int>& tracks,
+                        const vector<uint64_t>& started) {
+    vector<pollfd> watched;
+    vector<size_t> stages;
+    for (size_t i = 0; i < status_fds.size(); i++) {
+        if (status_fds[i] >= 0) {
+            watched.push_back({status_fds[i], POLLIN, 0});
+            stages.push_back(i);
+        }
+    }
+    while (!watched.empty()) {
+        if (poll(watched.data(), watched.size(), -1) < 0 && errno != EINTR) {
+            break;
+        }
+        for (size_t i = 0; i < watched.size(); i++) {
+            if (watched[i].revents == 0) {
+                continue;
+            }
+            int error;
+            size_t stage = stages[i];
+            if (read(watched[i].fd, &error, sizeof(error)) == sizeof(error)) {
+                trace_instant("exec failed", tracks[stage], "errno", error);
+                count_metric(metrics.exec_failures);
+            } else {
+                trace_instant("exec", tracks[stage]);
+                record_latency(kSpawnProcess, trace_now() - started[stage]);
+            }
+            close(watched[i].fd);
+            watched.erase(watched.begin() + i);
+            stages.erase(stages.begin() + i);
+            i--;
+        }
+    }
+    for (const auto& w : watched) {
+        close(w.fd);
+    }
+}
+
+// With perfstat, a forked child waits on a pipe until the shell has
+// attached its counters, and execs once the shell closes the other end.
+// Returns the end the shell closes, or -1; hold_fd is set to the child's.
+static int start_gate(perf_stats* perf, int& hold_fd) {
+    int fds[2];
+    hold_fd = -1;
+    if (perf == nullptr || pipe2(fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    hold_fd = fds[0];
+    return fds[1];
+}
+
+// In a forked child: waits until the shell opens the start gate.
+static void wait_at_gate(int hold_fd, int gate) {
+    if (hold_fd >= 0) {
+        char c;
+        close(gate);
+        while (read(hold_fd, &c, 1) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+// Waits for the forked stages, handing perf their rusage.  They are reaped
+// in whatever order they exit, so each stage's run ends on its track, and
+// its wall time is recorded under its command, when it really did.  Only
+// this thread's children are waited for: a builtin stage that starts
+// commands of its own (xargs, a replicated stage) reaps those itself.
+static void wait_stages(const vector<vector<string>>& cmds, const vector<pid_t>& pids,
+                        const vector<int>& tracks, const vector<uint64_t>& started,
+                        perf_stats* perf) {
+    size_t left = pids.size() - std::count(pids.begin(), pids.end(), -1);
+    while (left > 0) {
+        int status;
+        rusage usage;
+        pid_t pid = wait4(-1, &status, __WNOTHREAD, &usage);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        size_t i = std::find(pids.begin(), pids.end(), pid) - pids.begin();
+        if (i < pids.size()) {
+            trace_span("run", tracks[i], started[i], "status", exit_code(status));
+            record_command(cmds[i][0], trace_now() - started[i]);
+            if (perf != nullptr) {
+                perf->reaped(i, usage);
+            }
+            metrics.children.fetch_sub(1, std::memory_order_relaxed);
+            left--;
+        } else {
+            reaped_early[pid] = status;
+        }
+    }
+}
+
+void pipe_cmds(const vector<vector<string>>& cmds, const redirection& redir, perf_stats* perf,
+               pipeline_monitor* monitor) {
     int num_cmds = cmds.size();
 
-    // Create pipes.
+    // A pipeline of nothing but line-oriented builtins reading files runs
+    // as a single pass over the files, right here.  A monitored one runs
+    // stage by stage: there is nothing to compare in a single pass.
+    uint64_t pipeline_start = trace_now();
+    fused_pipeline fused;
+    if (monitor == nullptr && fusion_enabled() && fuse_pipeline(cmds, fused)) {
+        int track = trace_enabled() ? trace_track("fused pipeline") : kShellTrack;
+        cout.flush();
+        StageIO io = {redir.in, redir.capture != nullptr ? -1 : redir.out, nullptr, nullptr,
+                      redir.capture};
+        if (perf != nullptr) {
+            perf->fuse();
+            perf->start_thread(0);
+        }
+        arm_first_byte(io.out, pipeline_start);
+        fused.run(io);
+        disarm_first_byte();
+        if (perf != nullptr) {
+            perf->stop_thread(0);
+        }
+        trace_span("run", track, pipeline_start);
+        record_command("(fused)", trace_now() - pipeline_start);
+        return;
+    }
+
+    // Builtin stages run on a thread inside the shell instead of in a
+    // forked child.
+    vector<builtin_fn> builtins(num_cmds);
+    vector<int> tracks(num_cmds, kShellTrack);
+    for (int i = 0; i < num_cmds; i++) {
+        builtins[i] = find_builtin(cmds[i]);
+        if (trace_enabled()) {
+            tracks[i] = trace_track(join_args(cmds[i]));
+        }
+    }
+
+    // A command substitution's output goes to the shell: a builtin last
+    // stage appends it to the capture itself, a forked one writes it to a
+    // pipe the shell reads.
+    int out = redir.out;
+    int capture_read = -1;
+    if (redir.capture != nullptr) {
+        out = -1;
+        if (builtins[num_cmds - 1] == nullptr) {
+            capture_read = capture_pipe(out);
+        }
+    }
+
+    // Create pipes.  Two neighbouring builtin stages don't need one: they
+    // share a ring in the shell's memory instead, which saves copying
+    // everything through the kernel and a context switch per buffer.
     vector<int[2]> pipes(num_cmds - 1);
+    vector<unique_ptr<byte_ring>> rings(num_cmds - 1);
     for (int i = 0; i < num_cmds - 1; i++) {
-        if (pipe(pipes[i]) < 0) {
+        uint64_t creating = trace_now();
+        if (builtins[i] != nullptr && builtins[i + 1] != nullptr) {
+            rings[i].reset(new byte_ring(kStageRingSize));
+            pipes[i][0] = pipes[i][1] = -1;
+        } else if (pipe2(pipes[i], O_CLOEXEC) < 0) {
             cerr << strerror(errno) << endl;
             exit(EXIT_FAILURE);
         }
+        trace_span(rings[i] ? "ring" : "pipe", kShellTrack, creating);
+        if (monitor != nullptr && rings[i]) {
+            monitor->watch_ring(i, rings[i].get());
+        } else if (monitor != nullptr) {
+            monitor->watch_pipe(i, pipes[i][0]);
+        }
     }
 
-    // Execute the commands in the pipeline.
-    vector<pid_t> pids(num_cmds);
+    // The builtin threads own (and close) their pipe ends.
+    vector<bool> thread_owned(2 * num_cmds, false);
     for (int i = 0; i < num_cmds; i++) {
+        if (builtins[i] != nullptr) {
+            if (i > 0) {
+                thread_owned[2 * (i - 1)] = true;
+            }
+            if (i < num_cmds - 1) {
+                thread_owned[2 * i + 1] = true;
+            }
+        }
+    }
+
+    // Execute the external commands in the pipeline.  They are all forked
+    // before any builtin thread starts, so no child is forked from a shell
+    // that is running more than one thread.
+    vector<pid_t> pids(num_cmds, -1);
+    vector<int> exec_status(num_cmds, -1);
+    vector<uint64_t> started(num_cmds);
+    for (int i = 0; i < num_cmds; i++) {
+        if (builtins[i] != nullptr) {
+            continue;
+        }
+        int status_fd;
+        int hold_fd;
+        string file = find_command(cmds[i][0]);
+        exec_status[i] = exec_status_pipe(status_fd);
+        int gate = start_gate(perf, hold_fd);
+        started[i] = trace_now();
         if ((pids[i] = fork()) < 0) {
             cerr << strerror(errno) << endl;
             exit(EXIT_FAILURE);
         } else if (pids[i] == 0) {
             // Child process.
+            signal(SIGPIPE, SIG_DFL);
 
-            // Set up input redirection from the previous command, if there is one.
+            // Set up input redirection from the previous command, if there
+            // is one, or from the pipeline's input file.
             if (i > 0) {
                 dup2(pipes[i - 1][0], STDIN_FILENO);
+            } else if (redir.in != STDIN_FILENO) {
+                dup2(redir.in, STDIN_FILENO);
             }
 
-            // Set up output redirection to the next command, if there is one.
+            // Set up output redirection to the next command, if there is
+            // one, or to the pipeline's output file.
             if (i < num_cmds - 1) {
                 dup2(pipes[i][1], STDOUT_FILENO);
+            } else if (out != STDOUT_FILENO) {
+                dup2(out, STDOUT_FILENO);
             }
 
             // Close all pipe ends.
             for (int j = 0; j < num_cmds - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+                if (!rings[j]) {
+                    close(pipes[j][0]);
+                    close(pipes[j][1]);
+                }
             }
 
             // Execute the command.
-            const vector<string> &cmd = cmds[i];
-            char **argv = new char *[cmd.size() + 1];
-            for (size_t j = 0; j < cmd.size(); j++) {
-                argv[j] = const_cast<char *>(cmd[j].c_str());
+            wait_at_gate(hold_fd, gate);
+            vector<char*> argv = exec_argv(cmds[i]);
+            if (file != cmds[i][0]) {
+                execv(file.c_str(), argv.data());
             }
-            argv[cmd.size()] = nullptr;
-            execvp(argv[0], argv);
+            execvp(argv[0], argv.data());
 
+            report_exec_failure(status_fd);
             cerr << strerror(errno) << endl;
-            delete[] argv;
             exit(EXIT_FAILURE);
         }
+        trace_span("fork", kShellTrack, started[i], "pid", pids[i]);
+        count_metric(metrics.forks);
+        metrics.children.fetch_add(1, std::memory_order_relaxed);
+        if (status_fd >= 0) {
+            close(status_fd);
+        }
+        if (gate >= 0) {
+            perf->attach(i, pids[i]);
+            close(hold_fd);
+            close(gate);
+        }
+        if (monitor != nullptr) {
+            monitor->watch_process(i, pids[i]);
+        }
     }
-    // close all pipe ends in parent process
+
+    // close the pipe ends no builtin thread is going to use
     for (int i = 0; i < num_cmds - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+        if (rings[i]) {
+            continue;
+        }
+        if (!thread_owned[2 * i]) {
+            close(pipes[i][0]);
+        }
+        if (!thread_owned[2 * i + 1]) {
+            close(pipes[i][1]);
+        }
     }
 
-    // wait for all child processes to finish
+    // Only output the shell writes itself can be timed: with an external
+    // last stage, the first byte goes straight from it to the output.
+    if (capture_read >= 0) {
+        close(out);
+    }
+    cout.flush();
+    if (builtins[num_cmds - 1] != nullptr && redir.capture == nullptr) {
+        arm_first_byte(redir.out, pipeline_start);
+    }
+    vector<thread> threads;
     for (int i = 0; i < num_cmds; i++) {
-        waitpid(pids[i], nullptr, 0);
+        if (builtins[i] == nullptr) {
+            continue;
+        }
+        StageIO io = {i > 0 ? pipes[i - 1][0] : redir.in,
+                      i < num_cmds - 1 ? pipes[i][1] : out,
+                      i > 0 ? rings[i - 1].get() : nullptr,
+                      i < num_cmds - 1 ? rings[i].get() : nullptr,
+                      i < num_cmds - 1 ? nullptr : redir.capture};
+        builtin_fn builtin = builtins[i];
+        const vector<string>& cmd = cmds[i];
+        int track = tracks[i];
+        if (monitor != nullptr) {
+            monitor->watch_thread(i);
+        }
+        uint64_t spawning = trace_now();
+        threads.emplace_back([builtin, &cmd, io, &redir, out, track, perf, monitor, i,
+                              spawning]() mutable {
+            uint64_t start = trace_now();
+            record_latency(kSpawnThread, start - spawning);
+            if (monitor != nullptr) {
+                monitor->thread_started(i);
+            }
+            if (perf != nullptr) {
+                perf->start_thread(i);
+            }
+            int status = builtin(cmd, io);
+            if (perf != nullptr) {
+                perf->stop_thread(i);
+            }
+            trace_span("run", track, start, "status", status);
+            record_command(cmd[0], trace_now() - start);
+            // Closing our ends is what lets the neighbouring stages see EOF
+            // (or, upstream, fail their writes like a closed pipe would).
+            if (io.in_ring != nullptr) {
+                io.in_ring->close_read();
+            } else if (io.in != redir.in) {
+                close(io.in);
+            }
+            if (io.out_ring != nullptr) {
+                io.out_ring->close_write();
+            } else if (io.out != out) {
+                close(io.out);
+            }
+            if (monitor != nullptr) {
+                monitor->thread_finished(i);
+            }
+        });
+    }
+
+    // wait for all child processes and builtin threads to finish
+    watch_execs(exec_status, tracks, started);
+    if (capture_read >= 0) {
+        read_capture(capture_read, *redir.capture);
+    }
+    if (monitor != nullptr) {
+        monitor->run();
+    }
+    wait_stages(cmds, pids, tracks, started, perf);
+    for (auto& t : threads) {
+        t.join();
+    }
+    disarm_first_byte();
+}
+
+// Bytes the trunk of a fan-out hands its branches per round.
+static const size_t kFanOutChunk = 64 * 1024;
+
+// Reads len bytes from fd into buf, fewer only at EOF or on an error.
+// Returns how many.
+static size_t read_fully(int fd, char* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// Copies what the trunk of a fan-out writes to `from` into each branch's
+// pipe in `to`: tee(2) duplicates it into all but the last without using
+// it up, and splice(2) then moves it into the last, so the bytes are never
+// copied through user space.  The first tee of a round decides how much
+// the round moves; should a later one come out short (its pipe was nearly
+// full), the round is finished with read() and write() instead.  A branch
+// that stops reading is dropped.  Closes every descriptor.
+static void pump_fan_out(int from, vector<int> to) {
+    vector<char> buf;
+    while (!to.empty()) {
+        size_t last = to.size() - 1;
+        ssize_t n = last == 0 ? splice(from, nullptr, to[0], nullptr, kFanOutChunk, SPLICE_F_MOVE)
+                              : tee(from, to[0], kFanOutChunk, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EPIPE) {
+            close(to[0]);
+            to.erase(to.begin());
+            continue;
+        }
+        if (n <= 0) {
+            break;  // the trunk is done
+        }
+        if (last == 0) {
+            continue;
+        }
+
+        // How much of the round each branch has, -1 once it has gone away.
+        vector<ssize_t> got(to.size(), n);
+        got[last] = 0;
+        bool short_round = false;
+        for (size_t i = 1; i < last; i++) {
+            do {
+                got[i] = tee(from, to[i], n, 0);
+            } while (got[i] < 0 && errno == EINTR);
+            short_round = short_round || (got[i] >= 0 && got[i] < n);
+        }
+        if (short_round) {
+            buf.resize(n);
+            ssize_t have = read_fully(from, buf.data(), n);
+            for (size_t i = 0; i <= last; i++) {
+                if (got[i] >= 0 && got[i] < have &&
+                    !write_all(to[i], buf.data() + got[i], have - got[i])) {
+                    got[i] = -1;
+                }
+            }
+        } else {
+            while (got[last] < n) {
+                ssize_t m = splice(from, nullptr, to[last], nullptr, n - got[last], SPLICE_F_MOVE);
+                if (m < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (m <= 0) {
+                    // The last branch went away; the others have the round.
+                    buf.resize(n - got[last]);
+                    read_fully(from, buf.data(), n - got[last]);
+                    got[last] = -1;
+                    break;
+                }
+                got[last] += m;
+            }
+        }
+        for (size_t i = to.size(); i-- > 0;) {
+            if (got[i] < 0) {
+                close(to[i]);
+                to.erase(to.begin() + i);
+            }
+        }
+    }
+    close(from);
+    for (int fd : to) {
+        close(fd);
+    }
+}
+
+// Runs `TRUNK |{ BRANCH ; BRANCH ... }`: each branch in a forked copy of
+// the shell reading a pipe of its own, and the trunk like any pipeline,
+// writing to a pipe that a thread tees into the branches' (see
+// pump_fan_out()).  The trunk's output is produced once however many
+// branches read it.  The first branch writes where the fan-out does, as
+// it goes; the others write into a memfd each, copied out once the
+// branches before them have finished, so the output comes in branch order
+// whichever branch finishes first.
+void run_fan_out(const vector<vector<string>>& trunk, const vector<vector<string>>& branches,
+                 const redirection& redir) {
+    int trunk_out[2];
+    if (pipe2(trunk_out, O_CLOEXEC) < 0) {
+        cerr << "pipe_shell: " << strerror(errno) << endl;
+        return;
+    }
+
+    // What the copies of the shell running the branches mustn't hold: a
+    // branch holding another's pipe would keep it from seeing EOF.
+    vector<int> held = {trunk_out[0], trunk_out[1]};
+    vector<int> inputs;
+    vector<int> outputs(branches.size(), -1);
+    vector<pid_t> pids;
+    bool started = true;
+    cout.flush();
+    for (size_t i = 0; i < branches.size() && started; i++) {
+        int in[2];
+        int out = redir.out;
+        if (pipe2(in, O_CLOEXEC) < 0) {
+            cerr << "pipe_shell: " << strerror(errno) << endl;
+            started = false;
+            break;
+        }
+        if (i > 0 || redir.capture != nullptr) {
+            out = outputs[i] = memfd_create("pipe_shell fan-out branch", MFD_CLOEXEC);
+        }
+        uint64_t forking = trace_now();
+        pid_t pid = out >= 0 ? fork() : -1;
+        if (pid == 0) {
+            held.push_back(in[1]);
+            enter_forked_copy(held);
+            vector<vector<string>> cmds;
+            vector<vector<string>> nested;
+            redirection branch_redir;
+            branch_redir.in = in[0];
+            branch_redir.out = out;
+            if (parse_nested(branches[i], cmds, nested, branch_redir, 0)) {
+                run_nested(cmds, nested, branch_redir);
+            }
+            finish_substitutions(0);
+            cout.flush();
+            _exit(EXIT_SUCCESS);
+        }
+        close(in[0]);
+        if (pid < 0) {
+            cerr << "pipe_shell: " << strerror(errno) << endl;
+            close(in[1]);
+            started = false;
+            break;
+        }
+        trace_span("fork", kShellTrack, forking, "pid", pid);
+        count_metric(metrics.forks);
+        metrics.children.fetch_add(1, std::memory_order_relaxed);
+        pids.push_back(pid);
+        inputs.push_back(in[1]);
+        held.push_back(in[1]);
+        if (outputs[i] >= 0) {
+            held.push_back(outputs[i]);
+        }
+    }
+
+    if (started) {
+        thread pump(pump_fan_out, trunk_out[0], inputs);
+        redirection trunk_redir = redir;
+        trunk_redir.out = trunk_out[1];
+        trunk_redir.capture = nullptr;
+        vector<vector<string>> cmds = trunk;
+        if (cmds.size() == 1) {
+            run_cmd(cmds[0], trunk_redir);
+        } else {
+            plan_pipeline(cmds);
+            pipe_cmds(cmds, trunk_redir);
+        }
+        close(trunk_out[1]);
+        pump.join();
+    } else {
+        // The branches that did start see EOF straight away.
+        close(trunk_out[0]);
+        close(trunk_out[1]);
+        for (int fd : inputs) {
+            close(fd);
+        }
+    }
+
+    for (size_t i = 0; i < branches.size(); i++) {
+        if (i < pids.size()) {
+            wait_forked_copy(pids[i]);
+        }
+        if (outputs[i] < 0) {
+            continue;
+        }
+        if (i < pids.size() && lseek(outputs[i], 0, SEEK_SET) == 0) {
+            if (redir.capture != nullptr) {
+                read_capture(outputs[i], *redir.capture);
+                continue;
+            }
+            copy_fd(outputs[i], redir.out);
+        }
+        close(outputs[i]);
+    }
+}
+
+// Bytes merge moves per splice or read.
+static const size_t kMergeChunk = 64 * 1024;
+
+// How far a producer can get ahead of the merge: with -o, what the kernel
+// holds in its pipe while the producers before it are passed on; without,
+// the longest line kept whole.  Past that a producer waits, or its line
+// goes out in pieces.
+static const size_t kMergeBuffer = 1 << 20;
+
+// Moves everything readable from in to out with splice(2), or with read()
+// and write() where out can't take a splice (a terminal, say).  Returns
+// false if out went away.
+static bool splice_all(int in, int out) {
+    bool splicing = true;
+    vector<char> buf;
+    while (true) {
+        ssize_t n = splicing ? splice(in, nullptr, out, nullptr, kMergeChunk, SPLICE_F_MOVE)
+                             : read(in, buf.data(), buf.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && splicing && errno == EINVAL) {
+            splicing = false;
+            buf.resize(kMergeChunk);
+            continue;
+        }
+        if (n < 0 && errno == EPIPE) {
+            return false;
+        }
+        if (n <= 0) {
+            return true;
+        }
+        if (!splicing && !write_all(out, buf.data(), n)) {
+            return false;
+        }
+    }
+}
+
+// Merges the producers' pipes in `from` into out, closing them as they
+// end.  Ordered, each is passed on whole after the one before it.
+// Otherwise an epoll loop passes on whatever complete lines a producer
+// has written as soon as it has, so lines from different producers
+// interleave but never mix; once only one producer is left, the rest of
+// its output is spliced.  If out goes away, the producers' pipes are
+// closed on them.
+static void merge_into(vector<int> from, int out, bool ordered) {
+    bool writing = true;
+    if (ordered) {
+        for (int fd : from) {
+            writing = writing && splice_all(fd, out);
+            close(fd);
+        }
+        return;
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    for (size_t i = 0; i < from.size(); i++) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, from[i], &event);
+    }
+    vector<string> partial(from.size());  // each producer's unfinished line
+    vector<char> buf(kMergeChunk);
+    size_t open = from.size();
+    while (open > 0 && writing) {
+        if (open == 1) {
+            size_t i = std::find_if(from.begin(), from.end(), [](int fd) { return fd >= 0; }) -
+                       from.begin();
+            writing = write_all(out, partial[i].data(), partial[i].size()) &&
+                      splice_all(from[i], out);
+            close(from[i]);
+            from[i] = -1;
+            break;
+        }
+        epoll_event events[16];
+        int ready = epoll_wait(epoll_fd, events, 16, -1);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready < 0) {
+            break;
+        }
+        for (int e = 0; e < ready && writing; e++) {
+            size_t i = events[e].data.u64;
+            ssize_t n = read(from[i], buf.data(), buf.size());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                // Its last line goes out as it is, finished or not.
+                writing = write_all(out, partial[i].data(), partial[i].size());
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, from[i], nullptr);
+                close(from[i]);
+                from[i] = -1;
+                open--;
+                continue;
+            }
+            const char* nl = static_cast<const char*>(memrchr(buf.data(), '\n', n));
+            if (nl == nullptr) {
+                partial[i].append(buf.data(), n);
+                if (partial[i].size() >= kMergeBuffer) {
+                    writing = write_all(out, partial[i].data(), partial[i].size());
+                    partial[i].clear();
+                }
+                continue;
+            }
+            size_t whole = nl - buf.data() + 1;
+            if (partial[i].empty()) {
+                writing = write_all(out, buf.data(), whole);
+            } else {
+                partial[i].append(buf.data(), whole);
+                writing = write_all(out, partial[i].data(), partial[i].size());
+            }
+            partial[i].assign(buf.data() + whole, n - whole);
+        }
+    }
+    close(epoll_fd);
+    for (int fd : from) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+// Runs `merge [-o] { PRODUCER ; ... } | CONSUMER`: each producer in a
+// forked copy of the shell writing a pipe of its own, all at once, and
+// the consumer like any pipeline (or fan-out) reading a pipe a thread
+// merges theirs into (see merge_into()).  Without a consumer the merged
+// output goes where the line's does.  The producers read nothing unless
+// they redirect their input: they can't all read the shell's.
+void run_merge(const vector<vector<string>>& producers, bool ordered,
+               vector<vector<string>>& cmds, const vector<vector<string>>& branches,
+               const redirection& redir) {
+    if (!redir.in_file.empty() || redir.here) {
+        cerr << "pipe_shell: a merge's consumer reads the merged output, not <" << endl;
+        return;
+    }
+
+    vector<int> outputs;
+    vector<pid_t> pids;
+    cout.flush();
+    for (const auto& producer : producers) {
+        int out[2];
+        if (pipe2(out, O_CLOEXEC) < 0) {
+            cerr << "pipe_shell: " << strerror(errno) << endl;
+            break;
+        }
+        if (ordered) {
+            fcntl(out[0], F_SETPIPE_SZ, static_cast<int>(kMergeBuffer));  // as far as allowed
+        }
+        uint64_t forking = trace_now();
+        pid_t pid = fork();
+        if (pid == 0) {
+            // No copy holds another producer's pipe, which would keep the
+            // merge from seeing it end.
+            vector<int> held = outputs;
+            held.push_back(out[0]);
+            enter_forked_copy(held);
+            vector<vector<string>> producer_cmds;
+            vector<vector<string>> nested;
+            redirection producer_redir;
+            producer_redir.in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            producer_redir.out = out[1];
+            if (parse_nested(producer, producer_cmds, nested, producer_redir, 0)) {
+                run_nested(producer_cmds, nested, producer_redir);
+            }
+            finish_substitutions(0);
+            cout.flush();
+            _exit(EXIT_SUCCESS);
+        }
+        close(out[1]);
+        if (pid < 0) {
+            cerr << "pipe_shell: " << strerror(errno) << endl;
+            close(out[0]);
+            break;
+        }
+        trace_span("fork", kShellTrack, forking, "pid", pid);
+        count_metric(metrics.forks);
+        metrics.children.fetch_add(1, std::memory_order_relaxed);
+        pids.push_back(pid);
+        outputs.push_back(out[0]);
+    }
+
+    int merged[2];
+    if (cmds[0].empty()) {
+        merge_into(outputs, redir.out, ordered);
+    } else if (pipe2(merged, O_CLOEXEC) < 0) {
+        cerr << "pipe_shell: " << strerror(errno) << endl;
+        for (int fd : outputs) {
+            close(fd);
+        }
+    } else {
+        int to = merged[1];
+        for (int fd : outputs) {
+            struct stat st;
+            fstat(fd, &st);
+            merge_pipes.push_back({fd, st.st_ino});
+        }
+        struct stat st;
+        fstat(to, &st);
+        merge_pipes.push_back({to, st.st_ino});
+        thread merging([outputs, to, ordered]() {
+            merge_into(outputs, to, ordered);
+            close(to);
+        });
+        redirection consumer = redir;
+        consumer.in = merged[0];
+        if (!branches.empty()) {
+            run_fan_out(cmds, branches, consumer);
+        } else if (cmds.size() == 1) {
+            run_cmd(cmds[0], consumer);
+        } else {
+            plan_pipeline(cmds);
+            pipe_cmds(cmds, consumer);
+        }
+        // A consumer that stopped reading early stops the producers.
+        close(merged[0]);
+        merging.join();
+        merge_pipes.clear();
+    }
+    for (pid_t pid : pids) {
+        wait_forked_copy(pid);
     }
 }
 
@@ -149,6 +1925,55 @@ bool to_quit(string word) {
     return word.compare("exit") == 0;
 }
 
+// Reads the body of each here-document (`<<DELIM`, or `<< DELIM`) in args
+// from the lines after the command, up to a line that is just DELIM, and
+// leaves it in the word after the delimiter as typed and a newline.  With
+// `<<-DELIM`, leading tabs are dropped from the body's lines and from the
+// line ending it.  Quotes around DELIM are not part of it; they keep the
+// body from being expanded (see expand_pipeline()).
+static void read_here_documents(vector<string>& args) {
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i].compare(0, 2, "<<") != 0 || args[i].compare(0, 3, "<<<") == 0) {
+            continue;
+        }
+        bool strip_tabs = args[i].compare(0, 3, "<<-") == 0;
+        size_t op_size = strip_tabs ? 3 : 2;
+        if (args[i].size() == op_size && i + 1 < args.size()) {
+            args[i] += args[i + 1];
+            args.erase(args.begin() + i + 1);
+        }
+        string typed = args[i].substr(op_size);
+        string delim = typed;
+        if (delim.size() >= 2 && (delim[0] == '\'' || delim[0] == '"') &&
+            delim.back() == delim[0]) {
+            delim = delim.substr(1, delim.size() - 2);
+        }
+        if (delim.empty()) {
+            continue;  // take_redirections() complains
+        }
+        string body;
+        string line;
+        bool ended = false;
+        while (!ended) {
+            cout << "> ";
+            if (!getline(cin, line)) {
+                cerr << "pipe_shell: here-document ended by end of input (wanted " << delim
+                     << ")" << endl;
+                break;
+            }
+            if (strip_tabs) {
+                line.erase(0, line.find_first_not_of('\t'));
+            }
+            ended = line == delim;
+            if (!ended) {
+                body += line;
+                body += '\n';
+            }
+        }
+        args[i] = "<<" + typed + "\n" + body;
+    }
+}
+
 int read_args(vector<string>& args) {
     string line;
 
@@ -161,13 +1986,16 @@ int read_args(vector<string>& args) {
         cout << endl;
         exit(EXIT_SUCCESS);
     }
+    trace_instant("line read", kShellTrack, "bytes", line.size());
 
+    trace_scope tokenizing("tokenize");
     boost::algorithm::trim(line);
-    boost::algorithm::split(args, line, boost::is_any_of(" "), boost::token_compress_on);
+    split_words(line, args);
+    read_here_documents(args);
 
     int n = 0;
     for (auto& w : args) {
-        if (w.compare("|") == 0) {
+        if (w.compare("|") == 0 || w.compare("|!") == 0) {
             n++;
         }
     }
@@ -175,23 +2003,81 @@ int read_args(vector<string>& args) {
     return n;
 }
 
-int run_cmd(const vector<string>& args) {
+int run_cmd(const vector<string>& args, const redirection& redir, perf_stats* perf) {
+    builtin_fn builtin = find_builtin(args);
+    int track = trace_enabled() ? trace_track(join_args(args)) : kShellTrack;
+    uint64_t start = trace_now();
+    if (builtin != nullptr) {
+        // Builtins run inside the shell, anything we buffered has to reach
+        // stdout before they write to it.
+        cout.flush();
+        StageIO io = {redir.in, redir.capture != nullptr ? -1 : redir.out, nullptr, nullptr,
+                      redir.capture};
+        if (perf != nullptr) {
+            perf->start_thread(0);
+        }
+        arm_first_byte(io.out, start);
+        int status = builtin(args, io);
+        disarm_first_byte();
+        if (perf != nullptr) {
+            perf->stop_thread(0);
+        }
+        trace_span("run", track, start, "status", status);
+        record_command(args[0], trace_now() - start);
+        return status;
+    }
+
+    int status_fd;
+    int hold_fd;
+    int out = redir.out;
+    string file = find_command(args[0]);
+    int capture_read = redir.capture != nullptr ? capture_pipe(out) : -1;
+    int exec_status = exec_status_pipe(status_fd);
+    int gate = start_gate(perf, hold_fd);
     pid_t pid = fork();
     if (pid == 0) {
         // child
-        char** argv = new char*[args.size()+1];
-        for (size_t i = 0; i < args.size(); i++) {
-            argv[i] = const_cast<char*>(args[i].c_str());
+        signal(SIGPIPE, SIG_DFL);
+        if (redir.in != STDIN_FILENO) {
+            dup2(redir.in, STDIN_FILENO);
+        }
+        if (out != STDOUT_FILENO) {
+            dup2(out, STDOUT_FILENO);
         }
-        argv[args.size()] = nullptr; // null terminate args array
-        execvp(argv[0], argv);
+        vector<char*> argv = exec_argv(args);
+        wait_at_gate(hold_fd, gate);
+        if (file != args[0]) {
+            execv(file.c_str(), argv.data());
+        }
+        execvp(argv[0], argv.data());
 
         // Exec didn't work, so an error must have been encountered
+        report_exec_failure(status_fd);
         cerr << strerror(errno) << endl;
         exit(EXIT_FAILURE);
     }
 
     // parent
-    waitpid(pid, nullptr, 0);
+    trace_span("fork", kShellTrack, start, "pid", pid);
+    if (pid > 0) {
+        count_metric(metrics.forks);
+        metrics.children.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (status_fd >= 0) {
+        close(status_fd);
+    }
+    if (gate >= 0) {
+        if (pid > 0) {
+            perf->attach(0, pid);
+        }
+        close(hold_fd);
+        close(gate);
+    }
+    watch_execs({exec_status}, {track}, {start});
+    if (capture_read >= 0) {
+        close(out);
+        read_capture(capture_read, *redir.capture);
+    }
+    wait_stages({args}, {pid}, {track}, {start}, perf);
     return EXIT_SUCCESS;
 }
\ No newline at end of file
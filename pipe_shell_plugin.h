@@ -0,0 +1,123 @@
+/*
+ * The interface between pipe_shell and plugins: shared objects that add
+ * pipeline stages running inside the shell, the way its builtins do,
+ * instead of costing a fork() and exec() per stage.
+ *
+ * This header is plain C and is the whole ABI.  Structures are only ever
+ * extended at the end, and every one starts with its size, so a plugin
+ * built against an older version of this header keeps working; a change
+ * that can't be made that way bumps PIPE_SHELL_PLUGIN_ABI_VERSION, and
+ * pipe_shell refuses plugins built for another version.
+ *
+ * A plugin defines its stages and registers them from its init function:
+ *
+ *     static int upper(pipe_shell_stage* stage, const pipe_shell_stage_ops* ops,
+ *                      int argc, const char* const* argv, void* user_data) {
+ *         const char* in;
+ *         size_t len;
+ *         while ((in = ops->input(stage, &len)) != NULL) {
+ *             char* out = ops->output(stage, len);
+ *             for (size_t i = 0; i < len; i++) out[i] = toupper(in[i]);
+ *             if (ops->emit(stage, len) != 0) return 1;
+ *         }
+ *         return 0;
+ *     }
+ *
+ *     static int init(const pipe_shell_host* host) {
+ *         return host->register_stage(host, "upper", upper, NULL);
+ *     }
+ *
+ *     PIPE_SHELL_PLUGIN(init)
+ *
+ * and is built with e.g. `cc -shared -fPIC -o upper.so upper.c`.  It is
+ * loaded at startup if listed (colon separated) in PIPE_SHELL_PLUGINS, or
+ * with the `load` builtin.  Plugin stages are looked up after the builtins
+ * and before the PATH.
+ */
+
+#ifndef PIPE_SHELL_PLUGIN_H_
+#define PIPE_SHELL_PLUGIN_H_
+
+#include <stddef.h>  /* for size_t */
+#include <stdint.h>  /* for uint32_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PIPE_SHELL_PLUGIN_ABI_VERSION 1
+
+/* One running stage, opaque to the plugin. */
+typedef struct pipe_shell_stage pipe_shell_stage;
+
+/*
+ * How a stage gets at its input and output.  Both sides are buffers owned
+ * by the shell: the stage reads straight out of the shell's input buffer
+ * and formats its output straight into the shell's output buffer.
+ */
+typedef struct pipe_shell_stage_ops {
+    uint32_t size;  /* sizeof(pipe_shell_stage_ops) */
+
+    /*
+     * Returns the next piece of the stage's input and sets *len to its
+     * length, or returns NULL at the end of the input (or on a read
+     * error).  The bytes stay valid until the next call; pieces are not
+     * aligned to lines.
+     */
+    const char* (*input)(pipe_shell_stage* stage, size_t* len);
+
+    /*
+     * Returns a buffer with room for at least len bytes of output.  The
+     * buffer is valid until the next call to output() or emit().
+     */
+    char* (*output)(pipe_shell_stage* stage, size_t len);
+
+    /*
+     * Passes the first len bytes of the buffer output() returned on to
+     * the next stage.  Returns 0, or -1 if the next stage has gone away
+     * and the stage should stop.
+     */
+    int (*emit)(pipe_shell_stage* stage, size_t len);
+} pipe_shell_stage_ops;
+
+/*
+ * A stage's body, run on a thread of the shell.  argv[0] is the name the
+ * stage was registered under.  Returns the stage's exit status.  Several
+ * instances of a stage may run at once, on different threads.
+ */
+typedef int (*pipe_shell_stage_fn)(pipe_shell_stage* stage, const pipe_shell_stage_ops* ops,
+                                   int argc, const char* const* argv, void* user_data);
+
+/* What the shell offers a plugin while it is being loaded. */
+typedef struct pipe_shell_host {
+    uint32_t size;         /* sizeof(pipe_shell_host) */
+    uint32_t abi_version;  /* PIPE_SHELL_PLUGIN_ABI_VERSION of the shell */
+
+    /*
+     * Makes name a command that runs fn (passed user_data).  Returns 0, or
+     * -1 if name is taken by a builtin or another plugin's stage.
+     */
+    int (*register_stage)(const struct pipe_shell_host* host, const char* name,
+                          pipe_shell_stage_fn fn, void* user_data);
+} pipe_shell_host;
+
+/* A plugin's init function: registers its stages, returns 0 on success. */
+typedef int (*pipe_shell_plugin_init_fn)(const pipe_shell_host* host);
+
+/*
+ * What pipe_shell looks up in a plugin; PIPE_SHELL_PLUGIN(init) defines
+ * both.
+ */
+#define PIPE_SHELL_PLUGIN_EXPORT __attribute__((visibility("default")))
+extern PIPE_SHELL_PLUGIN_EXPORT const uint32_t pipe_shell_plugin_abi_version;
+PIPE_SHELL_PLUGIN_EXPORT int pipe_shell_plugin_init(const pipe_shell_host* host);
+
+#define PIPE_SHELL_PLUGIN(init)                                                 \
+    const uint32_t pipe_shell_plugin_abi_version = PIPE_SHELL_PLUGIN_ABI_VERSION; \
+    int pipe_shell_plugin_init(const pipe_shell_host* host) { return init(host); }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* PIPE_SHELL_PLUGIN_H_ */
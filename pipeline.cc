@@ -0,0 +1,428 @@
+#include "pipeline.h"
+
+#include <fcntl.h>        // for open(), fcntl()
+#include <pthread.h>      // for pthread_sigmask()
+#include <signal.h>       // for sigtimedwait()
+#include <sys/epoll.h>    // for epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/eventfd.h>  // for eventfd()
+#include <sys/syscall.h>  // for SYS_pidfd_open
+#include <sys/wait.h>     // for waitpid(), WIFSIGNALED()
+#include <unistd.h>       // for pipe2(), read(), write(), close()
+
+#include <algorithm>  // for std::min()
+#include <atomic>
+#include <cerrno>
+#include <cstring>  // for strerror()
+#include <thread>
+
+#include "builtins.h"
+#include "byte_ring.h"
+#include "spawn.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+// The epoll slots of a job; kStageSlot + i is stage i's pidfd.
+enum { kInputSlot, kOutputSlot, kErrorSlot, kStageSlot };
+
+struct pipeline_runner::job {
+    uint64_t id;
+    callback done;
+    pipeline_result result;
+    string input;
+    size_t input_sent = 0;
+    int in_fd = -1;   // the write end of the first stage's stdin
+    int out_fd = -1;  // the read end of the last stage's stdout
+    int err_fd = -1;  // the read end of the spawned stages' stderr
+    vector<pid_t> pids;  // -1 for builtin stages
+    vector<int> pidfds;
+    vector<bool> finished;
+    size_t left = 0;  // stages still running
+    vector<std::thread> threads;
+    vector<size_t> thread_stages;
+    unique_ptr<std::atomic<int>[]> thread_status;  // -1 while running
+    vector<string> thread_err;  // what each builtin stage wrote on stderr
+    vector<unique_ptr<byte_ring>> rings;
+};
+
+pipeline& pipeline::stage(vector<string> argv) {
+    stages_.push_back(std::move(argv));
+    return *this;
+}
+
+pipeline& pipeline::input(string data) {
+    input_ = std::move(data);
+    return *this;
+}
+
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// A write to a pipe whose reader is gone fails with EPIPE instead of
+// raising SIGPIPE, which would kill the program using the runner.
+static ssize_t write_no_sigpipe(int fd, const char* buf, size_t len) {
+    sigset_t pipe_set;
+    sigset_t old;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old);
+    sigset_t pending;
+    sigpending(&pending);
+    bool was_pending = sigismember(&pending, SIGPIPE);
+    ssize_t n = write(fd, buf, len);
+    int error = errno;
+    if (n < 0 && error == EPIPE && !was_pending) {
+        timespec zero = {0, 0};
+        sigtimedwait(&pipe_set, nullptr, &zero);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    errno = error;
+    return n;
+}
+
+pipeline_runner::pipeline_runner()
+    : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+      event_fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev);
+}
+
+pipeline_runner::~pipeline_runner() {
+    run();
+    close(event_fd_);
+    close(epoll_fd_);
+}
+
+void pipeline_runner::watch(int fd, uint32_t events, uint64_t job_id, unsigned slot) {
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.u64 = job_id << 16 | slot;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void pipeline_runner::start(const pipeline& p, callback done) {
+    unique_ptr<job> j(new job);
+    j->id = next_id_++;
+    j->done = std::move(done);
+    launch(*j, p);
+    jobs_[j->id] = std::move(j);
+}
+
+std::future<pipeline_result> pipeline_runner::start(const pipeline& p) {
+    auto promise = std::make_shared<std::promise<pipeline_result>>();
+    start(p, [promise](pipeline_result&& result) { promise->set_value(std::move(result)); });
+    return promise->get_future();
+}
+
+void pipeline_runner::launch(job& j, const pipeline& p) {
+    const auto& cmds = p.stages();
+    size_t n = cmds.size();
+    j.pids.assign(n, -1);
+    j.pidfds.assign(n, -1);
+    j.finished.assign(n, false);
+    j.result.statuses.assign(n, 0);
+    j.result.signals.assign(n, 0);
+    j.result.spawn_errors.assign(n, 0);
+    j.thread_status.reset(new std::atomic<int>[n]);
+    if (n == 0) {
+        j.result.error = EINVAL;
+        return;
+    }
+
+    // Each stage's stdin and stdout, -1 where it is a ring.  Every pipe is
+    // close-on-exec, so a stage only inherits the ends dup'ed onto its own
+    // 0, 1 and 2, and no job's stages hold another job's pipes open.
+    vector<builtin_fn> builtins(n);
+    vector<int> in(n, -1);
+    vector<int> out(n, -1);
+    j.rings.resize(n - 1);
+    int err_write = -1;
+    int fds[2];
+    bool ok = true;
+    for (size_t i = 0; i < n; i++) {
+        builtins[i] = cmds[i].empty() ? nullptr : find_builtin(cmds[i]);
+    }
+    if (!p.input_data().empty()) {
+        ok = pipe2(fds, O_CLOEXEC) == 0;
+        if (ok) {
+            in[0] = fds[0];
+            j.in_fd = fds[1];
+            j.input = p.input_data();
+        }
+    } else {
+        in[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        ok = in[0] >= 0;
+    }
+    for (size_t i = 0; ok && i < n - 1; i++) {
+        if (builtins[i] != nullptr && builtins[i + 1] != nullptr) {
+            j.rings[i].reset(new byte_ring(kStageRingSize));
+        } else if ((ok = pipe2(fds, O_CLOEXEC) == 0)) {
+            out[i] = fds[1];
+            in[i + 1] = fds[0];
+        }
+    }
+    if (ok && (ok = pipe2(fds, O_CLOEXEC) == 0)) {
+        out[n - 1] = fds[1];
+        j.out_fd = fds[0];
+    }
+    if (ok && (ok = pipe2(fds, O_CLOEXEC) == 0)) {
+        err_write = fds[1];
+        j.err_fd = fds[0];
+    }
+    if (!ok) {
+        j.result.error = errno;
+        for (int* fd : {&in[0], &out[n - 1], &j.in_fd, &j.out_fd, &j.err_fd, &err_write}) {
+            if (*fd >= 0) {
+                close(*fd);
+                *fd = -1;
+            }
+        }
+        for (size_t i = 0; i < n - 1; i++) {
+            if (out[i] >= 0) {
+                close(out[i]);
+                close(in[i + 1]);
+            }
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (builtins[i] != nullptr) {
+            continue;
+        }
+        j.left++;
+        int error = ENOENT;
+        if (!cmds[i].empty()) {
+            error = spawn_command(cmds[i], in[i], out[i], err_write, j.pids[i]);
+        }
+        close(in[i]);
+        close(out[i]);
+        if (error != 0) {
+            // As a shell reports a command it couldn't run.
+            j.pids[i] = -1;
+            j.result.err += (cmds[i].empty() ? string("(empty)") : cmds[i][0]) + ": " +
+                            strerror(error) + "\n";
+            j.result.statuses[i] = error == ENOENT ? 127 : 126;
+            j.result.spawn_errors[i] = error;
+            j.finished[i] = true;
+            j.left--;
+            continue;
+        }
+        j.pidfds[i] = syscall(SYS_pidfd_open, j.pids[i], 0);
+        if (j.pidfds[i] >= 0) {
+            fcntl(j.pidfds[i], F_SETFD, FD_CLOEXEC);
+            watch(j.pidfds[i], EPOLLIN, j.id, kStageSlot + i);
+        } else {
+            // Before Linux 5.3: poll() checks on it with waitpid().
+            unwatched_children_ = true;
+        }
+    }
+    close(err_write);
+
+    // The builtin stages own (and close) their ends, as in the shell.  Each
+    // writes its stderr to a string of its own, added to the job's once
+    // the stage is done.
+    j.thread_err.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        if (builtins[i] == nullptr) {
+            continue;
+        }
+        j.left++;
+        j.thread_status[i] = -1;
+        StageIO io = {in[i], out[i], i > 0 ? j.rings[i - 1].get() : nullptr,
+                      i < n - 1 ? j.rings[i].get() : nullptr, nullptr, &j.thread_err[i]};
+        builtin_fn builtin = builtins[i];
+        std::atomic<int>* status = &j.thread_status[i];
+        int event_fd = event_fd_;
+        j.thread_stages.push_back(i);
+        j.threads.emplace_back([builtin, io, status, event_fd](vector<string> argv) mutable {
+            // SIGPIPE would kill the whole program; builtins see EPIPE.
+            sigset_t pipe_set;
+            sigemptyset(&pipe_set);
+            sigaddset(&pipe_set, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &pipe_set, nullptr);
+            int result = builtin(argv, io);
+            if (io.in_ring != nullptr) {
+                io.in_ring->close_read();
+            } else {
+                close(io.in);
+            }
+            if (io.out_ring != nullptr) {
+                io.out_ring->close_write();
+            } else {
+                close(io.out);
+            }
+            status->store(result, std::memory_order_release);
+            uint64_t one = 1;
+            ssize_t ignored = write(event_fd, &one, sizeof(one));
+            (void) ignored;
+        }, cmds[i]);
+    }
+
+    if (j.in_fd >= 0) {
+        set_nonblocking(j.in_fd);
+        watch(j.in_fd, EPOLLOUT, j.id, kInputSlot);
+    }
+    set_nonblocking(j.out_fd);
+    watch(j.out_fd, EPOLLIN, j.id, kOutputSlot);
+    set_nonblocking(j.err_fd);
+    watch(j.err_fd, EPOLLIN, j.id, kErrorSlot);
+}
+
+void pipeline_runner::feed_input(job& j) {
+    while (j.input_sent < j.input.size()) {
+        ssize_t n = write_no_sigpipe(j.in_fd, j.input.data() + j.input_sent,
+                                     j.input.size() - j.input_sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (n < 0) {
+            break;  // the first stage stopped reading
+        }
+        j.input_sent += n;
+    }
+    close(j.in_fd);
+    j.in_fd = -1;
+    string().swap(j.input);
+}
+
+// Reads what is there; returns false, with fd closed, at the end.
+static bool drain(int& fd, string& into) {
+    char buf[64 * 1024];
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return true;
+        }
+        if (n <= 0) {
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        into.append(buf, n);
+    }
+}
+
+void pipeline_runner::reap(job& j, size_t stage) {
+    int status;
+    if (j.finished[stage] || waitpid(j.pids[stage], &status, WNOHANG) != j.pids[stage]) {
+        return;
+    }
+    j.result.statuses[stage] = exit_code(status);
+    j.result.signals[stage] = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    j.finished[stage] = true;
+    j.left--;
+    if (j.pidfds[stage] >= 0) {
+        close(j.pidfds[stage]);
+        j.pidfds[stage] = -1;
+    }
+}
+
+void pipeline_runner::collect_threads(job& j) {
+    for (size_t t = 0; t < j.threads.size(); t++) {
+        size_t stage = j.thread_stages[t];
+        int status = j.thread_status[stage].load(std::memory_order_acquire);
+        if (j.finished[stage] || status < 0) {
+            continue;
+        }
+        j.threads[t].join();
+        j.result.err += j.thread_err[stage];
+        j.result.statuses[stage] = status;
+        j.finished[stage] = true;
+        j.left--;
+    }
+}
+
+void pipeline_runner::handle(job& j, unsigned slot) {
+    if (slot == kInputSlot) {
+        feed_input(j);
+    } else if (slot == kOutputSlot) {
+        drain(j.out_fd, j.result.out);
+    } else if (slot == kErrorSlot) {
+        drain(j.err_fd, j.result.err);
+    } else {
+        reap(j, slot - kStageSlot);
+    }
+}
+
+bool pipeline_runner::finish_if_done(uint64_t id) {
+    auto it = jobs_.find(id);
+    job& j = *it->second;
+    if (j.left > 0 || j.out_fd >= 0 || j.err_fd >= 0) {
+        return false;
+    }
+    if (j.in_fd >= 0) {
+        close(j.in_fd);
+    }
+    if (!j.result.statuses.empty()) {
+        j.result.status = j.result.statuses.back();
+    }
+    unique_ptr<job> done = std::move(it->second);
+    jobs_.erase(it);
+    // The callback may start more pipelines.
+    if (done->done) {
+        done->done(std::move(done->result));
+    }
+    return true;
+}
+
+size_t pipeline_runner::poll(int timeout_ms) {
+    vector<uint64_t> ids;
+    for (const auto& entry : jobs_) {
+        const job& j = *entry.second;
+        if (j.left == 0 && j.out_fd < 0 && j.err_fd < 0) {
+            timeout_ms = 0;
+        }
+    }
+    if (unwatched_children_) {
+        timeout_ms = timeout_ms < 0 ? 10 : std::min(timeout_ms, 10);
+    }
+    epoll_event events[64];
+    int ready = jobs_.empty() ? 0 : epoll_wait(epoll_fd_, events, 64, timeout_ms);
+    for (int e = 0; e < ready; e++) {
+        uint64_t id = events[e].data.u64 >> 16;
+        if (id == 0) {
+            uint64_t count;
+            ssize_t ignored = read(event_fd_, &count, sizeof(count));
+            (void) ignored;
+            for (auto& entry : jobs_) {
+                collect_threads(*entry.second);
+            }
+            continue;
+        }
+        auto it = jobs_.find(id);
+        if (it != jobs_.end()) {
+            handle(*it->second, events[e].data.u64 & 0xffff);
+        }
+    }
+    for (auto& entry : jobs_) {
+        job& j = *entry.second;
+        if (unwatched_children_) {
+            for (size_t i = 0; i < j.pids.size(); i++) {
+                if (j.pids[i] > 0 && j.pidfds[i] < 0) {
+                    reap(j, i);
+                }
+            }
+        }
+        ids.push_back(entry.first);
+    }
+    for (uint64_t id : ids) {
+        finish_if_done(id);
+    }
+    return jobs_.size();
+}
+
+void pipeline_runner::run() {
+    while (poll(-1) > 0) {
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Pipelines for C++ programs that link the shell's engine instead of
+// driving its read loop: stages are given as argv vectors (nothing is
+// parsed), stdin comes from a string and stdout and stderr are captured
+// into strings.
+//
+//     pipeline_runner runner;
+//     pipeline p;
+//     p.stage({"grep", "-i", "war"}).stage({"wc", "-l"}).input(text);
+//     std::future<pipeline_result> r = runner.start(p);
+//     runner.run();
+//     std::cout << r.get().out;
+//
+// A runner drives any number of pipelines from the one thread that calls
+// poll() or run(): a single epoll loop feeds their stdin, drains their
+// output and notices their stages finish, and results are handed back
+// through a callback or a future.  Stages that are builtins run on a
+// thread of their own, as in the shell, and neighbouring builtin stages
+// share a byte_ring; the others are started with posix_spawn(), which
+// doesn't copy the caller's page tables the way fork() does.
+//
+// What every stage prints on stderr is collected in pipeline_result::err:
+// the spawned stages' through a pipe, the builtin stages' through their
+// StageIO::err, added as each of them finishes.
+struct pipeline_result {
+    int status = 0;                 // the last stage's exit status
+    std::vector<int> statuses;      // each stage's; 128 + N for signal N
+    std::vector<int> signals;       // the signal that killed each stage, or 0
+    std::vector<int> spawn_errors;  // errno each stage couldn't start with, or 0
+    std::string out;                // what the last stage wrote on stdout
+    std::string err;                // what the stages wrote on stderr
+    int error = 0;                  // errno if the pipeline couldn't start
+};
+
+class pipeline {
+ public:
+    // Appends a stage; argv[0] is a builtin or a command found on PATH.
+    pipeline& stage(std::vector<std::string> argv);
+
+    // What the first stage reads; without input it reads /dev/null.
+    pipeline& input(std::string data);
+
+    const std::vector<std::vector<std::string>>& stages() const { return stages_; }
+    const std::string& input_data() const { return input_; }
+
+ private:
+    std::vector<std::vector<std::string>> stages_;
+    std::string input_;
+};
+
+class pipeline_runner {
+ public:
+    typedef std::function<void(pipeline_result&&)> callback;
+
+    pipeline_runner();
+    ~pipeline_runner();  // waits for the pipelines still running
+
+    pipeline_runner(const pipeline_runner&) = delete;
+    pipeline_runner& operator=(const pipeline_runner&) = delete;
+
+    // Starts p; done is called from poll() once every stage has finished
+    // and all output has been read.
+    void start(const pipeline& p, callback done);
+    std::future<pipeline_result> start(const pipeline& p);
+
+    // Waits up to timeout_ms (-1: no limit) for something to happen, and
+    // handles it and anything else that is ready.  Returns how many
+    // pipelines are still running.
+    size_t poll(int timeout_ms);
+
+    // Polls until no pipeline is running.
+    void run();
+
+    size_t running() const { return jobs_.size(); }
+
+    // Polls readable when poll() has something to handle, for a caller
+    // waiting on descriptors of its own as well; it then calls poll(0).
+    int fd() const { return epoll_fd_; }
+
+ private:
+    struct job;
+
+    void launch(job& j, const pipeline& p);
+    void watch(int fd, uint32_t events, uint64_t job_id, unsigned slot);
+    void handle(job& j, unsigned slot);
+    void feed_input(job& j);
+    void reap(job& j, size_t stage);
+    void collect_threads(job& j);
+    bool finish_if_done(uint64_t id);
+
+    int epoll_fd_;
+    int event_fd_;  // builtin threads signal it when they are done
+    uint64_t next_id_ = 1;
+    std::map<uint64_t, std::unique_ptr<job>> jobs_;
+    bool unwatched_children_ = false;  // some child has no pidfd
+};
+
+#endif  // PIPELINE_H_
@@ -0,0 +1,64 @@
+// Runs many pipelines at once from a single thread with pipeline_runner:
+// for every word given, `grep -i WORD | wc -l` over FILE held in memory.
+//
+//     ./pipeline_demo FILE [COPIES] [WORD]...
+
+#include <algorithm>  // for std::min()
+#include <chrono>
+#include <cstdlib>  // for atoi(), EXIT_SUCCESS, EXIT_FAILURE
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "pipeline.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        cerr << "usage: " << argv[0] << " FILE [COPIES] [WORD]..." << endl;
+        return EXIT_FAILURE;
+    }
+    std::ifstream file(argv[1]);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    string text = contents.str();
+    int copies = argc > 2 ? atoi(argv[2]) : 100;
+    vector<string> words(argv + std::min(argc, 3), argv + argc);
+    if (words.empty()) {
+        words = {"war", "peace", "prince", "moscow"};
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    pipeline_runner runner;
+    vector<long> counts(words.size(), 0);
+    int failed = 0;
+    for (int c = 0; c < copies; c++) {
+        for (size_t w = 0; w < words.size(); w++) {
+            pipeline p;
+            p.stage({"grep", "-i", words[w]}).stage({"wc", "-l"}).input(text);
+            runner.start(p, [&counts, &failed, w](pipeline_result&& r) {
+                if (r.status != 0 || r.error != 0) {
+                    failed++;
+                }
+                counts[w] += atol(r.out.c_str());
+            });
+        }
+    }
+    runner.run();
+    double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (size_t w = 0; w < words.size(); w++) {
+        cout << words[w] << ": " << counts[w] / copies << " lines" << endl;
+    }
+    cout << copies * words.size() << " pipelines in " << seconds << " s, " << failed
+         << " failed" << endl;
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,219 @@
+#include "plugins.h"
+
+#include <dlfcn.h>  // for dlopen(), dlsym()
+
+#include <cstdlib>  // for getenv(), EXIT_SUCCESS, EXIT_FAILURE
+#include <iostream>
+#include <mutex>
+
+#include "pipe_shell_plugin.h"
+
+using std::cerr;
+using std::endl;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::vector;
+
+static const size_t kInputSize = 64 * 1024;
+
+struct plugin_stage {
+    string name;
+    pipe_shell_stage_fn fn;
+    void* user_data;
+    string path;  // the plugin that registered it
+};
+
+// Stages are registered by `load` while pipelines may be looking them up
+// on other threads.
+static mutex registry_mutex;
+static vector<plugin_stage> registry;
+
+// Finds name in the registry; the caller holds registry_mutex.
+static const plugin_stage* lookup(const string& name) {
+    for (const auto& s : registry) {
+        if (s.name == name) {
+            return &s;
+        }
+    }
+    return nullptr;
+}
+
+// The host handed to a plugin's init function, and what it registered so
+// far.  Registrations only take effect once init has succeeded.
+struct plugin_load {
+    pipe_shell_host host;  // first, so the plugin's host pointer is ours
+    string path;
+    vector<plugin_stage> stages;
+    string error;
+};
+
+static int register_stage(const pipe_shell_host* host, const char* name,
+                          pipe_shell_stage_fn fn, void* user_data) {
+    plugin_load* load = reinterpret_cast<plugin_load*>(const_cast<pipe_shell_host*>(host));
+    string stage_name = name != nullptr ? name : "";
+    bool taken = is_builtin_name(stage_name);
+    for (const auto& s : load->stages) {
+        taken = taken || s.name == stage_name;
+    }
+    {
+        lock_guard<mutex> lock(registry_mutex);
+        taken = taken || lookup(stage_name) != nullptr;
+    }
+    if (stage_name.empty() || stage_name.find_first_of(" |") != string::npos || fn == nullptr) {
+        load->error = "invalid stage '" + stage_name + "'";
+        return -1;
+    }
+    if (taken) {
+        load->error = "stage '" + stage_name + "' is already defined";
+        return -1;
+    }
+    load->stages.push_back({stage_name, fn, user_data, load->path});
+    return 0;
+}
+
+bool load_plugin(const string& path, string& error) {
+    // Plugins stay loaded: their stages may be running at any time.
+    void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+        error = dlerror();
+        return false;
+    }
+    const uint32_t* version =
+        static_cast<const uint32_t*>(dlsym(handle, "pipe_shell_plugin_abi_version"));
+    pipe_shell_plugin_init_fn init =
+        reinterpret_cast<pipe_shell_plugin_init_fn>(dlsym(handle, "pipe_shell_plugin_init"));
+    if (version == nullptr || init == nullptr) {
+        error = path + ": not a pipe_shell plugin";
+        return false;
+    }
+    if (*version != PIPE_SHELL_PLUGIN_ABI_VERSION) {
+        error = path + ": built for plugin ABI version " + std::to_string(*version) +
+                ", this shell has version " + std::to_string(PIPE_SHELL_PLUGIN_ABI_VERSION);
+        return false;
+    }
+
+    plugin_load load;
+    load.host = {sizeof(pipe_shell_host), PIPE_SHELL_PLUGIN_ABI_VERSION, register_stage};
+    load.path = path;
+    if (init(&load.host) != 0) {
+        error = path + ": " + (load.error.empty() ? "initialization failed" : load.error);
+        return false;
+    }
+    lock_guard<mutex> lock(registry_mutex);
+    for (const auto& s : load.stages) {
+        if (lookup(s.name) != nullptr) {
+            error = path + ": stage '" + s.name + "' is already defined";
+            return false;
+        }
+    }
+    registry.insert(registry.end(), load.stages.begin(), load.stages.end());
+    return true;
+}
+
+void load_startup_plugins() {
+    const char* list = getenv("PIPE_SHELL_PLUGINS");
+    if (list == nullptr) {
+        return;
+    }
+    string paths = list;
+    size_t start = 0;
+    while (start <= paths.size()) {
+        size_t end = paths.find(':', start);
+        if (end == string::npos) {
+            end = paths.size();
+        }
+        string path = paths.substr(start, end - start);
+        string error;
+        if (!path.empty() && !load_plugin(path, error)) {
+            cerr << "pipe_shell: cannot load plugin: " << error << endl;
+        }
+        start = end + 1;
+    }
+}
+
+// A plugin stage while it runs: the stage's io and the buffers handed
+// to the plugin.
+struct pipe_shell_stage {
+    const StageIO* io;
+    vector<char> in;
+    vector<char> out;
+};
+
+static const char* stage_input(pipe_shell_stage* stage, size_t* len) {
+    ssize_t n = stage_read(*stage->io, stage->in.data(), stage->in.size());
+    if (n <= 0) {
+        *len = 0;
+        return nullptr;
+    }
+    *len = n;
+    return stage->in.data();
+}
+
+static char* stage_output(pipe_shell_stage* stage, size_t len) {
+    if (stage->out.size() < len) {
+        stage->out.resize(len);
+    }
+    return stage->out.data();
+}
+
+static int stage_emit(pipe_shell_stage* stage, size_t len) {
+    if (len > stage->out.size()) {
+        return -1;
+    }
+    return stage_write(*stage->io, stage->out.data(), len) ? 0 : -1;
+}
+
+static const pipe_shell_stage_ops kStageOps = {
+    sizeof(pipe_shell_stage_ops), stage_input, stage_output, stage_emit,
+};
+
+static int run_plugin_stage(const vector<string>& args, StageIO& io) {
+    plugin_stage stage;
+    {
+        lock_guard<mutex> lock(registry_mutex);
+        const plugin_stage* s = lookup(args[0]);
+        if (s == nullptr) {
+            return EXIT_FAILURE;
+        }
+        stage = *s;
+    }
+    vector<const char*> argv;
+    for (const auto& arg : args) {
+        argv.push_back(arg.c_str());
+    }
+    argv.push_back(nullptr);
+
+    pipe_shell_stage running;
+    running.io = &io;
+    running.in.resize(kInputSize);
+    return stage.fn(&running, &kStageOps, static_cast<int>(args.size()), argv.data(),
+                    stage.user_data);
+}
+
+builtin_fn find_plugin_stage(const string& name) {
+    lock_guard<mutex> lock(registry_mutex);
+    return lookup(name) != nullptr ? run_plugin_stage : nullptr;
+}
+
+int builtin_load(const vector<string>& args, StageIO& io) {
+    if (args.size() == 1) {
+        string list;
+        {
+            lock_guard<mutex> lock(registry_mutex);
+            for (const auto& s : registry) {
+                list += s.name + "\t" + s.path + "\n";
+            }
+        }
+        return stage_write(io, list.data(), list.size()) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+    for (size_t i = 1; i < args.size(); i++) {
+        string error;
+        if (!load_plugin(args[i], error)) {
+            stage_err(io) << "load: " << error << endl;
+            status = EXIT_FAILURE;
+        }
+    }
+    return status;
+}
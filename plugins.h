@@ -0,0 +1,24 @@
+#ifndef PLUGINS_H_
+#define PLUGINS_H_
+
+#include <string>
+#include <vector>
+
+#include "builtins.h"
+
+// Loads the plugin at path (see pipe_shell_plugin.h) and registers its
+// stages.  Returns false, with the reason in error, if it can't be loaded;
+// none of its stages are registered then.
+bool load_plugin(const std::string& path, std::string& error);
+
+// Loads the plugins listed, colon separated, in PIPE_SHELL_PLUGINS.
+void load_startup_plugins();
+
+// Returns the builtin that runs the plugin stage registered as name, or
+// nullptr if there is none.
+builtin_fn find_plugin_stage(const std::string& name);
+
+// load [PLUGIN]...: loads plugins, or lists the loaded stages.
+int builtin_load(const std::vector<std::string>& args, StageIO& io);
+
+#endif  // PLUGINS_H_
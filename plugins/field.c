@@ -0,0 +1,119 @@
+/*
+ * field [-d DELIM] N: prints the Nth field of every line, like
+ * awk '{ print $N }' (or cut -d DELIM -f N), as a pipe_shell plugin stage.
+ * Without -d, fields are separated by runs of blanks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../pipe_shell_plugin.h"
+
+struct field_spec {
+    long n;
+    int delim;  /* -1: runs of blanks */
+};
+
+/* Appends the nth field of [line, line+len) and a newline to out. */
+static size_t extract(const struct field_spec* spec, const char* line, size_t len, char* out) {
+    const char* p = line;
+    const char* end = line + len;
+    long field = 1;
+    if (spec->delim < 0) {
+        for (;;) {
+            while (p < end && (*p == ' ' || *p == '\t')) p++;
+            const char* start = p;
+            while (p < end && *p != ' ' && *p != '\t') p++;
+            if (start == p) break;
+            if (field++ == spec->n) {
+                memcpy(out, start, p - start);
+                out[p - start] = '\n';
+                return p - start + 1;
+            }
+        }
+        out[0] = '\n';
+        return 1;
+    }
+    const char* start = p;
+    for (;;) {
+        const char* sep = memchr(p, spec->delim, end - p);
+        const char* stop = sep ? sep : end;
+        if (field++ == spec->n) {
+            memcpy(out, start, stop - start);
+            out[stop - start] = '\n';
+            return stop - start + 1;
+        }
+        if (!sep) break;
+        p = start = sep + 1;
+    }
+    /* Like cut: a line without the delimiter is printed whole. */
+    if (memchr(line, spec->delim, len) == NULL) {
+        memcpy(out, line, len);
+        out[len] = '\n';
+        return len + 1;
+    }
+    out[0] = '\n';
+    return 1;
+}
+
+static int field(pipe_shell_stage* stage, const pipe_shell_stage_ops* ops, int argc,
+                 const char* const* argv, void* user_data) {
+    struct field_spec spec = {0, -1};
+    char* partial = NULL;  /* a line split across input pieces */
+    size_t partial_len = 0;
+    const char* in;
+    size_t len;
+    (void) user_data;
+
+    if (argc == 4 && strcmp(argv[1], "-d") == 0 && strlen(argv[2]) == 1) {
+        spec.delim = (unsigned char) argv[2][0];
+        spec.n = atol(argv[3]);
+    } else if (argc == 2) {
+        spec.n = atol(argv[1]);
+    }
+    if (spec.n < 1) {
+        return 2;
+    }
+
+    while ((in = ops->input(stage, &len)) != NULL) {
+        /* No line's output is longer than the line plus its newline. */
+        char* out = ops->output(stage, len + partial_len + 1);
+        size_t out_len = 0;
+        const char* p = in;
+        const char* end = in + len;
+        const char* nl;
+        while ((nl = memchr(p, '\n', end - p)) != NULL) {
+            if (partial_len > 0) {
+                partial = realloc(partial, partial_len + (nl - p));
+                memcpy(partial + partial_len, p, nl - p);
+                out_len += extract(&spec, partial, partial_len + (nl - p), out + out_len);
+                partial_len = 0;
+            } else {
+                out_len += extract(&spec, p, nl - p, out + out_len);
+            }
+            p = nl + 1;
+        }
+        if (p < end) {
+            partial = realloc(partial, partial_len + (end - p));
+            memcpy(partial + partial_len, p, end - p);
+            partial_len += end - p;
+        }
+        if (ops->emit(stage, out_len) != 0) {
+            free(partial);
+            return 1;
+        }
+    }
+    if (partial_len > 0) {
+        char* out = ops->output(stage, partial_len + 1);
+        size_t out_len = extract(&spec, partial, partial_len, out);
+        ops->emit(stage, out_len);
+    }
+    free(partial);
+    return 0;
+}
+
+static int init(const pipe_shell_host* host) {
+    return host->register_stage(host, "field", field, NULL);
+}
+
+PIPE_SHELL_PLUGIN(init)
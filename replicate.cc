@@ -0,0 +1,223 @@
+#include "replicate.h"
+
+#include <fcntl.h>     // for O_CLOEXEC
+#include <sys/mman.h>  // for memfd_create()
+#include <sys/wait.h>  // for waitpid()
+#include <unistd.h>    // for pipe2(), lseek(), ftruncate(), read(), pread(), close()
+
+#include <algorithm>  // for std::max()
+#include <cerrno>
+#include <cstdlib>  // for strtoul(), EXIT_SUCCESS, EXIT_FAILURE
+#include <cstring>  // for memchr(), strerror()
+#include <iostream>
+
+#include "byte_ring.h"
+#include "metrics.h"
+#include "spawn.h"
+#include "task_pool.h"
+
+using std::endl;
+using std::string;
+using std::vector;
+
+static const size_t kReadSize = 64 * 1024;
+
+// A builtin copy costs nothing to start, so its chunks only need to be
+// big enough to keep the copies busy between windows; an external one is
+// forked and exec'd for every chunk, which its chunk has to make up for.
+static const size_t kBuiltinChunk = 1 << 20;
+static const size_t kProcessChunk = 8 << 20;
+
+// Chunks are handed to the copies a window at a time, so only one window
+// of input and output is ever buffered.
+static const size_t kChunksPerCopy = 2;
+
+static const unsigned long kMaxCopies = 256;
+
+bool is_replica_count(const string& word) {
+    if (word.size() < 2 || word[0] != '&' ||
+        word.find_first_not_of("0123456789", 1) != string::npos) {
+        return false;
+    }
+    unsigned long n = strtoul(word.c_str() + 1, nullptr, 10);
+    return n >= 1 && n <= kMaxCopies;
+}
+
+bool is_replicated_stage(const vector<string>& cmd) {
+    return cmd.size() > 1 && is_replica_count(cmd[0]);
+}
+
+// Reads the stage's next chunk: the leftover carry and then input up to
+// the first line end past size bytes, or to EOF.  What was read past that
+// line end is left in carry.  Returns false once there is no input left.
+static bool next_chunk(const StageIO& io, size_t size, string& carry, bool& at_eof,
+                       string& chunk) {
+    chunk.swap(carry);
+    carry.clear();
+    bool has_newline = chunk.find('\n') != string::npos;
+    while (!at_eof && (chunk.size() < size || !has_newline)) {
+        size_t used = chunk.size();
+        chunk.resize(used + kReadSize);
+        ssize_t n = stage_read(io, &chunk[used], kReadSize);
+        chunk.resize(used + (n > 0 ? n : 0));
+        if (n <= 0) {
+            at_eof = true;
+        } else if (!has_newline) {
+            has_newline = memchr(&chunk[used], '\n', n) != nullptr;
+        }
+    }
+    if (!at_eof) {
+        size_t cut = chunk.rfind('\n') + 1;
+        carry.assign(chunk, cut, string::npos);
+        chunk.resize(cut);
+    }
+    return !chunk.empty();
+}
+
+// Runs the builtin on chunk, collecting its output in out and what it
+// prints on stderr in err.
+static int run_builtin(builtin_fn builtin, const vector<string>& cmd, const string& chunk,
+                       string& out, string& err) {
+    byte_ring ring(chunk.size());
+    ring.write(chunk.data(), chunk.size());
+    ring.close_write();
+    StageIO io = {-1, -1, &ring, nullptr, &out, &err};
+    int status = builtin(cmd, io);
+    ring.close_read();
+    return status;
+}
+
+// Makes the memfd fd, created on first use and reused after, hold data
+// from its start, positioned at its start.
+static bool fill_memfd(int& fd, const char* name, const string& data) {
+    if (fd < 0) {
+        fd = memfd_create(name, MFD_CLOEXEC);
+    }
+    return fd >= 0 && lseek(fd, 0, SEEK_SET) >= 0 && write_all(fd, data.data(), data.size()) &&
+           ftruncate(fd, data.size()) >= 0 && lseek(fd, 0, SEEK_SET) >= 0;
+}
+
+// Appends what the command wrote to the memfd fd since fill_memfd().
+static void read_memfd(int fd, string& into) {
+    off_t size = lseek(fd, 0, SEEK_CUR);
+    if (size <= 0) {
+        return;
+    }
+    size_t used = into.size();
+    into.resize(used + size);
+    ssize_t n = pread(fd, &into[used], size, 0);
+    into.resize(used + (n > 0 ? n : 0));
+}
+
+// Runs the external command on chunk, collecting its output in out.  The
+// chunk is handed over in the memfd in, so nothing has to be fed to the
+// command while its output is read.  With err set, the stage's stderr is
+// collected (see StageIO): the command's goes to the memfd err_file and
+// is read back into err once it has exited.  This runs on a pool thread,
+// hence spawn_command() rather than fork().
+static int run_process(const vector<string>& cmd, const string& chunk, int& in, int& err_file,
+                       string& out, string* err) {
+    StageIO stage = {-1, -1, nullptr, nullptr, nullptr, err};
+    if (!fill_memfd(in, "pipe_shell replica input", chunk) ||
+        (err != nullptr && !fill_memfd(err_file, "pipe_shell replica stderr", string()))) {
+        stage_err(stage) << cmd[0] << ": " << strerror(errno) << endl;
+        return EXIT_FAILURE;
+    }
+    int output[2];
+    if (pipe2(output, O_CLOEXEC) < 0) {
+        stage_err(stage) << cmd[0] << ": " << strerror(errno) << endl;
+        return EXIT_FAILURE;
+    }
+    pid_t pid;
+    int error = spawn_command(cmd, in, output[1], err != nullptr ? err_file : -1, pid);
+    close(output[1]);
+    if (error != 0) {
+        stage_err(stage) << cmd[0] << ": " << strerror(error) << endl;
+        close(output[0]);
+        return EXIT_FAILURE;
+    }
+    count_metric(metrics.forks);
+
+    while (true) {
+        size_t used = out.size();
+        out.resize(used + kReadSize);
+        ssize_t n = read(output[0], &out[used], kReadSize);
+        out.resize(used + (n > 0 ? n : 0));
+        if (n == 0 || (n < 0 && errno != EINTR)) {
+            break;
+        }
+    }
+    close(output[0]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (err != nullptr) {
+        read_memfd(err_file, *err);
+    }
+    return exit_code(status);
+}
+
+int builtin_replicate(const vector<string>& args, StageIO& io) {
+    unsigned copies = strtoul(args[0].c_str() + 1, nullptr, 10);
+    vector<string> cmd(args.begin() + 1, args.end());
+    builtin_fn builtin = find_builtin(cmd);
+    size_t chunk_size = builtin != nullptr ? kBuiltinChunk : kProcessChunk;
+
+    // A pool of the stage's own: the shared one may be busy with a builtin
+    // grep elsewhere in the pipeline, or in a copy of this one.
+    task_pool pool(copies - 1);
+    size_t window = copies * kChunksPerCopy;
+    vector<string> chunks(window);
+    vector<string> outputs(window);
+    vector<string> errors(window);
+    vector<int> statuses(window);
+    vector<int> inputs(window, -1);
+    vector<int> error_files(window, -1);
+    string carry;
+    bool at_eof = false;
+    bool writing = true;
+    bool ran = false;
+    // Like grep's: success if any copy succeeded, since a grep finding
+    // nothing in one chunk is no failure of the stage.
+    int status = -1;
+    while (writing) {
+        size_t n = 0;
+        while (n < window && next_chunk(io, chunk_size, carry, at_eof, chunks[n])) {
+            n++;
+        }
+        if (n == 0 && ran) {
+            break;
+        }
+        // No input at all is still run once, as a single copy would be.
+        n = std::max<size_t>(n, 1);
+        ran = true;
+        // What the copies print on stderr is kept with their output and
+        // goes out with it, in the order of the input.  External copies
+        // only have theirs kept when the stage's is collected anyway.
+        pool.run(n, [&](size_t i) {
+            outputs[i].clear();
+            errors[i].clear();
+            statuses[i] = builtin != nullptr
+                              ? run_builtin(builtin, cmd, chunks[i], outputs[i], errors[i])
+                              : run_process(cmd, chunks[i], inputs[i], error_files[i],
+                                            outputs[i], io.err != nullptr ? &errors[i] : nullptr);
+        });
+        for (size_t i = 0; i < n && writing; i++) {
+            if (!errors[i].empty()) {
+                stage_err(io) << errors[i] << std::flush;
+            }
+            writing = stage_write(io, outputs[i].data(), outputs[i].size());
+            if (status != EXIT_SUCCESS) {
+                status = statuses[i];
+            }
+        }
+    }
+    for (const vector<int>* fds : {&inputs, &error_files}) {
+        for (int fd : *fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+    return writing ? status : EXIT_FAILURE;
+}
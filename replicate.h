@@ -0,0 +1,30 @@
+#ifndef REPLICATE_H_
+#define REPLICATE_H_
+
+#include <string>
+#include <vector>
+
+#include "builtins.h"
+
+// Replicated stages: a stage ending in `&N`, like `grep -i war &4`, runs
+// as N copies of itself working on its input at once.  The input is cut
+// into chunks at line ends; the copies take chunks as they free up and
+// their outputs are written in the order of the input, so the stage
+// prints what a single copy would -- provided the stage treats every
+// line on its own (grep, tr, sed without ranges), which is up to the
+// user.  A builtin stage runs once per chunk on the copy's thread; an
+// external one is started once per chunk, which costs a fork and exec
+// per chunk, so its chunks are bigger.
+//
+// parse_commands() moves the `&N` to the front of the stage's words, so
+// `grep -i war &4` is the stage {"&4", "grep", "-i", "war"} and nothing
+// takes it for a grep that could be planned or fused.
+int builtin_replicate(const std::vector<std::string>& args, StageIO& io);
+
+// Whether word is a replica count, `&N` with N at least 1.
+bool is_replica_count(const std::string& word);
+
+// Whether cmd is a replicated stage.
+bool is_replicated_stage(const std::vector<std::string>& cmd);
+
+#endif  // REPLICATE_H_
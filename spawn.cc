@@ -0,0 +1,53 @@
+#include "spawn.h"
+
+#include <signal.h>    // for sigset_t
+#include <spawn.h>     // for posix_spawn()
+#include <sys/wait.h>  // for WIFEXITED()
+#include <unistd.h>    // for STDIN_FILENO
+
+#include "command_path.h"
+
+using std::string;
+using std::vector;
+
+extern char** environ;
+
+int spawn_command(const vector<string>& cmd, int in, int out, int err, pid_t& pid) {
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    int fds[] = {in, out, err};
+    for (int target = STDIN_FILENO; target <= STDERR_FILENO; target++) {
+        if (fds[target] >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, fds[target], target);
+        }
+    }
+    vector<char*> argv = exec_argv(cmd);
+    string file = find_command(cmd[0]);
+    int error = file != cmd[0]
+                    ? posix_spawn(&pid, file.c_str(), &actions, &attr, argv.data(), environ)
+                    : posix_spawnp(&pid, file.c_str(), &actions, &attr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return error;
+}
+
+vector<char*> exec_argv(const vector<string>& cmd) {
+    vector<char*> argv;
+    for (const auto& arg : cmd) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    return argv;
+}
+
+int exit_code(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
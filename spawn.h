@@ -0,0 +1,31 @@
+#ifndef SPAWN_H_
+#define SPAWN_H_
+
+#include <sys/types.h>  // for pid_t
+
+#include <string>
+#include <vector>
+
+// Starting external commands from a thread: a builtin stage that runs
+// commands of its own (xargs, a replicated stage), a coprocess, or a
+// program driving a pipeline_runner.  None of them may fork() and run code
+// in the child of a process with other threads, so these commands are
+// started with posix_spawn(), which doesn't copy the page tables either.
+// The shell's own stages are forked from its main thread (see pipe_cmds())
+// and only share the pieces below that don't start anything.
+
+// Starts cmd, cmd[0] looked up with find_command(), with in, out and err
+// as its stdin, stdout and stderr (-1 leaves one as it is).  Every signal
+// is unblocked in it and SIGPIPE is at its default, as in a forked stage.
+// Returns 0 with the child in pid, or the errno it couldn't start with.
+int spawn_command(const std::vector<std::string>& cmd, int in, int out, int err, pid_t& pid);
+
+// cmd as the NULL-terminated argv that execv() and posix_spawn() take,
+// pointing into cmd.
+std::vector<char*> exec_argv(const std::vector<std::string>& cmd);
+
+// A wait() status as the shell reports it: the exit status, or 128 + N
+// for signal N.
+int exit_code(int status);
+
+#endif  // SPAWN_H_
@@ -0,0 +1,120 @@
+#include "task_pool.h"
+
+using std::lock_guard;
+using std::mutex;
+using std::unique_lock;
+
+task_pool::task_pool(unsigned workers)
+    : body_(nullptr), generation_(0), stopping_(false), remaining_(0) {
+    for (unsigned i = 0; i <= workers; i++) {
+        queues_.emplace_back(new work_queue);
+    }
+    for (unsigned i = 1; i <= workers; i++) {
+        threads_.emplace_back(&task_pool::worker_main, this, i);
+    }
+}
+
+task_pool::~task_pool() {
+    {
+        lock_guard<mutex> lock(m_);
+        stopping_ = true;
+    }
+    start_cv_.notify_all();
+    for (auto& t : threads_) {
+        t.join();
+    }
+}
+
+void task_pool::run(size_t n, const std::function<void(size_t)>& body) {
+    lock_guard<mutex> serialize(run_mutex_);
+    if (n == 0) {
+        return;
+    }
+    if (threads_.empty() || n == 1) {
+        for (size_t i = 0; i < n; i++) {
+            body(i);
+        }
+        return;
+    }
+
+    // body_ and remaining_ are published before any index is queued, so a
+    // worker that finds an index also sees what to do with it.
+    {
+        lock_guard<mutex> lock(m_);
+        body_ = &body;
+        remaining_ = n;
+        generation_++;
+    }
+    size_t nqueues = queues_.size();
+    for (size_t q = 0; q < nqueues; q++) {
+        lock_guard<mutex> lock(queues_[q]->m);
+        for (size_t i = q * n / nqueues; i < (q + 1) * n / nqueues; i++) {
+            queues_[q]->items.push_back(i);
+        }
+    }
+    start_cv_.notify_all();
+
+    work(0);
+
+    unique_lock<mutex> lock(m_);
+    done_cv_.wait(lock, [this] { return remaining_ == 0; });
+    body_ = nullptr;
+}
+
+void task_pool::worker_main(unsigned self) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            unique_lock<mutex> lock(m_);
+            start_cv_.wait(lock, [this, seen] { return stopping_ || generation_ != seen; });
+            if (stopping_) {
+                return;
+            }
+            seen = generation_;
+        }
+        work(self);
+    }
+}
+
+void task_pool::work(unsigned self) {
+    size_t item;
+    while (pop_own(self, item) || steal(self, item)) {
+        (*body_)(item);
+        if (--remaining_ == 0) {
+            lock_guard<mutex> lock(m_);
+            done_cv_.notify_all();
+        }
+    }
+}
+
+bool task_pool::pop_own(unsigned self, size_t& item) {
+    work_queue& q = *queues_[self];
+    lock_guard<mutex> lock(q.m);
+    if (q.items.empty()) {
+        return false;
+    }
+    item = q.items.front();
+    q.items.pop_front();
+    return true;
+}
+
+// Takes from the back of a victim's slice: the owner works front to back,
+// so the two rarely contend for the same end.
+bool task_pool::steal(unsigned self, size_t& item) {
+    for (size_t k = 1; k < queues_.size(); k++) {
+        work_queue& q = *queues_[(self + k) % queues_.size()];
+        lock_guard<mutex> lock(q.m);
+        if (!q.items.empty()) {
+            item = q.items.back();
+            q.items.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+task_pool& shared_task_pool() {
+    static task_pool pool(std::thread::hardware_concurrency() > 1
+                          ? std::thread::hardware_concurrency() - 1 : 0);
+    return pool;
+}
@@ -0,0 +1,60 @@
+#ifndef TASK_POOL_H_
+#define TASK_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>  // for size_t
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads for data-parallel builtins.  run() hands
+// out the indices of a loop: each worker starts on its own contiguous
+// slice and, once that is used up, steals from the back of the others'
+// slices, so uneven tasks (chunks with many matches) don't leave cores idle.
+class task_pool {
+ public:
+    // workers is the number of threads besides the caller of run().
+    explicit task_pool(unsigned workers);
+    ~task_pool();
+
+    // Calls body(i) for every i in [0, n) and returns when all calls are
+    // done.  The calling thread works along.  One run() executes at a time;
+    // body must not call run() itself.
+    void run(size_t n, const std::function<void(size_t)>& body);
+
+    // How many threads, the caller included, work on a run().
+    unsigned concurrency() const { return static_cast<unsigned>(queues_.size()); }
+
+ private:
+    struct work_queue {
+        std::mutex m;
+        std::deque<size_t> items;
+    };
+
+    void worker_main(unsigned self);
+    void work(unsigned self);
+    bool pop_own(unsigned self, size_t& item);
+    bool steal(unsigned self, size_t& item);
+
+    std::vector<std::unique_ptr<work_queue>> queues_;  // [0] is the caller's
+    std::vector<std::thread> threads_;
+
+    std::mutex run_mutex_;  // serializes run()
+    std::mutex m_;
+    std::condition_variable start_cv_;
+    std::condition_variable done_cv_;
+    const std::function<void(size_t)>* body_;
+    uint64_t generation_;
+    bool stopping_;
+    std::atomic<size_t> remaining_;
+};
+
+// The pool shared by all builtins, one thread per core.
+task_pool& shared_task_pool();
+
+#endif  // TASK_POOL_H_
@@ -0,0 +1,154 @@
+#include "trace.h"
+
+#include <unistd.h>  // for getpid()
+
+#include <atomic>
+#include <cstdio>   // for fopen(), fprintf()
+#include <cstdlib>  // for getenv(), atexit()
+#include <ctime>    // for clock_gettime()
+#include <mutex>
+#include <vector>
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::vector;
+
+bool trace_on = false;
+
+namespace {
+
+struct trace_event {
+    const char* name;
+    const char* arg_name;  // nullptr if there is no argument
+    int64_t arg;
+    uint64_t ts;
+    uint64_t dur;
+    int track;
+    char phase;  // 'X' for a span, 'i' for an instant
+};
+
+// About 3MB; a pipeline costs a few dozen events.
+const size_t kCapacity = 64 * 1024;
+
+trace_event* events;
+std::atomic<uint64_t> next_event(0);
+
+string trace_path;
+pid_t trace_pid;  // the shell, not a child that forgot to _exit()
+mutex track_mutex;
+vector<string> track_names;
+
+void record(char phase, const char* name, int track, uint64_t ts, uint64_t dur,
+            const char* arg_name, int64_t arg) {
+    trace_event& e = events[next_event.fetch_add(1, std::memory_order_relaxed) % kCapacity];
+    e = {name, arg_name, arg, ts, dur, track, phase};
+}
+
+string json_string(const string& s) {
+    string out = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+void write_trace() {
+    if (getpid() != trace_pid) {
+        return;
+    }
+    FILE* f = fopen(trace_path.c_str(), "w");
+    if (f == nullptr) {
+        perror(trace_path.c_str());
+        return;
+    }
+    int pid = trace_pid;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+               "\"args\":{\"name\":\"pipe_shell\"}}",
+            pid);
+    {
+        lock_guard<mutex> lock(track_mutex);
+        for (size_t i = 0; i < track_names.size(); i++) {
+            fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%zu,"
+                       "\"args\":{\"name\":%s}}",
+                    pid, i, json_string(track_names[i]).c_str());
+            fprintf(f, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":%d,\"tid\":%zu,"
+                       "\"args\":{\"sort_index\":%zu}}",
+                    pid, i, i);
+        }
+    }
+    uint64_t end = next_event.load();
+    uint64_t begin = end > kCapacity ? end - kCapacity : 0;
+    for (uint64_t i = begin; i < end; i++) {
+        const trace_event& e = events[i % kCapacity];
+        fprintf(f, ",\n{\"name\":%s,\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+                json_string(e.name).c_str(), e.phase, pid, e.track, e.ts / 1000.0);
+        if (e.phase == 'X') {
+            fprintf(f, ",\"dur\":%.3f", e.dur / 1000.0);
+        } else {
+            fprintf(f, ",\"s\":\"t\"");
+        }
+        if (e.arg_name != nullptr) {
+            fprintf(f, ",\"args\":{%s:%lld}", json_string(e.arg_name).c_str(),
+                    static_cast<long long>(e.arg));
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+}  // namespace
+
+void trace_init() {
+    const char* path = getenv("PIPE_SHELL_TRACE");
+    if (path == nullptr || *path == '\0') {
+        return;
+    }
+    trace_path = path;
+    trace_pid = getpid();
+    events = new trace_event[kCapacity]();
+    track_names.push_back("shell");
+    // The shell leaves through exit() when its input ends.
+    atexit(write_trace);
+    trace_on = true;
+}
+
+uint64_t trace_now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+int trace_track(const string& name) {
+    if (!trace_enabled()) {
+        return kShellTrack;
+    }
+    lock_guard<mutex> lock(track_mutex);
+    track_names.push_back(name);
+    return static_cast<int>(track_names.size() - 1);
+}
+
+void trace_span(const char* name, int track, uint64_t start, const char* arg_name,
+                int64_t arg) {
+    if (trace_enabled()) {
+        uint64_t now = trace_now();
+        record('X', name, track, start, now - start, arg_name, arg);
+    }
+}
+
+void trace_instant(const char* name, int track, const char* arg_name, int64_t arg) {
+    if (trace_enabled()) {
+        record('i', name, track, trace_now(), 0, arg_name, arg);
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <cstdint>
+#include <string>
+
+// Where the time between pressing enter and getting the prompt back goes.
+//
+// With PIPE_SHELL_TRACE=FILE set, the shell records what it does (reading
+// and parsing the line, creating pipes, each fork, each exec and how it
+// went, each stage's run and exit, the prompt) and, when it exits, writes
+// the events to FILE as Chrome trace-event JSON, which chrome://tracing and
+// Perfetto load.  Each stage gets a track of its own; the shell's own work
+// is on the "shell" track.
+//
+// Recording an event is a timestamp and a few stores into a preallocated
+// ring (the oldest events are overwritten once it is full), so tracing
+// hardly changes the timings it measures.  Event and argument names must
+// be string literals: only the pointers are kept.
+
+extern bool trace_on;
+
+inline bool trace_enabled() {
+    return trace_on;
+}
+
+// Reads PIPE_SHELL_TRACE and, if it is set, starts recording.
+void trace_init();
+
+// Monotonic nanoseconds, the clock events are stamped with.
+uint64_t trace_now();
+
+// The track of the shell itself.
+const int kShellTrack = 0;
+
+// Makes a new track called name and returns it.
+int trace_track(const std::string& name);
+
+// Records something that took from start until now.
+void trace_span(const char* name, int track, uint64_t start, const char* arg_name = nullptr,
+                int64_t arg = 0);
+
+// Records something that happened now.
+void trace_instant(const char* name, int track, const char* arg_name = nullptr,
+                   int64_t arg = 0);
+
+// Records a span on the shell track covering its own lifetime.
+class trace_scope {
+ public:
+    explicit trace_scope(const char* name)
+        : name_(name), start_(trace_enabled() ? trace_now() : 0) {}
+    ~trace_scope() {
+        if (trace_enabled()) {
+            trace_span(name_, kShellTrack, start_);
+        }
+    }
+
+ private:
+    const char* name_;
+    uint64_t start_;
+};
+
+#endif  // TRACE_H_